@@ -10,6 +10,7 @@
 #include <drm_fourcc.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,11 +48,47 @@ struct amdgpu_priv {
 	uint64_t sdma_cmdbuf_addr;
 	uint64_t sdma_cmdbuf_size;
 	uint32_t *sdma_cmdbuf_map;
+	/* Serializes use of the SDMA command buffer; bo_map runs without the mappings lock. */
+	pthread_mutex_t sdma_lock;
+	/*
+	 * A copy whose completion was handed out as a fence. Its VA mappings are torn down and
+	 * the command buffer reused only after it has finished.
+	 */
+	bool sdma_pending;
+	uint64_t sdma_pending_seq;
+	uint32_t sdma_pending_src;
+	uint32_t sdma_pending_dst;
+	uint64_t sdma_pending_size;
+	/* GEM handle the pending copy took over, closed once the copy has retired, or 0. */
+	uint32_t sdma_pending_close;
+
+	/* GEM handle -> struct amdgpu_linear_bo_priv, for BOs not owned by DRI. */
+	void *linear_bo_table;
+	pthread_mutex_t linear_bo_lock;
+};
+
+/*
+ * Create info of a linear BO. It is fixed for the lifetime of the GEM handle, so it is captured
+ * once at create/import time rather than queried from the kernel on every map.
+ */
+struct amdgpu_linear_bo_priv {
+	uint64_t bo_size;
+	uint64_t domains;
+	uint64_t domain_flags;
+	/*
+	 * GTT buffer used as the SDMA staging copy, kept around for subsequent maps. Maps of the
+	 * same handle can run concurrently, so both fields are guarded by staging_lock.
+	 */
+	pthread_mutex_t staging_lock;
+	uint32_t staging_handle;
+	bool staging_in_use;
 };
 
 struct amdgpu_linear_vma_priv {
 	uint32_t handle;
 	uint32_t map_flags;
+	/* True if handle is the staging buffer owned by the amdgpu_linear_bo_priv. */
+	bool cached_staging;
 };
 
 const static uint32_t render_target_formats[] = {
@@ -77,6 +114,112 @@ static int query_dev_info(int fd, struct drm_amdgpu_info_device *dev_info)
 	return drmCommandWrite(fd, DRM_AMDGPU_INFO, &info_args, sizeof(info_args));
 }
 
+static struct amdgpu_linear_bo_priv *amdgpu_linear_bo_priv_get(struct driver *drv,
+							       uint32_t handle)
+{
+	struct amdgpu_priv *priv = drv->priv;
+	struct amdgpu_linear_bo_priv *bo_priv = NULL;
+
+	pthread_mutex_lock(&priv->linear_bo_lock);
+	if (drmHashLookup(priv->linear_bo_table, handle, (void **)&bo_priv))
+		bo_priv = NULL;
+	pthread_mutex_unlock(&priv->linear_bo_lock);
+
+	return bo_priv;
+}
+
+static int amdgpu_linear_bo_priv_add(struct driver *drv, uint32_t handle,
+				     const struct drm_amdgpu_gem_create_in *info)
+{
+	struct amdgpu_priv *priv = drv->priv;
+	struct amdgpu_linear_bo_priv *bo_priv;
+	int ret = 0;
+
+	pthread_mutex_lock(&priv->linear_bo_lock);
+	/* Imports of an already known buffer resolve to the same GEM handle. */
+	if (!drmHashLookup(priv->linear_bo_table, handle, (void **)&bo_priv))
+		goto out;
+
+	bo_priv = calloc(1, sizeof(*bo_priv));
+	if (!bo_priv) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	bo_priv->bo_size = info->bo_size;
+	bo_priv->domains = info->domains;
+	bo_priv->domain_flags = info->domain_flags;
+	pthread_mutex_init(&bo_priv->staging_lock, NULL);
+
+	drmHashInsert(priv->linear_bo_table, handle, bo_priv);
+out:
+	pthread_mutex_unlock(&priv->linear_bo_lock);
+	return ret;
+}
+
+static void amdgpu_linear_bo_priv_free(int fd, struct amdgpu_linear_bo_priv *bo_priv)
+{
+	if (bo_priv->staging_handle) {
+		struct drm_gem_close gem_close = { 0 };
+		gem_close.handle = bo_priv->staging_handle;
+		drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	}
+
+	pthread_mutex_destroy(&bo_priv->staging_lock);
+	free(bo_priv);
+}
+
+/* Claims the cached staging buffer of bo_priv, or returns 0 if there is none or it is in use. */
+static uint32_t amdgpu_staging_get(struct amdgpu_linear_bo_priv *bo_priv)
+{
+	uint32_t handle = 0;
+
+	pthread_mutex_lock(&bo_priv->staging_lock);
+	if (bo_priv->staging_handle && !bo_priv->staging_in_use) {
+		bo_priv->staging_in_use = true;
+		handle = bo_priv->staging_handle;
+	}
+	pthread_mutex_unlock(&bo_priv->staging_lock);
+
+	return handle;
+}
+
+/* Keeps a newly created staging buffer, in use, if bo_priv doesn't cache one yet. */
+static bool amdgpu_staging_adopt(struct amdgpu_linear_bo_priv *bo_priv, uint32_t handle)
+{
+	bool adopted = false;
+
+	pthread_mutex_lock(&bo_priv->staging_lock);
+	if (!bo_priv->staging_handle) {
+		bo_priv->staging_handle = handle;
+		bo_priv->staging_in_use = true;
+		adopted = true;
+	}
+	pthread_mutex_unlock(&bo_priv->staging_lock);
+
+	return adopted;
+}
+
+static void amdgpu_staging_put(struct amdgpu_linear_bo_priv *bo_priv)
+{
+	pthread_mutex_lock(&bo_priv->staging_lock);
+	bo_priv->staging_in_use = false;
+	pthread_mutex_unlock(&bo_priv->staging_lock);
+}
+
+static void amdgpu_linear_bo_priv_remove(struct driver *drv, uint32_t handle)
+{
+	struct amdgpu_priv *priv = drv->priv;
+	struct amdgpu_linear_bo_priv *bo_priv;
+
+	pthread_mutex_lock(&priv->linear_bo_lock);
+	if (!drmHashLookup(priv->linear_bo_table, handle, (void **)&bo_priv)) {
+		drmHashDelete(priv->linear_bo_table, handle);
+		amdgpu_linear_bo_priv_free(drv->fd, bo_priv);
+	}
+	pthread_mutex_unlock(&priv->linear_bo_lock);
+}
+
 static int sdma_init(struct amdgpu_priv *priv, int fd)
 {
 	union drm_amdgpu_ctx ctx_args = { { 0 } };
@@ -182,8 +325,86 @@ static void sdma_finish(struct amdgpu_priv *priv, int fd)
 	drmCommandWriteRead(fd, DRM_AMDGPU_CTX, &ctx_args, sizeof(ctx_args));
 }
 
+static void sdma_unmap_va(int fd, uint32_t handle, uint64_t addr)
+{
+	struct drm_amdgpu_gem_va va_args = { 0 };
+
+	va_args.handle = handle;
+	va_args.operation = AMDGPU_VA_OP_UNMAP;
+	va_args.flags = AMDGPU_VM_DELAY_UPDATE;
+	va_args.va_address = addr;
+	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+}
+
+static int sdma_wait(struct amdgpu_priv *priv, int fd, uint64_t seq)
+{
+	union drm_amdgpu_wait_cs wait_cs = { { 0 } };
+	int ret;
+
+	wait_cs.in.handle = seq;
+	wait_cs.in.ip_type = AMDGPU_HW_IP_DMA;
+	wait_cs.in.ctx_id = priv->sdma_ctx;
+	wait_cs.in.timeout = INT64_MAX;
+
+	ret = drmCommandWriteRead(fd, DRM_AMDGPU_WAIT_CS, &wait_cs, sizeof(wait_cs));
+	if (ret) {
+		drv_loge("Could not wait for CS to finish\n");
+	} else if (wait_cs.out.status) {
+		drv_loge("Infinite wait timed out, likely GPU hang.\n");
+		ret = -ENODEV;
+	}
+
+	return ret;
+}
+
+/* Assumes sdma_lock is held. */
+static void sdma_retire_pending(struct amdgpu_priv *priv, int fd)
+{
+	uint64_t src_addr = priv->sdma_cmdbuf_addr + priv->sdma_cmdbuf_size;
+
+	if (!priv->sdma_pending)
+		return;
+
+	sdma_wait(priv, fd, priv->sdma_pending_seq);
+	sdma_unmap_va(fd, priv->sdma_pending_dst, src_addr + priv->sdma_pending_size);
+	sdma_unmap_va(fd, priv->sdma_pending_src, src_addr);
+	if (priv->sdma_pending_close) {
+		struct drm_gem_close gem_close = { 0 };
+		gem_close.handle = priv->sdma_pending_close;
+		drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		priv->sdma_pending_close = 0;
+	}
+	priv->sdma_pending = false;
+}
+
+/* Returns a sync_file for the given SDMA submission in out_fence. */
+static int sdma_export_fence(struct amdgpu_priv *priv, int fd, uint64_t seq, int *out_fence)
+{
+	union drm_amdgpu_fence_to_handle fence_to_handle = { { { 0 } } };
+	int ret;
+
+	fence_to_handle.in.fence.ctx_id = priv->sdma_ctx;
+	fence_to_handle.in.fence.ip_type = AMDGPU_HW_IP_DMA;
+	fence_to_handle.in.fence.seq_no = seq;
+	fence_to_handle.in.what = AMDGPU_FENCE_TO_HANDLE_GET_SYNC_FILE_FD;
+
+	ret = drmCommandWriteRead(fd, DRM_AMDGPU_FENCE_TO_HANDLE, &fence_to_handle,
+				  sizeof(fence_to_handle));
+	if (ret)
+		return ret;
+
+	*out_fence = fence_to_handle.out.handle;
+	return 0;
+}
+
+/*
+ * Copies size bytes from src_handle to dst_handle with SDMA. If out_fence is non-NULL, it
+ * receives a sync_file for the copy instead of waiting for it, or -1 if the copy completed.
+ * A non-zero close_handle is closed once the copy has finished or failed, which for a copy
+ * left pending is only when it retires.
+ */
 static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint32_t dst_handle,
-		     uint64_t size)
+		     uint64_t size, int *out_fence, uint32_t close_handle)
 {
 	const uint64_t max_size_per_cmd = 0x3fff00;
 	const uint32_t cmd_size = 7 * sizeof(uint32_t); /* 7 dwords, see loop below. */
@@ -201,12 +422,19 @@ static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint
 	union drm_amdgpu_cs cs = { { 0 } };
 	struct drm_amdgpu_bo_list_in bo_list = { 0 };
 	struct drm_amdgpu_bo_list_entry bo_list_entries[3] = { { 0 } };
-	union drm_amdgpu_wait_cs wait_cs = { { 0 } };
 	int ret = 0;
 
+	if (out_fence)
+		*out_fence = -1;
+
 	if (size > UINT64_MAX - max_size_per_cmd ||
-	    DIV_ROUND_UP(size, max_size_per_cmd) > max_commands)
-		return -ENOMEM;
+	    DIV_ROUND_UP(size, max_size_per_cmd) > max_commands) {
+		ret = -ENOMEM;
+		goto close;
+	}
+
+	pthread_mutex_lock(&priv->sdma_lock);
+	sdma_retire_pending(priv, fd);
 
 	/* Map both buffers into the GPU address space so we can access them from the GPU. */
 	va_args.handle = src_handle;
@@ -217,7 +445,7 @@ static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint
 
 	ret = drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
 	if (ret)
-		return ret;
+		goto unlock;
 
 	va_args.handle = dst_handle;
 	va_args.flags = AMDGPU_VM_PAGE_READABLE | AMDGPU_VM_PAGE_WRITEABLE | AMDGPU_VM_DELAY_UPDATE;
@@ -282,33 +510,31 @@ static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint
 		goto unmap_dst;
 	}
 
-	wait_cs.in.handle = cs.out.handle;
-	wait_cs.in.ip_type = AMDGPU_HW_IP_DMA;
-	wait_cs.in.ctx_id = priv->sdma_ctx;
-	wait_cs.in.timeout = INT64_MAX;
-
-	ret = drmCommandWriteRead(fd, DRM_AMDGPU_WAIT_CS, &wait_cs, sizeof(wait_cs));
-	if (ret) {
-		drv_loge("Could not wait for CS to finish\n");
-	} else if (wait_cs.out.status) {
-		drv_loge("Infinite wait timed out, likely GPU hang.\n");
-		ret = -ENODEV;
+	if (out_fence && !sdma_export_fence(priv, fd, cs.out.handle, out_fence)) {
+		priv->sdma_pending = true;
+		priv->sdma_pending_seq = cs.out.handle;
+		priv->sdma_pending_src = src_handle;
+		priv->sdma_pending_dst = dst_handle;
+		priv->sdma_pending_size = size;
+		priv->sdma_pending_close = close_handle;
+		close_handle = 0;
+		goto unlock;
 	}
 
-unmap_dst:
-	va_args.handle = dst_handle;
-	va_args.operation = AMDGPU_VA_OP_UNMAP;
-	va_args.flags = AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = dst_addr;
-	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+	ret = sdma_wait(priv, fd, cs.out.handle);
 
+unmap_dst:
+	sdma_unmap_va(fd, dst_handle, dst_addr);
 unmap_src:
-	va_args.handle = src_handle;
-	va_args.operation = AMDGPU_VA_OP_UNMAP;
-	va_args.flags = AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = src_addr;
-	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
-
+	sdma_unmap_va(fd, src_handle, src_addr);
+unlock:
+	pthread_mutex_unlock(&priv->sdma_lock);
+close:
+	if (close_handle) {
+		struct drm_gem_close gem_close = { 0 };
+		gem_close.handle = close_handle;
+		drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	}
 	return ret;
 }
 
@@ -378,6 +604,16 @@ static int amdgpu_init(struct driver *drv)
 		return -ENODEV;
 	}
 
+	priv->linear_bo_table = drmHashCreate();
+	if (!priv->linear_bo_table) {
+		dri_close(drv);
+		free(priv);
+		drv->priv = NULL;
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&priv->linear_bo_lock, NULL);
+	pthread_mutex_init(&priv->sdma_lock, NULL);
+
 	/* Continue on failure, as we can still succesfully map things without SDMA. */
 	if (sdma_init(priv, drv_get_fd(drv)))
 		drv_loge("SDMA init failed\n");
@@ -452,6 +688,7 @@ static int amdgpu_init(struct driver *drv)
 			dri_query_modifiers(drv, format, mod_cnt, modifiers, &mod_cnt);
 			metadata.tiling = TILE_TYPE_DRI_MODIFIER;
 			for (int i = 0; i < mod_cnt; ++i) {
+				/* The KMS planes are only asked once a scanout buffer is. */
 				bool scanout =
 				    is_modifier_scanout_capable(drv->priv, format, modifiers[i]);
 
@@ -495,7 +732,24 @@ static int amdgpu_init(struct driver *drv)
 
 static void amdgpu_close(struct driver *drv)
 {
+	struct amdgpu_priv *priv = drv->priv;
+	struct amdgpu_linear_bo_priv *bo_priv;
+	unsigned long handle;
+
+	pthread_mutex_lock(&priv->sdma_lock);
+	sdma_retire_pending(priv, drv_get_fd(drv));
+	pthread_mutex_unlock(&priv->sdma_lock);
+
+	if (drmHashFirst(priv->linear_bo_table, &handle, (void **)&bo_priv)) {
+		do {
+			amdgpu_linear_bo_priv_free(drv_get_fd(drv), bo_priv);
+		} while (drmHashNext(priv->linear_bo_table, &handle, (void **)&bo_priv));
+	}
+	drmHashDestroy(priv->linear_bo_table);
+	pthread_mutex_destroy(&priv->linear_bo_lock);
+
 	sdma_finish(drv->priv, drv_get_fd(drv));
+	pthread_mutex_destroy(&priv->sdma_lock);
 	dri_close(drv);
 	free(drv->priv);
 	drv->priv = NULL;
@@ -564,6 +818,14 @@ static int amdgpu_create_bo_linear(struct bo *bo, uint32_t width, uint32_t heigh
 	if (ret < 0)
 		return ret;
 
+	ret = amdgpu_linear_bo_priv_add(bo->drv, gem_create.out.handle, &gem_create.in);
+	if (ret) {
+		struct drm_gem_close gem_close = { 0 };
+		gem_close.handle = gem_create.out.handle;
+		drmIoctl(drv_get_fd(bo->drv), DRM_IOCTL_GEM_CLOSE, &gem_close);
+		return ret;
+	}
+
 	for (plane = 0; plane < bo->meta.num_planes; plane++)
 		bo->handles[plane].u32 = gem_create.out.handle;
 
@@ -599,8 +861,8 @@ static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint
 }
 
 static int amdgpu_create_bo_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
-					   uint32_t format, const uint64_t *modifiers,
-					   uint32_t count)
+					   uint32_t format, uint64_t use_flags,
+					   const uint64_t *modifiers, uint32_t count)
 {
 	bool only_use_linear = true;
 
@@ -608,12 +870,52 @@ static int amdgpu_create_bo_with_modifiers(struct bo *bo, uint32_t width, uint32
 		if (modifiers[i] != DRM_FORMAT_MOD_LINEAR)
 			only_use_linear = false;
 
+	/* Frequent CPU access is far cheaper on a linear buffer than through a detiling blit. */
+	if ((use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN | BO_USE_LINEAR)) &&
+	    drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_LINEAR))
+		only_use_linear = true;
+
 	if (only_use_linear)
-		return amdgpu_create_bo_linear(bo, width, height, format, BO_USE_SCANOUT);
+		return amdgpu_create_bo_linear(bo, width, height, format,
+					       use_flags | BO_USE_SCANOUT);
 
 	return dri_bo_create_with_modifiers(bo, width, height, format, modifiers, count);
 }
 
+static int amdgpu_import_linear_bo(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+	struct drm_amdgpu_gem_create_in bo_info = { 0 };
+	struct drm_amdgpu_gem_op gem_op = { 0 };
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret)
+		return ret;
+
+	if (amdgpu_linear_bo_priv_get(bo->drv, bo->handles[0].u32))
+		return 0;
+
+	gem_op.handle = bo->handles[0].u32;
+	gem_op.op = AMDGPU_GEM_OP_GET_GEM_CREATE_INFO;
+	gem_op.value = (uintptr_t)&bo_info;
+
+	ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_OP, &gem_op, sizeof(gem_op));
+	if (ret) {
+		drv_loge("AMDGPU_GEM_OP_GET_GEM_CREATE_INFO failed with %d\n", ret);
+		goto fail;
+	}
+
+	ret = amdgpu_linear_bo_priv_add(bo->drv, bo->handles[0].u32, &bo_info);
+	if (ret)
+		goto fail;
+
+	return 0;
+
+fail:
+	drv_gem_bo_destroy(bo);
+	return ret;
+}
+
 static int amdgpu_import_bo(struct bo *bo, struct drv_import_fd_data *data)
 {
 	bool dri_tiling = data->format_modifier != DRM_FORMAT_MOD_LINEAR;
@@ -632,7 +934,7 @@ static int amdgpu_import_bo(struct bo *bo, struct drv_import_fd_data *data)
 	if (dri_tiling)
 		return dri_bo_import(bo, data);
 	else
-		return drv_prime_bo_import(bo, data);
+		return amdgpu_import_linear_bo(bo, data);
 }
 
 static int amdgpu_release_bo(struct bo *bo)
@@ -645,10 +947,19 @@ static int amdgpu_release_bo(struct bo *bo)
 
 static int amdgpu_destroy_bo(struct bo *bo)
 {
+	struct amdgpu_priv *priv = bo->drv->priv;
+
 	if (bo->priv)
 		return dri_bo_destroy(bo);
-	else
-		return drv_gem_bo_destroy(bo);
+
+	/* A write-back into this bo may still be pending; it reads the cached staging buffer. */
+	pthread_mutex_lock(&priv->sdma_lock);
+	if (priv->sdma_pending && priv->sdma_pending_dst == bo->handles[0].u32)
+		sdma_retire_pending(priv, bo->drv->fd);
+	pthread_mutex_unlock(&priv->sdma_lock);
+
+	amdgpu_linear_bo_priv_remove(bo->drv, bo->handles[0].u32);
+	return drv_gem_bo_destroy(bo);
 }
 
 static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
@@ -656,9 +967,8 @@ static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, size_t plane, uint32_
 	void *addr = MAP_FAILED;
 	int ret;
 	union drm_amdgpu_gem_mmap gem_map = { { 0 } };
-	struct drm_amdgpu_gem_create_in bo_info = { 0 };
-	struct drm_amdgpu_gem_op gem_op = { 0 };
 	uint32_t handle = bo->handles[plane].u32;
+	struct amdgpu_linear_bo_priv *bo_priv;
 	struct amdgpu_linear_vma_priv *priv = NULL;
 	struct amdgpu_priv *drv_priv;
 
@@ -666,42 +976,51 @@ static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, size_t plane, uint32_
 		return dri_bo_map(bo, vma, plane, map_flags);
 
 	drv_priv = bo->drv->priv;
-	gem_op.handle = handle;
-	gem_op.op = AMDGPU_GEM_OP_GET_GEM_CREATE_INFO;
-	gem_op.value = (uintptr_t)&bo_info;
-
-	ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_OP, &gem_op, sizeof(gem_op));
-	if (ret)
+	bo_priv = amdgpu_linear_bo_priv_get(bo->drv, handle);
+	if (!bo_priv) {
+		drv_loge("No create info for handle %u\n", handle);
 		return MAP_FAILED;
+	}
 
-	vma->length = bo_info.bo_size;
+	vma->length = bo_priv->bo_size;
 
-	if (((bo_info.domains & AMDGPU_GEM_DOMAIN_VRAM) ||
-	     (bo_info.domain_flags & AMDGPU_GEM_CREATE_CPU_GTT_USWC)) &&
+	if (((bo_priv->domains & AMDGPU_GEM_DOMAIN_VRAM) ||
+	     (bo_priv->domain_flags & AMDGPU_GEM_CREATE_CPU_GTT_USWC)) &&
 	    drv_priv->sdma_cmdbuf_map) {
-		union drm_amdgpu_gem_create gem_create = { { 0 } };
-
 		priv = calloc(1, sizeof(struct amdgpu_linear_vma_priv));
 		if (!priv)
 			return MAP_FAILED;
 
-		gem_create.in.bo_size = bo_info.bo_size;
-		gem_create.in.alignment = 4096;
-		gem_create.in.domains = AMDGPU_GEM_DOMAIN_GTT;
+		/*
+		 * Vmas of the same BO with other map flags can be mapped at once; only one of them
+		 * gets the cached staging buffer.
+		 */
+		priv->handle = amdgpu_staging_get(bo_priv);
+		priv->cached_staging = priv->handle != 0;
+		if (!priv->cached_staging) {
+			union drm_amdgpu_gem_create gem_create = { { 0 } };
+
+			gem_create.in.bo_size = bo_priv->bo_size;
+			gem_create.in.alignment = 4096;
+			gem_create.in.domains = AMDGPU_GEM_DOMAIN_GTT;
+
+			ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_CREATE, &gem_create,
+						  sizeof(gem_create));
+			if (ret < 0) {
+				drv_loge("GEM create failed\n");
+				free(priv);
+				return MAP_FAILED;
+			}
 
-		ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_CREATE, &gem_create,
-					  sizeof(gem_create));
-		if (ret < 0) {
-			drv_loge("GEM create failed\n");
-			free(priv);
-			return MAP_FAILED;
+			priv->handle = gem_create.out.handle;
+			priv->cached_staging = amdgpu_staging_adopt(bo_priv, priv->handle);
 		}
 
 		priv->map_flags = map_flags;
-		handle = priv->handle = gem_create.out.handle;
+		handle = priv->handle;
 
 		ret = sdma_copy(bo->drv->priv, bo->drv->fd, bo->handles[0].u32, priv->handle,
-				bo_info.bo_size);
+				bo_priv->bo_size, NULL, 0);
 		if (ret) {
 			drv_loge("SDMA copy for read failed\n");
 			goto fail;
@@ -725,16 +1044,23 @@ static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, size_t plane, uint32_
 
 fail:
 	if (priv) {
-		struct drm_gem_close gem_close = { 0 };
-		gem_close.handle = priv->handle;
-		drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		if (priv->cached_staging) {
+			amdgpu_staging_put(bo_priv);
+		} else {
+			struct drm_gem_close gem_close = { 0 };
+			gem_close.handle = priv->handle;
+			drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		}
 		free(priv);
 	}
 	return MAP_FAILED;
 }
 
-static int amdgpu_unmap_bo(struct bo *bo, struct vma *vma)
+static int amdgpu_unmap_bo_with_fence(struct bo *bo, struct vma *vma, int *out_fence)
 {
+	if (out_fence)
+		*out_fence = -1;
+
 	if (bo->priv) {
 		return dri_bo_unmap(bo, vma);
 	} else {
@@ -744,23 +1070,44 @@ static int amdgpu_unmap_bo(struct bo *bo, struct vma *vma)
 
 		if (vma->priv) {
 			struct amdgpu_linear_vma_priv *priv = vma->priv;
-			struct drm_gem_close gem_close = { 0 };
+			uint32_t close_handle = priv->cached_staging ? 0 : priv->handle;
 
 			if (BO_MAP_WRITE & priv->map_flags) {
+				/*
+				 * With a fence, the write-back to VRAM proceeds while the
+				 * producer moves on; the next SDMA copy retires it first. An
+				 * uncached staging buffer is closed by the copy once it retired.
+				 */
 				r = sdma_copy(bo->drv->priv, bo->drv->fd, priv->handle,
-					      bo->handles[0].u32, vma->length);
-				if (r)
-					return r;
+					      bo->handles[0].u32, vma->length, out_fence,
+					      close_handle);
+				close_handle = 0;
 			}
 
-			gem_close.handle = priv->handle;
-			r = drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+			if (priv->cached_staging) {
+				struct amdgpu_linear_bo_priv *bo_priv =
+				    amdgpu_linear_bo_priv_get(bo->drv, bo->handles[0].u32);
+				if (bo_priv)
+					amdgpu_staging_put(bo_priv);
+			} else if (close_handle) {
+				struct drm_gem_close gem_close = { 0 };
+				gem_close.handle = close_handle;
+				drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+			}
+
+			free(priv);
+			vma->priv = NULL;
 		}
 
-		return 0;
+		return r;
 	}
 }
 
+static int amdgpu_unmap_bo(struct bo *bo, struct vma *vma)
+{
+	return amdgpu_unmap_bo_with_fence(bo, vma, NULL);
+}
+
 static int amdgpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
@@ -797,6 +1144,7 @@ const struct backend backend_amdgpu = {
 	.bo_import = amdgpu_import_bo,
 	.bo_map = amdgpu_map_bo,
 	.bo_unmap = amdgpu_unmap_bo,
+	.bo_unmap_with_fence = amdgpu_unmap_bo_with_fence,
 	.bo_invalidate = amdgpu_bo_invalidate,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
 	.num_planes_from_modifier = dri_num_planes_from_modifier,
@@ -79,60 +79,60 @@ ndk::ScopedAStatus Allocator::allocate(const std::vector<uint8_t>& descriptor, i
     }
 
     BufferDescriptorInfo description;
+    struct cros_gralloc_buffer_descriptor crosDescriptor;
 
-    int ret = ::android::gralloc4::decodeBufferDescriptorInfo(descriptor, &description);
-    if (ret) {
-        ALOGE("Failed to allocate. Failed to decode buffer descriptor: %d.\n", ret);
+    int ret = mDescriptorCache.get(mDriver, descriptor.data(), descriptor.size(), &description,
+                                   &crosDescriptor);
+    if (ret == -EINVAL) {
+        ALOGE("Failed to allocate. Failed to decode buffer descriptor.\n");
         return ToBinderStatus(AllocationError::BAD_DESCRIPTOR);
     }
+    if (ret) {
+        const std::string drmFormatString = get_drm_format_string(crosDescriptor.drm_format);
+        const std::string pixelFormatString = getPixelFormatString(description.format);
+        const std::string usageString = getUsageString(description.usage);
+        ALOGE("Failed to allocate. Unsupported combination: pixel format:%s, drm format:%s, "
+              "usage:%s\n",
+              pixelFormatString.c_str(), drmFormatString.c_str(), usageString.c_str());
+        return ToBinderStatus(AllocationError::UNSUPPORTED);
+    }
+
+    std::vector<native_handle_t*> handles(count, nullptr);
+    std::vector<int32_t> strides(count, 0);
+    std::vector<ndk::ScopedAStatus> statuses(count);
 
-    std::vector<native_handle_t*> handles;
-    handles.resize(count, nullptr);
+    mWorkerPool.run(count, [&](uint32_t i) {
+        statuses[i] = allocate(crosDescriptor, &strides[i], &handles[i]);
+    });
 
     for (int32_t i = 0; i < count; i++) {
-        ndk::ScopedAStatus status = allocate(description, &outResult->stride, &handles[i]);
-        if (!status.isOk()) {
-            for (int32_t j = 0; j < i; j++) {
+        if (statuses[i].isOk()) {
+            continue;
+        }
+
+        for (int32_t j = 0; j < count; j++) {
+            if (handles[j]) {
                 releaseBufferAndHandle(handles[j]);
             }
-            return status;
         }
+        return std::move(statuses[i]);
     }
 
+    outResult->stride = count ? strides[0] : 0;
     outResult->buffers.resize(count);
     for (int32_t i = 0; i < count; i++) {
         auto handle = handles[i];
-        outResult->buffers[i] = ::android::dupToAidl(handle);
-        releaseBufferAndHandle(handle);
+        // Hand the fds over to the result instead of duplicating and then closing them.
+        mDriver->release(handle);
+        outResult->buffers[i] = ::android::makeToAidl(handle);
+        native_handle_delete(handle);
     }
 
     return ndk::ScopedAStatus::ok();
 }
 
-ndk::ScopedAStatus Allocator::allocate(const BufferDescriptorInfo& descriptor, int32_t* outStride,
-                                       native_handle_t** outHandle) {
-    if (!mDriver) {
-        ALOGE("Failed to allocate. Driver is uninitialized.\n");
-        return ToBinderStatus(AllocationError::NO_RESOURCES);
-    }
-
-    struct cros_gralloc_buffer_descriptor crosDescriptor;
-    if (convertToCrosDescriptor(descriptor, &crosDescriptor)) {
-        return ToBinderStatus(AllocationError::UNSUPPORTED);
-    }
-
-    crosDescriptor.reserved_region_size += sizeof(CrosGralloc4Metadata);
-
-    if (!mDriver->is_supported(&crosDescriptor)) {
-        const std::string drmFormatString = get_drm_format_string(crosDescriptor.drm_format);
-        const std::string pixelFormatString = getPixelFormatString(descriptor.format);
-        const std::string usageString = getUsageString(descriptor.usage);
-        ALOGE("Failed to allocate. Unsupported combination: pixel format:%s, drm format:%s, "
-              "usage:%s\n",
-              pixelFormatString.c_str(), drmFormatString.c_str(), usageString.c_str());
-        return ToBinderStatus(AllocationError::UNSUPPORTED);
-    }
-
+ndk::ScopedAStatus Allocator::allocate(const struct cros_gralloc_buffer_descriptor& crosDescriptor,
+                                       int32_t* outStride, native_handle_t** outHandle) {
     native_handle_t* handle;
     int ret = mDriver->allocate(&crosDescriptor, &handle);
     if (ret) {
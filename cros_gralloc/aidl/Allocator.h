@@ -14,6 +14,7 @@
 #include "cros_gralloc/cros_gralloc_driver.h"
 #include "cros_gralloc/cros_gralloc_helpers.h"
 #include "cros_gralloc/gralloc4/CrosGralloc4Metadata.h"
+#include "cros_gralloc/gralloc4/CrosGralloc4Utils.h"
 
 namespace aidl::android::hardware::graphics::allocator::impl {
 
@@ -30,10 +31,8 @@ class Allocator : public BnAllocator {
     ndk::SpAIBinder createBinder() override;
 
   private:
-    ndk::ScopedAStatus allocate(
-            const ::android::hardware::graphics::mapper::V4_0::IMapper::BufferDescriptorInfo&
-                    descriptor,
-            int32_t* outStride, native_handle_t** outHandle);
+    ndk::ScopedAStatus allocate(const struct cros_gralloc_buffer_descriptor& crosDescriptor,
+                                int32_t* outStride, native_handle_t** outHandle);
 
     ndk::ScopedAStatus initializeMetadata(
             cros_gralloc_handle_t crosHandle,
@@ -42,6 +41,8 @@ class Allocator : public BnAllocator {
     void releaseBufferAndHandle(native_handle_t* handle);
 
     cros_gralloc_driver* mDriver = nullptr;
+    CrosGralloc4DescriptorCache mDescriptorCache;
+    CrosGralloc4WorkerPool mWorkerPool;
 };
 
 }  // namespace aidl::android::hardware::graphics::allocator::impl
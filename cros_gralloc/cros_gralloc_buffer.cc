@@ -115,6 +115,16 @@ uint64_t cros_gralloc_buffer::get_android_usage() const
 	return static_cast<uint64_t>(hnd_->usage);
 }
 
+cros_gralloc_handle_t cros_gralloc_buffer::get_handle() const
+{
+	return hnd_;
+}
+
+bool cros_gralloc_buffer::map_is_pure_mmap() const
+{
+	return drv_bo_map_is_pure_mmap(bo_);
+}
+
 int32_t cros_gralloc_buffer::increase_refcount()
 {
 	return ++refcount_;
@@ -126,12 +136,23 @@ int32_t cros_gralloc_buffer::decrease_refcount()
 	return --refcount_;
 }
 
+static bool rect_contains(const struct rectangle *outer, const struct rectangle *inner)
+{
+	return inner->x >= outer->x && inner->y >= outer->y &&
+	       inner->x + inner->width <= outer->x + outer->width &&
+	       inner->y + inner->height <= outer->y + outer->height;
+}
+
 int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_flags,
-				  uint8_t *addr[DRV_MAX_PLANES])
+				  uint8_t *addr[DRV_MAX_PLANES],
+				  enum cros_gralloc_lock_mapping *out_mapping)
 {
 	void *vaddr = nullptr;
 
 	memset(addr, 0, DRV_MAX_PLANES * sizeof(*addr));
+	*out_mapping = CROS_GRALLOC_LOCK_MAPPING_NONE;
+
+	std::lock_guard<std::mutex> lock(mutex_);
 
 	/*
 	 * Gralloc consumers don't support more than one kernel buffer per buffer object yet, so
@@ -143,22 +164,40 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 	}
 
 	if (map_flags) {
+		struct rectangle r = *rect;
+
+		if (!r.width && !r.height && !r.x && !r.y) {
+			/*
+			 * Android IMapper.hal: An accessRegion of all-zeros means the
+			 * entire buffer.
+			 */
+			r.width = drv_bo_get_width(bo_);
+			r.height = drv_bo_get_height(bo_);
+		}
+
+		/*
+		 * A mapping retained by unlock() is reused only if it grants the requested access
+		 * and covers the requested rect, since backends may only transfer the mapped rect;
+		 * otherwise it is replaced by a new one.
+		 */
+		if (lock_data_[0] && !lockcount_) {
+			if ((lock_map_flags_ & map_flags) == map_flags &&
+			    rect_contains(&lock_data_[0]->rect, &r)) {
+				*out_mapping = CROS_GRALLOC_LOCK_MAPPING_REUSED;
+			} else {
+				drv_bo_unmap(bo_, lock_data_[0]);
+				lock_data_[0] = nullptr;
+				*out_mapping = CROS_GRALLOC_LOCK_MAPPING_REPLACED;
+			}
+		}
+
 		if (lock_data_[0]) {
-			drv_bo_invalidate(bo_, lock_data_[0]);
 			vaddr = lock_data_[0]->vma->addr;
 		} else {
-			struct rectangle r = *rect;
-
-			if (!r.width && !r.height && !r.x && !r.y) {
-				/*
-				 * Android IMapper.hal: An accessRegion of all-zeros means the
-				 * entire buffer.
-				 */
-				r.width = drv_bo_get_width(bo_);
-				r.height = drv_bo_get_height(bo_);
-			}
-
-			vaddr = drv_bo_map(bo_, &r, map_flags, &lock_data_[0], 0);
+			vaddr = drv_bo_map_unsynchronized(bo_, &r, map_flags, &lock_data_[0], 0);
+			lock_map_flags_ = map_flags;
+			if (*out_mapping == CROS_GRALLOC_LOCK_MAPPING_NONE)
+				*out_mapping = CROS_GRALLOC_LOCK_MAPPING_NEW;
 		}
 
 		if (vaddr == MAP_FAILED) {
@@ -174,20 +213,82 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 	return 0;
 }
 
-int32_t cros_gralloc_buffer::unlock()
+int32_t cros_gralloc_buffer::begin_cpu_access(bool try_only)
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	/*
+	 * Nested and concurrent locks call this too; the driver skips the invalidate while the
+	 * buffer is already CPU-owned.
+	 */
+	if (!lock_data_[0])
+		return 0;
+
+	if (try_only)
+		return drv_bo_try_begin_cpu_access(bo_, lock_data_[0]);
+
+	return drv_bo_begin_cpu_access(bo_, lock_data_[0]);
+}
+
+int32_t cros_gralloc_buffer::unlock(int32_t *release_fence, bool *out_retained)
+{
+	int32_t ret = 0;
+
+	*release_fence = -1;
+	*out_retained = false;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
 	}
 
 	if (!--lockcount_) {
-		if (lock_data_[0]) {
-			drv_bo_flush_or_unmap(bo_, lock_data_[0]);
+		if (lock_data_[0] && drv_bo_can_cache_mapping(bo_)) {
+			/* Only flush; the mapping stays around for the next lock(). */
+			ret = drv_bo_end_cpu_access(bo_, lock_data_[0], release_fence);
+			*out_retained = true;
+		} else if (lock_data_[0]) {
+			ret = drv_bo_flush_or_unmap_with_fence(bo_, lock_data_[0], release_fence);
 			lock_data_[0] = nullptr;
 		}
 	}
 
+	return ret;
+}
+
+int32_t cros_gralloc_buffer::cancel_lock()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (lockcount_ <= 0) {
+		ALOGE("Buffer was not locked.");
+		return -EINVAL;
+	}
+
+	if (!--lockcount_ && lock_data_[0]) {
+		drv_bo_unmap(bo_, lock_data_[0]);
+		lock_data_[0] = nullptr;
+	}
+
+	return 0;
+}
+
+int32_t cros_gralloc_buffer::evict_mapping()
+{
+	std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+
+	if (!lock.owns_lock())
+		return -EAGAIN;
+	if (lockcount_)
+		return -EBUSY;
+
+	if (lock_data_[0]) {
+		drv_bo_unmap(bo_, lock_data_[0]);
+		lock_data_[0] = nullptr;
+	}
+
 	return 0;
 }
 
@@ -195,11 +296,33 @@ int32_t cros_gralloc_buffer::resource_info(uint32_t strides[DRV_MAX_PLANES],
 					   uint32_t offsets[DRV_MAX_PLANES],
 					   uint64_t *format_modifier)
 {
-	return drv_resource_info(bo_, strides, offsets, format_modifier);
+	if (!resource_info_valid_.load(std::memory_order_acquire)) {
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (!resource_info_valid_.load(std::memory_order_relaxed)) {
+			memset(resource_info_strides_, 0, sizeof(resource_info_strides_));
+			memset(resource_info_offsets_, 0, sizeof(resource_info_offsets_));
+
+			int32_t ret = drv_resource_info(bo_, resource_info_strides_,
+							resource_info_offsets_,
+							&resource_info_format_modifier_);
+			if (ret)
+				return ret;
+
+			resource_info_valid_.store(true, std::memory_order_release);
+		}
+	}
+
+	memcpy(strides, resource_info_strides_, sizeof(resource_info_strides_));
+	memcpy(offsets, resource_info_offsets_, sizeof(resource_info_offsets_));
+	*format_modifier = resource_info_format_modifier_;
+	return 0;
 }
 
 int32_t cros_gralloc_buffer::invalidate()
 {
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
@@ -211,15 +334,19 @@ int32_t cros_gralloc_buffer::invalidate()
 	return 0;
 }
 
-int32_t cros_gralloc_buffer::flush()
+int32_t cros_gralloc_buffer::flush(int32_t *release_fence)
 {
+	*release_fence = -1;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
 	}
 
 	if (lock_data_[0])
-		return drv_bo_flush(bo_, lock_data_[0]);
+		return drv_bo_flush_with_fence(bo_, lock_data_[0], release_fence);
 
 	return 0;
 }
@@ -232,6 +359,8 @@ int32_t cros_gralloc_buffer::get_reserved_region(void **addr, uint64_t *size) co
 		return -EINVAL;
 	}
 
+	std::lock_guard<std::mutex> lock(mutex_);
+
 	if (!reserved_region_addr_) {
 		reserved_region_addr_ =
 		    mmap(nullptr, hnd_->reserved_region_size, PROT_WRITE | PROT_READ, MAP_SHARED,
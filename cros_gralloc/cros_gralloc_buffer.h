@@ -7,10 +7,24 @@
 #ifndef CROS_GRALLOC_BUFFER_H
 #define CROS_GRALLOC_BUFFER_H
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 
 #include "cros_gralloc_helpers.h"
 
+/* How lock() obtained its CPU mapping, used by the driver's mapping cache. */
+enum cros_gralloc_lock_mapping {
+	/* No mapping was set up: nested lock or no CPU access requested. */
+	CROS_GRALLOC_LOCK_MAPPING_NONE,
+	/* The buffer had no mapping and was mapped. */
+	CROS_GRALLOC_LOCK_MAPPING_NEW,
+	/* A mapping retained by a previous unlock() was reused. */
+	CROS_GRALLOC_LOCK_MAPPING_REUSED,
+	/* A retained mapping lacked the requested access and was replaced. */
+	CROS_GRALLOC_LOCK_MAPPING_REPLACED,
+};
+
 class cros_gralloc_buffer
 {
       public:
@@ -32,18 +46,50 @@ class cros_gralloc_buffer
 	int32_t get_android_format() const;
 	uint64_t get_android_usage() const;
 
-	/* The new reference count is returned by both these functions. */
+	/* The handle never changes after creation, so it may be read without any lock. */
+	cros_gralloc_handle_t get_handle() const;
+
+	/* Whether lock() may map the buffer before its acquire fence has signaled. */
+	bool map_is_pure_mmap() const;
+
+	/*
+	 * The new reference count is returned by both these functions. The reference count is
+	 * guarded by the owning cros_gralloc_driver table shard, not by the buffer itself.
+	 */
 	int32_t increase_refcount();
 	int32_t decrease_refcount();
 
+	/*
+	 * lock() only sets up the CPU mapping; begin_cpu_access() must follow once the acquire
+	 * fence has signaled. With |try_only|, -EAGAIN is returned instead of doing any cache
+	 * maintenance.
+	 */
 	int32_t lock(const struct rectangle *rect, uint32_t map_flags,
-		     uint8_t *addr[DRV_MAX_PLANES]);
-	int32_t unlock();
+		     uint8_t *addr[DRV_MAX_PLANES], enum cros_gralloc_lock_mapping *out_mapping);
+	int32_t begin_cpu_access(bool try_only);
+
+	/*
+	 * |out_retained| is set if the buffer is now unlocked with its CPU mapping kept for the
+	 * next lock(), in which case the caller is expected to eventually evict_mapping().
+	 */
+	int32_t unlock(int32_t *release_fence, bool *out_retained);
+
+	/*
+	 * Undoes a lock() whose CPU access never began, e.g. because the acquire fence or
+	 * begin_cpu_access() failed. Nothing is flushed; the mapping is dropped once unlocked.
+	 */
+	int32_t cancel_lock();
+
+	/*
+	 * Drops a mapping retained by unlock(). Returns -EBUSY if the buffer is locked again and
+	 * -EAGAIN if its lock was briefly held by someone else, leaving the mapping in place.
+	 */
+	int32_t evict_mapping();
 	int32_t resource_info(uint32_t strides[DRV_MAX_PLANES], uint32_t offsets[DRV_MAX_PLANES],
 			      uint64_t *format_modifier);
 
 	int32_t invalidate();
-	int32_t flush();
+	int32_t flush(int32_t *release_fence);
 
 	int32_t get_reserved_region(void **reserved_region_addr,
 				    uint64_t *reserved_region_size) const;
@@ -60,9 +106,20 @@ class cros_gralloc_buffer
 	struct cros_gralloc_handle *hnd_;
 
 	int32_t refcount_ = 1;
+
+	/* Guards the CPU access state below so that unrelated buffers never contend. */
+	mutable std::mutex mutex_;
+
 	int32_t lockcount_ = 0;
 
 	struct mapping *lock_data_[DRV_MAX_PLANES];
+	uint32_t lock_map_flags_ = 0;
+
+	/* Backend resource info, queried once and then served without taking |mutex_|. */
+	std::atomic<bool> resource_info_valid_{ false };
+	uint32_t resource_info_strides_[DRV_MAX_PLANES];
+	uint32_t resource_info_offsets_[DRV_MAX_PLANES];
+	uint64_t resource_info_format_modifier_ = 0;
 
 	/* Optional additional shared memory region attached to some gralloc buffers. */
 	mutable void *reserved_region_addr_ = nullptr;
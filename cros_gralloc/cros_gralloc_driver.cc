@@ -6,13 +6,18 @@
 
 #include "cros_gralloc_driver.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <fcntl.h>
 #include <hardware/gralloc.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <syscall.h>
+#include <unistd.h>
+#include <vector>
 #include <xf86drm.h>
 
+#include "../minigbm_helpers.h"
 #include "../util.h"
 
 // Constants taken from pipe_loader_drm.c in Mesa
@@ -72,39 +77,86 @@ cros_gralloc_driver *cros_gralloc_driver::get_instance()
 	return &s_instance;
 }
 
+static void drv_destroy_and_close(struct driver *drv)
+{
+	int fd = drv_get_fd(drv);
+	drv_destroy(drv);
+	if (fd != -1)
+		close(fd);
+}
+
 #ifndef DRV_EXTERNAL
-static struct driver *init_try_node(int idx, char const *str)
+static int init_try_node(int idx, char const *str)
 {
 	int fd;
 	char *node;
-	struct driver *drv;
 
 	if (asprintf(&node, str, DRM_DIR_NAME, idx) < 0)
-		return NULL;
+		return -1;
 
 	fd = open(node, O_RDWR, 0);
 	free(node);
 
-	if (fd < 0)
-		return NULL;
+	/*
+	 * Opening the primary node of a device without a master makes the opener master, which
+	 * would make the compositor's SetMaster fail. A dropped master stays authenticated, so
+	 * the node can still be allocated from.
+	 */
+	if (fd >= 0 && drmIsMaster(fd))
+		drmDropMaster(fd);
 
-	drv = drv_create(fd);
-	if (!drv)
-		close(fd);
+	return fd;
+}
+
+/*
+ * Hashes what drmDevicesEqual() compares, so that every process derives the same key for a
+ * device whichever of its nodes it opened.
+ */
+static uint64_t drm_device_key(drmDevicePtr device)
+{
+	uint64_t key = 0xcbf29ce484222325ULL;
+	auto mix = [&key](const void *data, size_t size) {
+		const uint8_t *bytes = static_cast<const uint8_t *>(data);
+		for (size_t i = 0; i < size; i++) {
+			key ^= bytes[i];
+			key *= 0x100000001b3ULL;
+		}
+	};
+
+	mix(&device->bustype, sizeof(device->bustype));
+	switch (device->bustype) {
+	case DRM_BUS_PCI:
+		mix(&device->businfo.pci->domain, sizeof(device->businfo.pci->domain));
+		mix(&device->businfo.pci->bus, sizeof(device->businfo.pci->bus));
+		mix(&device->businfo.pci->dev, sizeof(device->businfo.pci->dev));
+		mix(&device->businfo.pci->func, sizeof(device->businfo.pci->func));
+		break;
+	case DRM_BUS_USB:
+		mix(&device->businfo.usb->bus, sizeof(device->businfo.usb->bus));
+		mix(&device->businfo.usb->dev, sizeof(device->businfo.usb->dev));
+		break;
+	case DRM_BUS_PLATFORM:
+		mix(device->businfo.platform->fullname, strlen(device->businfo.platform->fullname));
+		break;
+	case DRM_BUS_HOST1X:
+		mix(device->businfo.host1x->fullname, strlen(device->businfo.host1x->fullname));
+		break;
+	default:
+		return 0;
+	}
 
-	return drv;
+	return key ? key : 1;
 }
 
-static struct driver *init_try_nodes()
+void cros_gralloc_driver::init_try_nodes()
 {
 	/*
-	 * Create a driver from render nodes first, then try card
-	 * nodes.
+	 * Create a driver for every device with a render node, then for the card nodes of
+	 * devices that don't have one (display controllers, vkms).
 	 *
 	 * TODO(gsingh): Enable render nodes on udl/evdi.
 	 */
 
-	struct driver *drv;
 	char const *render_nodes_fmt = "%s/renderD%d";
 	char const *card_nodes_fmt = "%s/card%d";
 	uint32_t num_nodes = DRM_NUM_NODES;
@@ -112,68 +164,247 @@ static struct driver *init_try_nodes()
 	uint32_t max_render_node = (min_render_node + num_nodes);
 	uint32_t min_card_node = DRM_CARD_NODE_START;
 	uint32_t max_card_node = (min_card_node + num_nodes);
+	std::vector<drmDevicePtr> opened;
+
+	auto try_node = [&](uint32_t idx, char const *fmt) {
+		int fd = init_try_node(idx, fmt);
+		struct driver *drv;
+		struct gbm_device_info info;
+		drmDevicePtr device = nullptr;
+		uint64_t key = 0;
+
+		if (fd < 0)
+			return;
+
+		// A device is only used through its first node, checked before a driver is created.
+		if (drmGetDevice2(fd, 0, &device) == 0) {
+			for (drmDevicePtr other : opened) {
+				if (drmDevicesEqual(device, other)) {
+					drmFreeDevice(&device);
+					close(fd);
+					return;
+				}
+			}
+			opened.push_back(device);
+			key = drm_device_key(device);
+		}
+
+		drv = drv_create(fd);
+		if (!drv) {
+			close(fd);
+			return;
+		}
+
+		if (gbm_detect_device_info(0, drv_get_fd(drv), &info))
+			info.dev_type_flags = 0;
+
+		// Devices like vgem or udl are only used if there is nothing else.
+		if ((info.dev_type_flags & GBM_DEV_TYPE_FLAG_BLOCKED) && !devices_.empty()) {
+			drv_destroy_and_close(drv);
+			return;
+		}
+
+		devices_.emplace_back(drv, info.dev_type_flags, key);
+	};
 
 	// Try render nodes...
-	for (uint32_t i = min_render_node; i < max_render_node; i++) {
-		drv = init_try_node(i, render_nodes_fmt);
-		if (drv)
-			return drv;
-	}
+	for (uint32_t i = min_render_node; i < max_render_node; i++)
+		try_node(i, render_nodes_fmt);
 
-	// Try card nodes... for vkms mostly.
-	for (uint32_t i = min_card_node; i < max_card_node; i++) {
-		drv = init_try_node(i, card_nodes_fmt);
-		if (drv)
-			return drv;
-	}
+	// Try card nodes... for vkms and display controllers mostly.
+	for (uint32_t i = min_card_node; i < max_card_node; i++)
+		try_node(i, card_nodes_fmt);
 
-	return nullptr;
+	for (drmDevicePtr device : opened)
+		drmFreeDevice(&device);
 }
 
 #else
 
-static struct driver *init_try_nodes()
+void cros_gralloc_driver::init_try_nodes()
 {
-	return drv_create(-1);
+	struct driver *drv = drv_create(-1);
+
+	if (drv)
+		devices_.emplace_back(drv, 0, 0);
 }
 
 #endif
 
-static void drv_destroy_and_close(struct driver *drv)
+cros_gralloc_driver::cros_gralloc_device::cros_gralloc_device(struct driver *drv,
+							      uint32_t dev_type_flags, uint64_t key)
+    : drv(drv, drv_destroy_and_close), dev_type_flags(dev_type_flags), key(key)
 {
-	int fd = drv_get_fd(drv);
-	drv_destroy(drv);
-	if (fd != -1)
-		close(fd);
 }
 
-cros_gralloc_driver::cros_gralloc_driver() : drv_(init_try_nodes(), drv_destroy_and_close)
+void cros_gralloc_driver::init_routing()
 {
+	if (devices_.empty())
+		return;
+
+	// A blocked device was only kept if it is the only one.
+	if (devices_.size() > 1 && (devices_[0].dev_type_flags & GBM_DEV_TYPE_FLAG_BLOCKED))
+		devices_.erase(devices_.begin());
+
+	/*
+	 * Render-only buffers go to the first device that can render. Buffers for the display,
+	 * the camera or the video codecs go to the render device too when it drives a display,
+	 * and otherwise to the first display controller, whose memory those blocks can use.
+	 */
+	render_drv_ = devices_[0].drv.get();
+	for (auto &device : devices_) {
+		if (device.dev_type_flags & GBM_DEV_TYPE_FLAG_3D) {
+			render_drv_ = device.drv.get();
+			break;
+		}
+	}
+
+	display_drv_ = render_drv_;
+	for (auto &device : devices_) {
+		if (device.drv.get() == render_drv_ &&
+		    (device.dev_type_flags & GBM_DEV_TYPE_FLAG_DISPLAY))
+			break;
+		if ((device.dev_type_flags & GBM_DEV_TYPE_FLAG_DISPLAY) &&
+		    !(device.dev_type_flags & GBM_DEV_TYPE_FLAG_3D)) {
+			display_drv_ = device.drv.get();
+			break;
+		}
+	}
+
+	resource_info_is_static_ = true;
+	for (auto &device : devices_)
+		resource_info_is_static_ &= drv_resource_info_is_static(device.drv.get());
+}
+
+cros_gralloc_driver::cros_gralloc_driver()
+{
+	const char *max_mappings = getenv("MINIGBM_MAP_CACHE_MAX_MAPPINGS");
+	const char *max_bytes = getenv("MINIGBM_MAP_CACHE_MAX_BYTES");
+
+	init_try_nodes();
+	init_routing();
+
+	if (max_mappings)
+		map_cache_max_mappings_ = strtoul(max_mappings, nullptr, 0);
+	if (max_bytes)
+		map_cache_max_bytes_ = strtoull(max_bytes, nullptr, 0);
 }
 
 cros_gralloc_driver::~cros_gralloc_driver()
 {
-	buffers_.clear();
-	handles_.clear();
+	map_cache_lru_.clear();
+	map_cache_index_.clear();
+
+	for (auto &shard : shards_) {
+		shard.released.clear();
+		shard.imported.clear();
+		shard.handles.clear();
+		shard.buffers.clear();
+	}
+
+	/* Buffers hold on to their device, so the devices go last. */
+	devices_.clear();
 }
 
 bool cros_gralloc_driver::is_initialized()
 {
-	return drv_ != nullptr;
+	return !devices_.empty();
+}
+
+uint64_t cros_gralloc_driver::get_device_key(struct driver *drv)
+{
+	for (auto &device : devices_) {
+		if (device.drv.get() == drv)
+			return device.key;
+	}
+
+	return 0;
+}
+
+struct driver *cros_gralloc_driver::get_routed_driver(uint64_t use_flags)
+{
+	if (use_flags & (BO_USE_SCANOUT | BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE |
+			 BO_USE_HW_VIDEO_DECODER | BO_USE_HW_VIDEO_ENCODER))
+		return display_drv_;
+
+	return render_drv_;
+}
+
+struct driver *
+cros_gralloc_driver::select_driver(const struct cros_gralloc_buffer_descriptor *descriptor,
+				   uint32_t *out_format, uint64_t *out_use_flags)
+{
+	struct driver *routed = get_routed_driver(descriptor->use_flags);
+
+	if (get_resolved_format_and_use_flags(routed, descriptor, out_format, out_use_flags))
+		return routed;
+
+	// Fall back to any device that supports the buffer; importers may have to copy.
+	for (auto &device : devices_) {
+		struct driver *drv = device.drv.get();
+		if (drv != routed &&
+		    get_resolved_format_and_use_flags(drv, descriptor, out_format, out_use_flags))
+			return drv;
+	}
+
+	return nullptr;
+}
+
+/* Returns the handle's device_key, or 0 if the handle ends before it. */
+static uint64_t get_handle_device_key(cros_gralloc_handle_t hnd)
+{
+	size_t needed_ints =
+	    (offsetof(struct cros_gralloc_handle, device_key) + sizeof(hnd->device_key) -
+	     sizeof(native_handle_t)) /
+	    sizeof(int);
+
+	if (static_cast<size_t>(hnd->numFds + hnd->numInts) < needed_ints)
+		return 0;
+
+	return hnd->device_key;
+}
+
+struct driver *cros_gralloc_driver::select_import_driver(cros_gralloc_handle_t hnd)
+{
+	uint64_t key = get_handle_device_key(hnd);
+	struct driver *routed;
+
+	if (key) {
+		for (auto &device : devices_) {
+			if (device.key == key)
+				return device.drv.get();
+		}
+	}
+
+	/*
+	 * The handle names no device this process has open. Mirror select_driver() with the
+	 * format and use flags the buffer was allocated with.
+	 */
+	routed = get_routed_driver(hnd->use_flags);
+	if (drv_get_combination(routed, hnd->format, hnd->use_flags))
+		return routed;
+
+	for (auto &device : devices_) {
+		struct driver *drv = device.drv.get();
+		if (drv != routed && drv_get_combination(drv, hnd->format, hnd->use_flags))
+			return drv;
+	}
+
+	return routed;
 }
 
 bool cros_gralloc_driver::get_resolved_format_and_use_flags(
-    const struct cros_gralloc_buffer_descriptor *descriptor, uint32_t *out_format,
-    uint64_t *out_use_flags)
+    struct driver *drv, const struct cros_gralloc_buffer_descriptor *descriptor,
+    uint32_t *out_format, uint64_t *out_use_flags)
 {
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
 	struct combination *combo;
 
-	drv_resolve_format_and_use_flags(drv_.get(), descriptor->drm_format, descriptor->use_flags,
+	drv_resolve_format_and_use_flags(drv, descriptor->drm_format, descriptor->use_flags,
 					 &resolved_format, &resolved_use_flags);
 
-	combo = drv_get_combination(drv_.get(), resolved_format, resolved_use_flags);
+	combo = drv_get_combination(drv, resolved_format, resolved_use_flags);
 	if (!combo && (descriptor->droid_usage & GRALLOC_USAGE_HW_VIDEO_ENCODER) &&
 	    descriptor->droid_format != HAL_PIXEL_FORMAT_YCbCr_420_888) {
 		// Unmask BO_USE_HW_VIDEO_ENCODER for other formats. They are mostly
@@ -181,12 +412,12 @@ bool cros_gralloc_driver::get_resolved_format_and_use_flags(
 		// camera). YV12 is passed to the encoder component, but it is converted
 		// to YCbCr_420_888 before being passed to the hw encoder.
 		resolved_use_flags &= ~BO_USE_HW_VIDEO_ENCODER;
-		combo = drv_get_combination(drv_.get(), resolved_format, resolved_use_flags);
+		combo = drv_get_combination(drv, resolved_format, resolved_use_flags);
 	}
 	if (!combo && (descriptor->droid_usage & BUFFER_USAGE_FRONT_RENDERING_MASK)) {
 		resolved_use_flags &= ~BO_USE_FRONT_RENDERING;
 		resolved_use_flags |= BO_USE_LINEAR;
-		combo = drv_get_combination(drv_.get(), resolved_format, resolved_use_flags);
+		combo = drv_get_combination(drv, resolved_format, resolved_use_flags);
 	}
 	if (!combo)
 		return false;
@@ -200,10 +431,12 @@ bool cros_gralloc_driver::is_supported(const struct cros_gralloc_buffer_descript
 {
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
-	uint32_t max_texture_size = drv_get_max_texture_2d_size(drv_.get());
-	if (!get_resolved_format_and_use_flags(descriptor, &resolved_format, &resolved_use_flags))
+	struct driver *drv = select_driver(descriptor, &resolved_format, &resolved_use_flags);
+	if (!drv)
 		return false;
 
+	uint32_t max_texture_size = drv_get_max_texture_2d_size(drv);
+
 	// Allow blob buffers to go beyond the limit.
 	if (descriptor->droid_format == HAL_PIXEL_FORMAT_BLOB)
 		return true;
@@ -211,6 +444,44 @@ bool cros_gralloc_driver::is_supported(const struct cros_gralloc_buffer_descript
 	return descriptor->width <= max_texture_size && descriptor->height <= max_texture_size;
 }
 
+int32_t cros_gralloc_driver::get_supported_modifiers(
+    const struct cros_gralloc_buffer_descriptor *descriptor, std::vector<uint64_t> *out_modifiers)
+{
+	uint32_t resolved_format;
+	uint64_t resolved_use_flags;
+	uint32_t count;
+	struct driver *drv = select_driver(descriptor, &resolved_format, &resolved_use_flags);
+
+	if (!drv)
+		return -EINVAL;
+
+	count = drv_get_modifiers(drv, resolved_format, resolved_use_flags, nullptr, 0);
+	out_modifiers->resize(count);
+	drv_get_modifiers(drv, resolved_format, resolved_use_flags, out_modifiers->data(), count);
+
+	return 0;
+}
+
+int32_t cros_gralloc_driver::query_layout(const struct cros_gralloc_buffer_descriptor *descriptor,
+					  uint32_t *out_format, struct drv_layout *out_layout)
+{
+	uint32_t resolved_format;
+	uint64_t resolved_use_flags;
+	struct driver *drv = select_driver(descriptor, &resolved_format, &resolved_use_flags);
+	int ret;
+
+	if (!drv)
+		return -EINVAL;
+
+	ret = drv_bo_query_layout(drv, descriptor->width, descriptor->height, resolved_format,
+				  resolved_use_flags, out_layout);
+	if (ret)
+		return ret;
+
+	*out_format = resolved_format;
+	return 0;
+}
+
 int cros_gralloc_driver::create_reserved_region(const std::string &buffer_name,
 						uint64_t reserved_region_size)
 {
@@ -239,16 +510,18 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	size_t num_ints;
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
+	struct driver *drv;
 	struct bo *bo;
 	struct cros_gralloc_handle *hnd;
-	std::unique_ptr<cros_gralloc_buffer> buffer;
+	std::shared_ptr<cros_gralloc_buffer> buffer;
 
-	if (!get_resolved_format_and_use_flags(descriptor, &resolved_format, &resolved_use_flags)) {
+	drv = select_driver(descriptor, &resolved_format, &resolved_use_flags);
+	if (!drv) {
 		ALOGE("Failed to resolve format and use_flags.");
 		return -EINVAL;
 	}
 
-	bo = drv_bo_create(drv_.get(), descriptor->width, descriptor->height, resolved_format,
+	bo = drv_bo_create(drv, descriptor->width, descriptor->height, resolved_format,
 			   resolved_use_flags);
 	if (!bo) {
 		ALOGE("Failed to create bo.");
@@ -314,6 +587,7 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	hnd->droid_format = descriptor->droid_format;
 	hnd->usage = descriptor->droid_usage;
 	hnd->total_size = descriptor->reserved_region_size + drv_bo_get_total_size(bo);
+	hnd->device_key = get_device_key(drv);
 
 	buffer = cros_gralloc_buffer::create(bo, hnd);
 	if (!buffer) {
@@ -323,14 +597,15 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	}
 
 	{
-		std::lock_guard<std::mutex> lock(mutex_);
+		auto &shard = get_shard(hnd->id);
+		std::lock_guard<std::mutex> lock(shard.mutex);
 
 		struct cros_gralloc_imported_handle_info hnd_info = {
-			.buffer = buffer.get(),
+			.buffer = buffer,
 			.refcount = 1,
 		};
-		handles_.emplace(hnd, hnd_info);
-		buffers_.emplace(hnd->id, std::move(buffer));
+		shard.handles.emplace(hnd, hnd_info);
+		shard.buffers.emplace(hnd->id, std::move(buffer));
 	}
 
 	*out_handle = hnd;
@@ -347,7 +622,8 @@ destroy_bo:
 
 int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	/* Declared before the shard lock so that evicted buffers are destroyed outside of it. */
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> evicted;
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -355,8 +631,13 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		return -EINVAL;
 	}
 
-	auto hnd_it = handles_.find(hnd);
-	if (hnd_it != handles_.end()) {
+	import_cache_trim(&evicted);
+
+	auto &shard = get_shard(hnd->id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto hnd_it = shard.handles.find(hnd);
+	if (hnd_it != shard.handles.end()) {
 		// The underlying buffer (as multiple handles can refer to the same buffer)
 		// has already been imported into this process and the given handle has
 		// already been registered in this process. Increase both the buffer and
@@ -371,55 +652,91 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 
 	uint32_t id = hnd->id;
 
-	cros_gralloc_buffer *buffer = nullptr;
+	std::shared_ptr<cros_gralloc_buffer> buffer;
 
-	auto buffer_it = buffers_.find(id);
-	if (buffer_it != buffers_.end()) {
+	auto buffer_it = shard.buffers.find(id);
+	if (buffer_it != shard.buffers.end()) {
 		// The underlying buffer (as multiple handles can refer to the same buffer)
 		// has already been imported into this process but the given handle has not
 		// yet been registered. Increase the buffer reference count (here) and start
 		// to track the handle (below).
-		buffer = buffer_it->second.get();
+		buffer = buffer_it->second;
 		buffer->increase_refcount();
 	} else {
-		// The underlying buffer has not yet been imported into this process. Import
-		// and start to track the buffer (here) and start to track the handle (below).
-		struct drv_import_fd_data data = {
-			.format_modifier = hnd->format_modifier,
-			.width = hnd->width,
-			.height = hnd->height,
-			.format = hnd->format,
-			.tiling = hnd->tiling,
-			.use_flags = hnd->use_flags,
-		};
-		memcpy(data.fds, hnd->fds, sizeof(data.fds));
-		memcpy(data.strides, hnd->strides, sizeof(data.strides));
-		memcpy(data.offsets, hnd->offsets, sizeof(data.offsets));
+		struct stat st;
+		if (fstat(hnd->fds[0], &st)) {
+			ALOGE("Failed to import: failed to stat buffer: %s.", strerror(errno));
+			return -errno;
+		}
 
-		struct bo *bo = drv_bo_import(drv_.get(), &data);
-		if (!bo)
+		auto dmabuf = std::make_pair(st.st_dev, st.st_ino);
+
+		// The underlying buffer may have been released recently and still be cached, in
+		// which case it is revived instead of imported again. A cached buffer whose id now
+		// refers to a different dma-buf is stale.
+		auto released_it = shard.released.find(id);
+		if (released_it != shard.released.end()) {
+			bool same = released_it->second.dmabuf == dmabuf;
+			auto released = import_cache_take(shard, released_it);
+			if (same)
+				buffer = std::move(released);
+			else
+				evicted.push_back(std::move(released));
+		}
+
+		if (buffer)
+			buffer->increase_refcount();
+		else
+			buffer = import_buffer(hnd);
+
+		if (!buffer)
 			return -EFAULT;
 
-		auto scoped_buffer = cros_gralloc_buffer::create(bo, hnd);
-		if (!scoped_buffer) {
-			ALOGE("Failed to import: failed to create cros_gralloc_buffer.");
-			return -1;
-		}
-		buffer = scoped_buffer.get();
-		buffers_.emplace(id, std::move(scoped_buffer));
+		shard.buffers.emplace(id, buffer);
+		shard.imported.emplace(id, dmabuf);
 	}
 
 	struct cros_gralloc_imported_handle_info hnd_info = {
 		.buffer = buffer,
 		.refcount = 1,
 	};
-	handles_.emplace(hnd, hnd_info);
+	shard.handles.emplace(hnd, hnd_info);
 	return 0;
 }
 
+std::shared_ptr<cros_gralloc_buffer> cros_gralloc_driver::import_buffer(cros_gralloc_handle_t hnd)
+{
+	// The underlying buffer has not yet been imported into this process. The handle's
+	// plane sizes are trusted after drv_bo_import() checked them against the dma-buf size.
+	struct drv_import_fd_data data = {
+		.format_modifier = hnd->format_modifier,
+		.width = hnd->width,
+		.height = hnd->height,
+		.format = hnd->format,
+		.tiling = hnd->tiling,
+		.use_flags = hnd->use_flags,
+	};
+	memcpy(data.fds, hnd->fds, sizeof(data.fds));
+	memcpy(data.strides, hnd->strides, sizeof(data.strides));
+	memcpy(data.offsets, hnd->offsets, sizeof(data.offsets));
+	memcpy(data.sizes, hnd->sizes, sizeof(data.sizes));
+
+	struct bo *bo = drv_bo_import(select_import_driver(hnd), &data);
+	if (!bo)
+		return {};
+
+	std::shared_ptr<cros_gralloc_buffer> buffer = cros_gralloc_buffer::create(bo, hnd);
+	if (!buffer)
+		ALOGE("Failed to import: failed to create cros_gralloc_buffer.");
+
+	return buffer;
+}
+
 int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> evicted;
+	std::shared_ptr<cros_gralloc_buffer> buffer;
+	bool cached = false;
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -427,77 +744,467 @@ int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 		return -EINVAL;
 	}
 
-	auto buffer = get_buffer(hnd);
-	if (!buffer) {
-		ALOGE("Invalid reference (release() called on unregistered handle).");
-		return -EINVAL;
+	{
+		auto &shard = get_shard(hnd->id);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		auto hnd_it = shard.handles.find(hnd);
+		if (hnd_it == shard.handles.end()) {
+			ALOGE("Invalid reference (release() called on unregistered handle).");
+			return -EINVAL;
+		}
+
+		buffer = hnd_it->second.buffer;
+		if (!--hnd_it->second.refcount)
+			shard.handles.erase(hnd_it);
+
+		if (buffer->decrease_refcount() == 0) {
+			shard.buffers.erase(buffer->get_id());
+			cached = import_cache_insert(shard, buffer, &evicted);
+		} else {
+			buffer.reset();
+		}
 	}
 
-	if (!--handles_[hnd].refcount)
-		handles_.erase(hnd);
+	if (buffer) {
+		map_cache_remove(buffer.get());
 
-	if (buffer->decrease_refcount() == 0) {
-		buffers_.erase(buffer->get_id());
+		/* A cached buffer keeps its bo and fds around, but not its CPU mapping. */
+		if (cached)
+			buffer->evict_mapping();
 	}
 
+	import_cache_trim(&evicted);
+
+	/*
+	 * If this was the last reference, the buffer (and its bo) is destroyed here, outside of
+	 * the shard lock, as are buffers evicted from the import cache.
+	 */
+	buffer.reset();
+	evicted.clear();
 	return 0;
 }
 
-int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
-				  bool close_acquire_fence, const struct rectangle *rect,
-				  uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
+static const auto import_cache_timeout =
+    std::chrono::milliseconds(CROS_GRALLOC_IMPORT_CACHE_TIMEOUT_MS);
+
+static int64_t steady_ns(std::chrono::steady_clock::time_point time)
 {
-	int32_t ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
-	if (ret)
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+bool cros_gralloc_driver::import_cache_insert(
+    cros_gralloc_shard &shard, const std::shared_ptr<cros_gralloc_buffer> &buffer,
+    std::vector<std::shared_ptr<cros_gralloc_buffer>> *evicted)
+{
+	/* Assumes shard.mutex is held. */
+	uint32_t id = buffer->get_id();
+
+	/* Buffers allocated by this process are not imported again by it. */
+	auto imported_it = shard.imported.find(id);
+	if (imported_it == shard.imported.end())
+		return false;
+
+	struct cros_gralloc_released_buffer released = {
+		.buffer = buffer,
+		.dmabuf = imported_it->second,
+		.release_time = std::chrono::steady_clock::now(),
+		.size = buffer->get_total_size(),
+	};
+	shard.imported.erase(imported_it);
+
+	auto released_it = shard.released.find(id);
+	if (released_it != shard.released.end())
+		evicted->push_back(import_cache_take(shard, released_it));
+
+	if (released.size > CROS_GRALLOC_IMPORT_CACHE_MAX_BYTES)
+		return false;
+
+	if (shard.released.size() >= CROS_GRALLOC_IMPORT_CACHE_SHARD_SIZE) {
+		auto oldest = shard.released.begin();
+		for (auto it = shard.released.begin(); it != shard.released.end(); ++it) {
+			if (it->second.release_time < oldest->second.release_time)
+				oldest = it;
+		}
+
+		evicted->push_back(import_cache_take(shard, oldest));
+	}
+
+	int64_t expiry = steady_ns(released.release_time + import_cache_timeout);
+	int64_t next_expiry = import_cache_next_expiry_.load();
+	while (expiry < next_expiry &&
+	       !import_cache_next_expiry_.compare_exchange_weak(next_expiry, expiry)) {
+	}
+
+	import_cache_bytes_ += released.size;
+	shard.released.emplace(id, std::move(released));
+	return true;
+}
+
+std::shared_ptr<cros_gralloc_buffer>
+cros_gralloc_driver::import_cache_take(cros_gralloc_shard &shard,
+				       cros_gralloc_released_map::iterator it)
+{
+	/* Assumes shard.mutex is held. */
+	std::shared_ptr<cros_gralloc_buffer> buffer = std::move(it->second.buffer);
+
+	import_cache_bytes_ -= it->second.size;
+	shard.released.erase(it);
+	return buffer;
+}
+
+/*
+ * Evicts released buffers that expired in any shard and, while the cache is over its byte budget,
+ * the oldest remaining ones. Takes one shard lock at a time, so callers must not hold any.
+ */
+void cros_gralloc_driver::import_cache_trim(
+    std::vector<std::shared_ptr<cros_gralloc_buffer>> *evicted)
+{
+	struct import_cache_candidate {
+		std::chrono::steady_clock::time_point release_time;
+		cros_gralloc_shard *shard;
+		uint32_t id;
+	};
+	std::vector<import_cache_candidate> candidates;
+	auto now = std::chrono::steady_clock::now();
+	auto expiry = now - import_cache_timeout;
+	int64_t next_expiry = INT64_MAX;
+
+	if (steady_ns(now) < import_cache_next_expiry_.load() &&
+	    import_cache_bytes_.load() <= CROS_GRALLOC_IMPORT_CACHE_MAX_BYTES)
+		return;
+
+	/*
+	 * Inserts that race with the walk below lower the next expiry again themselves, so
+	 * resetting it first loses none of them.
+	 */
+	import_cache_next_expiry_.store(INT64_MAX);
+
+	for (auto &shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		for (auto it = shard.released.begin(); it != shard.released.end();) {
+			auto next = std::next(it);
+
+			if (it->second.release_time <= expiry) {
+				evicted->push_back(import_cache_take(shard, it));
+			} else {
+				auto expires = it->second.release_time + import_cache_timeout;
+
+				next_expiry = std::min(next_expiry, steady_ns(expires));
+				candidates.push_back({ it->second.release_time, &shard, it->first });
+			}
+
+			it = next;
+		}
+	}
+
+	int64_t current = import_cache_next_expiry_.load();
+	while (next_expiry < current &&
+	       !import_cache_next_expiry_.compare_exchange_weak(current, next_expiry)) {
+	}
+
+	if (import_cache_bytes_.load() <= CROS_GRALLOC_IMPORT_CACHE_MAX_BYTES)
+		return;
+
+	std::sort(candidates.begin(), candidates.end(),
+		  [](const import_cache_candidate &a, const import_cache_candidate &b) {
+			  return a.release_time < b.release_time;
+		  });
+
+	for (auto &candidate : candidates) {
+		if (import_cache_bytes_.load() <= CROS_GRALLOC_IMPORT_CACHE_MAX_BYTES)
+			break;
+
+		std::lock_guard<std::mutex> lock(candidate.shard->mutex);
+
+		/* Skip entries that were revived or replaced since the walk. */
+		auto it = candidate.shard->released.find(candidate.id);
+		if (it != candidate.shard->released.end() &&
+		    it->second.release_time == candidate.release_time)
+			evicted->push_back(import_cache_take(*candidate.shard, it));
+	}
+}
+
+int32_t cros_gralloc_driver::map_buffer(const std::shared_ptr<cros_gralloc_buffer> &buffer,
+					const struct rectangle *rect, uint32_t map_flags,
+					uint8_t *addr[DRV_MAX_PLANES])
+{
+	enum cros_gralloc_lock_mapping mapping;
+	int32_t ret = buffer->lock(rect, map_flags, addr, &mapping);
+
+	switch (mapping) {
+	case CROS_GRALLOC_LOCK_MAPPING_REUSED:
+		map_cache_hits_++;
+		map_cache_remove(buffer.get());
+		break;
+	case CROS_GRALLOC_LOCK_MAPPING_REPLACED:
+		map_cache_misses_++;
+		map_cache_remove(buffer.get());
+		break;
+	case CROS_GRALLOC_LOCK_MAPPING_NEW:
+		map_cache_misses_++;
+		break;
+	case CROS_GRALLOC_LOCK_MAPPING_NONE:
+		break;
+	}
+
+	return ret;
+}
+
+int32_t cros_gralloc_driver::lock_buffer(const std::shared_ptr<cros_gralloc_buffer> &buffer,
+					 int32_t acquire_fence, bool close_acquire_fence,
+					 const struct rectangle *rect, uint32_t map_flags,
+					 uint8_t *addr[DRV_MAX_PLANES], int32_t *ready_fence)
+{
+	int32_t ret;
+
+	/*
+	 * Backends that copy or blit the contents at map time would read what the GPU has not
+	 * finished writing, so they are only mapped once the acquire fence has signaled.
+	 */
+	if (!buffer->map_is_pure_mmap()) {
+		ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
+		if (ret)
+			return ret;
+
+		ret = map_buffer(buffer, rect, map_flags, addr);
+		if (ret)
+			return ret;
+
+		ret = buffer->begin_cpu_access(/*try_only=*/false);
+		if (ret) {
+			buffer->cancel_lock();
+			return ret;
+		}
+
+		if (ready_fence)
+			*ready_fence = -1;
+
+		return 0;
+	}
+
+	/*
+	 * Otherwise set up the CPU mapping while the acquire fence is still outstanding; only the
+	 * cache maintenance in begin_cpu_access() has to wait for it.
+	 */
+	ret = map_buffer(buffer, rect, map_flags, addr);
+	if (ret) {
+		if (close_acquire_fence && acquire_fence >= 0)
+			close(acquire_fence);
 		return ret;
+	}
+
+	/*
+	 * Without cache maintenance to order after the fence, the caller can wait on the acquire
+	 * fence itself.
+	 */
+	if (ready_fence && !buffer->begin_cpu_access(/*try_only=*/true)) {
+		*ready_fence = acquire_fence;
+		if (acquire_fence >= 0 && !close_acquire_fence)
+			*ready_fence = dup(acquire_fence);
+		return 0;
+	}
 
-	std::lock_guard<std::mutex> lock(mutex_);
+	ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
+	if (!ret)
+		ret = buffer->begin_cpu_access(/*try_only=*/false);
+	if (ret) {
+		buffer->cancel_lock();
+		return ret;
+	}
+
+	if (ready_fence)
+		*ready_fence = -1;
+
+	return 0;
+}
 
+int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
+				  bool close_acquire_fence, const struct rectangle *rect,
+				  uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
+{
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
+		if (close_acquire_fence && acquire_fence >= 0)
+			close(acquire_fence);
 		return -EINVAL;
 	}
 
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
 		ALOGE("Invalid reference (lock() called on unregistered handle).");
+		if (close_acquire_fence && acquire_fence >= 0)
+			close(acquire_fence);
 		return -EINVAL;
 	}
 
-	return buffer->lock(rect, map_flags, addr);
+	return lock_buffer(buffer, acquire_fence, close_acquire_fence, rect, map_flags, addr,
+			   nullptr);
 }
 
-int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fence)
+int32_t cros_gralloc_driver::lock_async(buffer_handle_t handle, int32_t acquire_fence,
+					const struct rectangle *rect, uint32_t map_flags,
+					uint8_t *addr[DRV_MAX_PLANES], int32_t *ready_fence)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	*ready_fence = -1;
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
+		if (acquire_fence >= 0)
+			close(acquire_fence);
 		return -EINVAL;
 	}
 
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
-		ALOGE("Invalid reference (unlock() called on unregistered handle).");
+		ALOGE("Invalid reference (lock_async() called on unregistered handle).");
+		if (acquire_fence >= 0)
+			close(acquire_fence);
 		return -EINVAL;
 	}
 
+	return lock_buffer(buffer, acquire_fence, true, rect, map_flags, addr, ready_fence);
+}
+
+int32_t cros_gralloc_driver::lock_many(struct cros_gralloc_lock_request *requests,
+				       uint32_t count)
+{
+	std::vector<cros_gralloc_handle_t> hnds(count);
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> buffers(count);
+	std::vector<bool> mapped(count);
+	std::vector<int32_t> fences(count);
+	std::vector<int32_t> fence_results(count);
+	int32_t ret = 0;
+
+	for (uint32_t i = 0; i < count; i++) {
+		hnds[i] = cros_gralloc_convert_handle(requests[i].handle);
+		memset(requests[i].addr, 0, sizeof(requests[i].addr));
+		requests[i].result = 0;
+	}
+
+	get_buffers(hnds.data(), buffers.data(), count);
+
+	/*
+	 * Buffers whose mapping is a plain mmap are mapped while their acquire fences are still
+	 * outstanding. The others copy at map time and are mapped once their fence signaled.
+	 */
+	for (uint32_t i = 0; i < count; i++) {
+		if (!buffers[i]) {
+			ALOGE("Invalid reference (lock_many() called on unregistered handle).");
+			requests[i].result = -EINVAL;
+			continue;
+		}
+
+		if (buffers[i]->map_is_pure_mmap()) {
+			requests[i].result = map_buffer(buffers[i], &requests[i].rect,
+							requests[i].map_flags, requests[i].addr);
+			mapped[i] = !requests[i].result;
+		}
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+		fences[i] = requests[i].acquire_fence;
+
+	cros_gralloc_sync_wait_many(fences.data(), fence_results.data(), count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (mapped[i] && fence_results[i]) {
+			buffers[i]->cancel_lock();
+			memset(requests[i].addr, 0, sizeof(requests[i].addr));
+			mapped[i] = false;
+		}
+
+		if (!requests[i].result && fence_results[i])
+			requests[i].result = fence_results[i];
+
+		if (!requests[i].result && !mapped[i])
+			requests[i].result = map_buffer(buffers[i], &requests[i].rect,
+							requests[i].map_flags, requests[i].addr);
+
+		if (!requests[i].result) {
+			requests[i].result = buffers[i]->begin_cpu_access(/*try_only=*/false);
+			if (requests[i].result) {
+				buffers[i]->cancel_lock();
+				memset(requests[i].addr, 0, sizeof(requests[i].addr));
+			}
+		}
+
+		if (requests[i].result && !ret)
+			ret = requests[i].result;
+	}
+
+	return ret;
+}
+
+int32_t cros_gralloc_driver::unlock_many(struct cros_gralloc_unlock_request *requests,
+					 uint32_t count)
+{
+	std::vector<cros_gralloc_handle_t> hnds(count);
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> buffers(count);
+	int32_t ret = 0;
+
+	for (uint32_t i = 0; i < count; i++)
+		hnds[i] = cros_gralloc_convert_handle(requests[i].handle);
+
+	get_buffers(hnds.data(), buffers.data(), count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		requests[i].release_fence = -1;
+		if (!buffers[i]) {
+			ALOGE("Invalid reference (unlock_many() called on unregistered handle).");
+			requests[i].result = -EINVAL;
+		} else {
+			requests[i].result = unlock_buffer(buffers[i], &requests[i].release_fence);
+		}
+
+		if (!ret)
+			ret = requests[i].result;
+	}
+
+	return ret;
+}
+
+int32_t cros_gralloc_driver::unlock_buffer(const std::shared_ptr<cros_gralloc_buffer> &buffer,
+					   int32_t *release_fence)
+{
 	/*
 	 * From the ANativeWindow::dequeueBuffer documentation:
 	 *
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
+	 *
+	 * Backends that complete the flush asynchronously return a fence instead.
 	 */
-	*release_fence = -1;
-	return buffer->unlock();
+	bool retained;
+	int32_t ret = buffer->unlock(release_fence, &retained);
+	if (!ret && retained)
+		map_cache_insert(buffer);
+
+	return ret;
 }
 
-int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
+int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fence)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto hnd = cros_gralloc_convert_handle(handle);
+	if (!hnd) {
+		ALOGE("Invalid handle.");
+		return -EINVAL;
+	}
+
+	auto buffer = get_buffer(hnd);
+	if (!buffer) {
+		ALOGE("Invalid reference (unlock() called on unregistered handle).");
+		return -EINVAL;
+	}
 
+	return unlock_buffer(buffer, release_fence);
+}
+
+int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
+{
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -515,8 +1222,6 @@ int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 
 int32_t cros_gralloc_driver::flush(buffer_handle_t handle, int32_t *release_fence)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -534,28 +1239,27 @@ int32_t cros_gralloc_driver::flush(buffer_handle_t handle, int32_t *release_fenc
 	 *
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
+	 *
+	 * Backends that complete the flush asynchronously return a fence instead.
 	 */
-	*release_fence = -1;
-	return buffer->flush();
+	return buffer->flush(release_fence);
 }
 
 int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t *out_store)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
 		return -EINVAL;
 	}
 
-	auto buffer = get_buffer(hnd);
-	if (!buffer) {
+	if (!is_registered(hnd)) {
 		ALOGE("Invalid reference (get_backing_store() called on unregistered handle).");
 		return -EINVAL;
 	}
 
-	*out_store = static_cast<uint64_t>(buffer->get_id());
+	/* The buffer id is immutable and carried by the handle itself. */
+	*out_store = static_cast<uint64_t>(hnd->id);
 	return 0;
 }
 
@@ -563,14 +1267,30 @@ int32_t cros_gralloc_driver::resource_info(buffer_handle_t handle, uint32_t stri
 					   uint32_t offsets[DRV_MAX_PLANES],
 					   uint64_t *format_modifier)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
 		return -EINVAL;
 	}
 
+	/*
+	 * Unless the backend reports a layout of its own, resource info is exactly what the
+	 * handle was allocated with and needs no buffer lookup.
+	 */
+	if (resource_info_is_static_) {
+		if (!is_registered(hnd)) {
+			ALOGE("Invalid reference (resource_info() called on unregistered handle).");
+			return -EINVAL;
+		}
+
+		for (uint32_t plane = 0; plane < hnd->num_planes; plane++) {
+			strides[plane] = hnd->strides[plane];
+			offsets[plane] = hnd->offsets[plane];
+		}
+		*format_modifier = hnd->format_modifier;
+		return 0;
+	}
+
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
 		ALOGE("Invalid reference (resource_info() called on unregistered handle).");
@@ -584,8 +1304,6 @@ int32_t cros_gralloc_driver::get_reserved_region(buffer_handle_t handle,
 						 void **reserved_region_addr,
 						 uint64_t *reserved_region_size)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
 		ALOGE("Invalid handle.");
@@ -606,40 +1324,180 @@ uint32_t cros_gralloc_driver::get_resolved_drm_format(uint32_t drm_format, uint6
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
 
-	drv_resolve_format_and_use_flags(drv_.get(), drm_format, use_flags, &resolved_format,
-					 &resolved_use_flags);
+	drv_resolve_format_and_use_flags(get_routed_driver(use_flags), drm_format, use_flags,
+					 &resolved_format, &resolved_use_flags);
 
 	return resolved_format;
 }
 
-cros_gralloc_buffer *cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
+cros_gralloc_driver::cros_gralloc_shard &cros_gralloc_driver::get_shard(uint32_t id)
+{
+	return shards_[id % CROS_GRALLOC_NUM_SHARDS];
+}
+
+std::shared_ptr<cros_gralloc_buffer> cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
 {
-	/* Assumes driver mutex is held. */
-	if (handles_.count(hnd))
-		return handles_[hnd].buffer;
+	auto &shard = get_shard(hnd->id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto hnd_it = shard.handles.find(hnd);
+	if (hnd_it != shard.handles.end())
+		return hnd_it->second.buffer;
 
 	return nullptr;
 }
 
+bool cros_gralloc_driver::is_registered(cros_gralloc_handle_t hnd)
+{
+	auto &shard = get_shard(hnd->id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	return shard.handles.count(hnd) != 0;
+}
+
+void cros_gralloc_driver::get_buffers(const cros_gralloc_handle_t *hnds,
+				      std::shared_ptr<cros_gralloc_buffer> *buffers, uint32_t count)
+{
+	std::array<bool, CROS_GRALLOC_NUM_SHARDS> used = {};
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (hnds[i])
+			used[hnds[i]->id % CROS_GRALLOC_NUM_SHARDS] = true;
+	}
+
+	/* Each shard is locked once for the whole batch. */
+	for (uint32_t s = 0; s < CROS_GRALLOC_NUM_SHARDS; s++) {
+		if (!used[s])
+			continue;
+
+		std::lock_guard<std::mutex> lock(shards_[s].mutex);
+		for (uint32_t i = 0; i < count; i++) {
+			if (!hnds[i] || hnds[i]->id % CROS_GRALLOC_NUM_SHARDS != s)
+				continue;
+
+			auto hnd_it = shards_[s].handles.find(hnds[i]);
+			if (hnd_it != shards_[s].handles.end())
+				buffers[i] = hnd_it->second.buffer;
+		}
+	}
+}
+
 void cros_gralloc_driver::with_buffer(cros_gralloc_handle_t hnd,
 				      const std::function<void(cros_gralloc_buffer *)> &function)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
-
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
 		ALOGE("Invalid reference (with_buffer() called on unregistered handle).");
 		return;
 	}
 
-	function(buffer);
+	function(buffer.get());
 }
 
 void cros_gralloc_driver::with_each_buffer(
     const std::function<void(cros_gralloc_buffer *)> &function)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> buffers;
+
+	for (auto &shard : shards_) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		for (const auto &pair : shard.buffers)
+			buffers.push_back(pair.second);
+	}
+
+	for (const auto &buffer : buffers)
+		function(buffer.get());
+}
+
+void cros_gralloc_driver::map_cache_insert(const std::shared_ptr<cros_gralloc_buffer> &buffer)
+{
+	std::vector<std::shared_ptr<cros_gralloc_buffer>> victims;
 
-	for (const auto &pair : buffers_)
-		function(pair.second.get());
+	{
+		std::lock_guard<std::mutex> lock(map_cache_mutex_);
+
+		auto it = map_cache_index_.find(buffer.get());
+		if (it != map_cache_index_.end())
+			map_cache_lru_.splice(map_cache_lru_.end(), map_cache_lru_, it->second);
+		else
+			map_cache_push(buffer);
+
+		map_cache_evict(&victims);
+	}
+
+	/* Unmapping may write back through the backend, so it runs without the cache lock. */
+	for (const auto &victim : victims) {
+		int32_t ret = victim->evict_mapping();
+		if (!ret) {
+			map_cache_evictions_++;
+		} else if (ret == -EAGAIN) {
+			/*
+			 * Someone briefly held the buffer lock. The mapping is still there, so it
+			 * has to stay accounted for until a later eviction gets to it.
+			 */
+			std::lock_guard<std::mutex> lock(map_cache_mutex_);
+			if (!map_cache_index_.count(victim.get()))
+				map_cache_push(victim);
+		}
+	}
+}
+
+void cros_gralloc_driver::map_cache_push(const std::shared_ptr<cros_gralloc_buffer> &buffer)
+{
+	/* Assumes map_cache_mutex_ is held. */
+	struct cros_gralloc_map_cache_entry entry = { buffer, buffer.get(),
+						       buffer->get_total_size() };
+	map_cache_lru_.push_back(entry);
+	map_cache_index_.emplace(buffer.get(), std::prev(map_cache_lru_.end()));
+	map_cache_bytes_ += entry.size;
+}
+
+void cros_gralloc_driver::map_cache_remove(const cros_gralloc_buffer *buffer)
+{
+	std::lock_guard<std::mutex> lock(map_cache_mutex_);
+
+	auto it = map_cache_index_.find(buffer);
+	if (it == map_cache_index_.end())
+		return;
+
+	map_cache_bytes_ -= it->second->size;
+	map_cache_lru_.erase(it->second);
+	map_cache_index_.erase(it);
+}
+
+void cros_gralloc_driver::map_cache_evict(
+    std::vector<std::shared_ptr<cros_gralloc_buffer>> *victims)
+{
+	/* Assumes map_cache_mutex_ is held. */
+	while (!map_cache_lru_.empty() && (map_cache_lru_.size() > map_cache_max_mappings_ ||
+					   map_cache_bytes_ > map_cache_max_bytes_)) {
+		auto entry = map_cache_lru_.front();
+
+		map_cache_bytes_ -= entry.size;
+		map_cache_index_.erase(entry.key);
+		map_cache_lru_.pop_front();
+
+		/*
+		 * A buffer that is locked again no longer holds an idle mapping; its next
+		 * unlock() re-inserts it.
+		 */
+		auto buffer = entry.buffer.lock();
+		if (buffer)
+			victims->push_back(std::move(buffer));
+	}
+}
+
+void cros_gralloc_driver::get_map_cache_stats(struct cros_gralloc_map_cache_stats *stats)
+{
+	std::lock_guard<std::mutex> lock(map_cache_mutex_);
+
+	stats->hits = map_cache_hits_;
+	stats->misses = map_cache_misses_;
+	stats->evictions = map_cache_evictions_;
+	stats->num_mappings = map_cache_lru_.size();
+	stats->num_bytes = map_cache_bytes_;
+	stats->hit_rate = (stats->hits + stats->misses)
+			      ? static_cast<double>(stats->hits) / (stats->hits + stats->misses)
+			      : 0;
 }
@@ -9,23 +9,89 @@
 
 #include "cros_gralloc_buffer.h"
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <sys/types.h>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #if ANDROID_API_LEVEL >= 31 && defined(HAS_DMABUF_SYSTEM_HEAP)
 #include <BufferAllocator/BufferAllocator.h>
 #endif
 
+/* Number of independently locked partitions of the buffer and handle tables. */
+#define CROS_GRALLOC_NUM_SHARDS 16
+
+/*
+ * Default budget for CPU mappings kept alive between unlock() and the next lock(). 32-bit
+ * processes get a smaller address space budget. Both can be overridden with the
+ * MINIGBM_MAP_CACHE_MAX_MAPPINGS and MINIGBM_MAP_CACHE_MAX_BYTES environment variables.
+ */
+#define CROS_GRALLOC_MAP_CACHE_MAX_MAPPINGS 64
+#define CROS_GRALLOC_MAP_CACHE_MAX_BYTES (sizeof(void *) == 4 ? (128ULL << 20) : (1ULL << 30))
+
+/*
+ * Imported buffers whose last handle was released stay imported for up to
+ * CROS_GRALLOC_IMPORT_CACHE_TIMEOUT_MS, at most CROS_GRALLOC_IMPORT_CACHE_SHARD_SIZE of them per
+ * shard and CROS_GRALLOC_IMPORT_CACHE_MAX_BYTES in total, so that importing the same buffer
+ * again shortly after is a table lookup.
+ */
+#define CROS_GRALLOC_IMPORT_CACHE_SHARD_SIZE 4
+#define CROS_GRALLOC_IMPORT_CACHE_TIMEOUT_MS 1000
+#define CROS_GRALLOC_IMPORT_CACHE_MAX_BYTES (sizeof(void *) == 4 ? (32ULL << 20) : (128ULL << 20))
+
+struct cros_gralloc_map_cache_stats {
+	/* Locks served by a retained mapping vs. locks that had to map the buffer. */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	/* Mappings currently retained by unlocked buffers. */
+	uint32_t num_mappings;
+	uint64_t num_bytes;
+	/* hits / (hits + misses), or 0 before the first lock. */
+	double hit_rate;
+};
+
+/* One buffer of a lock_many() batch; |addr| and |result| are outputs. */
+struct cros_gralloc_lock_request {
+	buffer_handle_t handle;
+	/* Always consumed by lock_many(). */
+	int32_t acquire_fence;
+	struct rectangle rect;
+	uint32_t map_flags;
+	uint8_t *addr[DRV_MAX_PLANES];
+	int32_t result;
+};
+
+/* One buffer of an unlock_many() batch; |release_fence| and |result| are outputs. */
+struct cros_gralloc_unlock_request {
+	buffer_handle_t handle;
+	int32_t release_fence;
+	int32_t result;
+};
+
 class cros_gralloc_driver
 {
       public:
 	static cros_gralloc_driver *get_instance();
 	bool is_supported(const struct cros_gralloc_buffer_descriptor *descriptor);
+	int32_t get_supported_modifiers(const struct cros_gralloc_buffer_descriptor *descriptor,
+					std::vector<uint64_t> *out_modifiers);
 	int32_t allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
 			 native_handle_t **out_handle);
+	/*
+	 * Returns the DRM format and layout allocate() would give a buffer, without allocating
+	 * one on backends that can compute layouts. The reserved region is not included.
+	 */
+	int32_t query_layout(const struct cros_gralloc_buffer_descriptor *descriptor,
+			     uint32_t *out_format, struct drv_layout *out_layout);
 
 	int32_t retain(buffer_handle_t handle);
 	int32_t release(buffer_handle_t handle);
@@ -33,11 +99,33 @@ class cros_gralloc_driver
 	int32_t lock(buffer_handle_t handle, int32_t acquire_fence, bool close_acquire_fence,
 		     const struct rectangle *rect, uint32_t map_flags,
 		     uint8_t *addr[DRV_MAX_PLANES]);
+	/*
+	 * Like lock(), but doesn't block on |acquire_fence| (which is always consumed). The CPU
+	 * may access the buffer once |ready_fence| has signaled; -1 means immediately.
+	 */
+	int32_t lock_async(buffer_handle_t handle, int32_t acquire_fence,
+			   const struct rectangle *rect, uint32_t map_flags,
+			   uint8_t *addr[DRV_MAX_PLANES], int32_t *ready_fence);
 	int32_t unlock(buffer_handle_t handle, int32_t *release_fence);
 
+	/*
+	 * Lock or unlock several buffers at once: handles are resolved in one pass over the
+	 * buffer tables and all acquire fences are waited on together. Per-buffer results are
+	 * stored in the requests; the first error is returned.
+	 */
+	int32_t lock_many(struct cros_gralloc_lock_request *requests, uint32_t count);
+	int32_t unlock_many(struct cros_gralloc_unlock_request *requests, uint32_t count);
+
 	int32_t invalidate(buffer_handle_t handle);
 	int32_t flush(buffer_handle_t handle, int32_t *release_fence);
 
+	/*
+	 * Whether |hnd| was registered with retain() or allocate() and not released yet. Only
+	 * takes the shard lock for one table lookup, so callers that answer from the handle
+	 * itself can still reject unregistered handles cheaply.
+	 */
+	bool is_registered(cros_gralloc_handle_t hnd);
+
 	int32_t get_backing_store(buffer_handle_t handle, uint64_t *out_store);
 	int32_t resource_info(buffer_handle_t handle, uint32_t strides[DRV_MAX_PLANES],
 			      uint32_t offsets[DRV_MAX_PLANES], uint64_t *format_modifier);
@@ -51,14 +139,29 @@ class cros_gralloc_driver
 			 const std::function<void(cros_gralloc_buffer *)> &function);
 	void with_each_buffer(const std::function<void(cros_gralloc_buffer *)> &function);
 
+	void get_map_cache_stats(struct cros_gralloc_map_cache_stats *stats);
+
       private:
 	cros_gralloc_driver();
 	~cros_gralloc_driver();
 	bool is_initialized();
-	cros_gralloc_buffer *get_buffer(cros_gralloc_handle_t hnd);
-	bool
-	get_resolved_format_and_use_flags(const struct cros_gralloc_buffer_descriptor *descriptor,
-					  uint32_t *out_format, uint64_t *out_use_flags);
+	void init_try_nodes();
+	void init_routing();
+	std::shared_ptr<cros_gralloc_buffer> get_buffer(cros_gralloc_handle_t hnd);
+	bool get_resolved_format_and_use_flags(struct driver *drv,
+					       const struct cros_gralloc_buffer_descriptor *descriptor,
+					       uint32_t *out_format, uint64_t *out_use_flags);
+
+	/*
+	 * Allocations are routed by usage to the device whose memory the consumers need, or to
+	 * any other device that supports them. Imports go through the device recorded in the
+	 * handle, or for handles without one, the device the buffer was most likely allocated on.
+	 */
+	uint64_t get_device_key(struct driver *drv);
+	struct driver *get_routed_driver(uint64_t use_flags);
+	struct driver *select_driver(const struct cros_gralloc_buffer_descriptor *descriptor,
+				     uint32_t *out_format, uint64_t *out_use_flags);
+	struct driver *select_import_driver(cros_gralloc_handle_t hnd);
 
 	int create_reserved_region(const std::string &buffer_name, uint64_t reserved_region_size);
 
@@ -67,22 +170,118 @@ class cros_gralloc_driver
 	BufferAllocator allocator_;
 #endif
 
-	std::unique_ptr<struct driver, void (*)(struct driver *)> drv_;
+	struct cros_gralloc_device {
+		cros_gralloc_device(struct driver *drv, uint32_t dev_type_flags, uint64_t key);
+
+		std::unique_ptr<struct driver, void (*)(struct driver *)> drv;
+		/* GBM_DEV_TYPE_FLAG_* */
+		uint32_t dev_type_flags;
+		/* Same for the device in every process, or 0 if its bus is unknown. */
+		uint64_t key;
+	};
+
+	std::vector<cros_gralloc_device> devices_;
+	/* The GPU, and the device buffers for the display, camera and video codecs go to. */
+	struct driver *render_drv_ = nullptr;
+	struct driver *display_drv_ = nullptr;
+	bool resource_info_is_static_ = true;
 
 	struct cros_gralloc_imported_handle_info {
 		/*
 		 * The underlying buffer for referred to by this handle (as multiple handles can
 		 * refer to the same buffer).
 		 */
-		cros_gralloc_buffer *buffer = nullptr;
+		std::shared_ptr<cros_gralloc_buffer> buffer;
 
 		/* The handle's refcount as a handle can be imported multiple times.*/
 		int32_t refcount = 1;
 	};
 
-	std::mutex mutex_;
-	std::unordered_map<uint32_t, std::unique_ptr<cros_gralloc_buffer>> buffers_;
-	std::unordered_map<cros_gralloc_handle_t, cros_gralloc_imported_handle_info> handles_;
+	/*
+	 * The buffer and handle tables are split into shards by buffer id, so a handle always
+	 * lives in the same shard as the buffer it refers to. Shard locks only cover table
+	 * lookups and reference counting; CPU access runs under the per-buffer lock, and lookups
+	 * hand out shared references so a buffer outlives a concurrent release().
+	 */
+	struct cros_gralloc_released_buffer {
+		std::shared_ptr<cros_gralloc_buffer> buffer;
+		/* Device and inode of the buffer's first dma-buf, to catch reused buffer ids. */
+		std::pair<dev_t, ino_t> dmabuf;
+		std::chrono::steady_clock::time_point release_time;
+		uint64_t size;
+	};
+	using cros_gralloc_released_map = std::unordered_map<uint32_t, cros_gralloc_released_buffer>;
+
+	struct cros_gralloc_shard {
+		std::mutex mutex;
+		std::unordered_map<uint32_t, std::shared_ptr<cros_gralloc_buffer>> buffers;
+		std::unordered_map<cros_gralloc_handle_t, cros_gralloc_imported_handle_info> handles;
+		/* Dma-buf identity of the live buffers that were imported by retain(). */
+		std::unordered_map<uint32_t, std::pair<dev_t, ino_t>> imported;
+		/* Imported buffers without any handle left, waiting to be re-imported or evicted. */
+		cros_gralloc_released_map released;
+	};
+
+	cros_gralloc_shard &get_shard(uint32_t id);
+
+	std::shared_ptr<cros_gralloc_buffer> import_buffer(cros_gralloc_handle_t hnd);
+	bool import_cache_insert(cros_gralloc_shard &shard,
+				 const std::shared_ptr<cros_gralloc_buffer> &buffer,
+				 std::vector<std::shared_ptr<cros_gralloc_buffer>> *evicted);
+	std::shared_ptr<cros_gralloc_buffer>
+	import_cache_take(cros_gralloc_shard &shard, cros_gralloc_released_map::iterator it);
+	void import_cache_trim(std::vector<std::shared_ptr<cros_gralloc_buffer>> *evicted);
+
+	void get_buffers(const cros_gralloc_handle_t *hnds,
+			 std::shared_ptr<cros_gralloc_buffer> *buffers, uint32_t count);
+
+	int32_t map_buffer(const std::shared_ptr<cros_gralloc_buffer> &buffer,
+			   const struct rectangle *rect, uint32_t map_flags,
+			   uint8_t *addr[DRV_MAX_PLANES]);
+	int32_t lock_buffer(const std::shared_ptr<cros_gralloc_buffer> &buffer,
+			    int32_t acquire_fence, bool close_acquire_fence,
+			    const struct rectangle *rect, uint32_t map_flags,
+			    uint8_t *addr[DRV_MAX_PLANES], int32_t *ready_fence);
+	int32_t unlock_buffer(const std::shared_ptr<cros_gralloc_buffer> &buffer,
+			      int32_t *release_fence);
+
+	std::array<cros_gralloc_shard, CROS_GRALLOC_NUM_SHARDS> shards_;
+
+	/*
+	 * Bytes held by released buffers across all shards, and the steady_clock time (in ns) at
+	 * which the oldest of them expires, so that retain() and release() only walk the shards
+	 * when something is due.
+	 */
+	std::atomic<uint64_t> import_cache_bytes_{ 0 };
+	std::atomic<int64_t> import_cache_next_expiry_{ INT64_MAX };
+
+	/*
+	 * Unlocked buffers that kept their CPU mapping, least recently unlocked first. Victims
+	 * are picked under map_cache_mutex_ but unmapped after dropping it, taking each buffer's
+	 * own lock only opportunistically; a victim whose lock was busy is queued again.
+	 */
+	struct cros_gralloc_map_cache_entry {
+		std::weak_ptr<cros_gralloc_buffer> buffer;
+		const cros_gralloc_buffer *key;
+		uint64_t size;
+	};
+
+	void map_cache_insert(const std::shared_ptr<cros_gralloc_buffer> &buffer);
+	void map_cache_push(const std::shared_ptr<cros_gralloc_buffer> &buffer);
+	void map_cache_remove(const cros_gralloc_buffer *buffer);
+	void map_cache_evict(std::vector<std::shared_ptr<cros_gralloc_buffer>> *victims);
+
+	std::mutex map_cache_mutex_;
+	std::list<cros_gralloc_map_cache_entry> map_cache_lru_;
+	std::unordered_map<const cros_gralloc_buffer *,
+			   std::list<cros_gralloc_map_cache_entry>::iterator>
+	    map_cache_index_;
+	uint64_t map_cache_bytes_ = 0;
+	uint32_t map_cache_max_mappings_ = CROS_GRALLOC_MAP_CACHE_MAX_MAPPINGS;
+	uint64_t map_cache_max_bytes_ = CROS_GRALLOC_MAP_CACHE_MAX_BYTES;
+	std::atomic<uint64_t> map_cache_hits_{ 0 };
+	std::atomic<uint64_t> map_cache_misses_{ 0 };
+	std::atomic<uint64_t> map_cache_evictions_{ 0 };
 };
 
 #endif
@@ -40,6 +40,11 @@ struct cros_gralloc_handle : public native_handle_t {
 	uint32_t num_planes;
 	uint64_t reserved_region_size;
 	uint64_t total_size; /* Total allocation size */
+	/*
+	 * Identifies the device the buffer was allocated on, or 0 if unknown. Handles from
+	 * allocators that predate this field end before it.
+	 */
+	uint64_t device_key;
 } __attribute__((packed));
 
 typedef const struct cros_gralloc_handle *cros_gralloc_handle_t;
@@ -7,7 +7,9 @@
 #include "cros_gralloc_helpers.h"
 
 #include <hardware/gralloc.h>
+#include <poll.h>
 #include <sync/sync.h>
+#include <vector>
 
 /* Define to match AIDL BufferUsage::VIDEO_DECODER. */
 #define BUFFER_USAGE_VIDEO_DECODER (1 << 22)
@@ -193,6 +195,69 @@ int32_t cros_gralloc_sync_wait(int32_t fence, bool close_fence)
 	return 0;
 }
 
+int32_t cros_gralloc_sync_wait_many(const int32_t *fences, int32_t *results, uint32_t count)
+{
+	std::vector<struct pollfd> fds;
+	std::vector<uint32_t> indices;
+	int32_t ret = 0;
+	int timeout = 1000;
+
+	for (uint32_t i = 0; i < count; i++) {
+		results[i] = 0;
+		if (fences[i] < 0)
+			continue;
+
+		fds.push_back({ fences[i], POLLIN, 0 });
+		indices.push_back(i);
+	}
+
+	/* Same policy as cros_gralloc_sync_wait(): wait 1000 ms, then indefinitely. */
+	while (!fds.empty()) {
+		int err = poll(fds.data(), fds.size(), timeout);
+		if (err < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+
+			ALOGE("sync wait error = %s", strerror(errno));
+			for (uint32_t i : indices)
+				results[i] = -errno;
+			break;
+		}
+
+		if (err == 0) {
+			ALOGE("Timed out on sync wait for %zu fences", fds.size());
+			timeout = -1;
+			continue;
+		}
+
+		for (size_t i = 0; i < fds.size();) {
+			if (!fds[i].revents) {
+				i++;
+				continue;
+			}
+
+			if (fds[i].revents & (POLLERR | POLLNVAL))
+				results[indices[i]] = -EINVAL;
+
+			fds.erase(fds.begin() + i);
+			indices.erase(indices.begin() + i);
+		}
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (fences[i] >= 0 && close(fences[i])) {
+			ALOGE("Unable to close fence fd, err = %s", strerror(errno));
+			if (!results[i])
+				results[i] = -errno;
+		}
+
+		if (!ret)
+			ret = results[i];
+	}
+
+	return ret;
+}
+
 std::string get_drm_format_string(uint32_t drm_format)
 {
 	char *sequence = (char *)&drm_format;
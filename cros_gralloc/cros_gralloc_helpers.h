@@ -49,6 +49,12 @@ cros_gralloc_handle_t cros_gralloc_convert_handle(buffer_handle_t handle);
 
 int32_t cros_gralloc_sync_wait(int32_t fence, bool close_fence);
 
+/*
+ * Waits on all |fences| (-1 entries are skipped) with one poll() loop and closes them. The
+ * per-fence result is stored in |results|; the first error is returned.
+ */
+int32_t cros_gralloc_sync_wait_many(const int32_t *fences, int32_t *results, uint32_t count);
+
 std::string get_drm_format_string(uint32_t drm_format);
 
 #endif
@@ -11,6 +11,8 @@
 #include <cutils/native_handle.h>
 #include <hardware/gralloc.h>
 #include <memory.h>
+#include <unistd.h>
+#include <vector>
 
 struct gralloc0_module {
 	gralloc_module_t base;
@@ -29,6 +31,23 @@ struct cros_gralloc0_buffer_info {
 	uint32_t stride[4];
 };
 
+/* Entries of the GRALLOC_DRM_LOCK_MANY and GRALLOC_DRM_UNLOCK_MANY batches. */
+struct cros_gralloc0_lock_request {
+	buffer_handle_t handle;
+	int usage;
+	int l, t, w, h;
+	/* Consumed by the lock. */
+	int acquire_fence;
+	void *vaddr;
+	int result;
+};
+
+struct cros_gralloc0_unlock_request {
+	buffer_handle_t handle;
+	int release_fence;
+	int result;
+};
+
 /* This enumeration must match the one in <gralloc_drm.h>.
  * The functions supported by this gralloc's temporary private API are listed
  * below. Use of these functions is highly discouraged and should only be
@@ -43,6 +62,10 @@ enum {
 	GRALLOC_DRM_GET_BACKING_STORE,
 	GRALLOC_DRM_GET_BUFFER_INFO,
 	GRALLOC_DRM_GET_USAGE,
+	GRALLOC_DRM_LOCK_ASYNC,
+	GRALLOC_DRM_LOCK_MANY,
+	GRALLOC_DRM_UNLOCK_MANY,
+	GRALLOC_DRM_QUERY_LAYOUT,
 };
 
 /* This enumeration corresponds to the GRALLOC_DRM_GET_USAGE query op, which
@@ -211,6 +234,89 @@ static int gralloc0_unlock(struct gralloc_module_t const *module, buffer_handle_
 	return 0;
 }
 
+static int gralloc0_lock_many(struct gralloc0_module *mod,
+			      struct cros_gralloc0_lock_request *requests, uint32_t count)
+{
+	std::vector<struct cros_gralloc_lock_request> batch(count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		batch[i].handle = requests[i].handle;
+		batch[i].acquire_fence = requests[i].acquire_fence;
+		batch[i].rect = { .x = static_cast<uint32_t>(requests[i].l),
+				  .y = static_cast<uint32_t>(requests[i].t),
+				  .width = static_cast<uint32_t>(requests[i].w),
+				  .height = static_cast<uint32_t>(requests[i].h) };
+		batch[i].map_flags =
+		    cros_gralloc_convert_map_usage(static_cast<uint64_t>(requests[i].usage));
+	}
+
+	int ret = mod->driver->lock_many(batch.data(), count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		requests[i].vaddr = batch[i].addr[0];
+		requests[i].result = batch[i].result;
+	}
+
+	return ret;
+}
+
+static int gralloc0_unlock_many(struct gralloc0_module *mod,
+				struct cros_gralloc0_unlock_request *requests, uint32_t count)
+{
+	std::vector<struct cros_gralloc_unlock_request> batch(count);
+
+	for (uint32_t i = 0; i < count; i++)
+		batch[i].handle = requests[i].handle;
+
+	int ret = mod->driver->unlock_many(batch.data(), count);
+
+	for (uint32_t i = 0; i < count; i++) {
+		requests[i].release_fence = batch[i].release_fence;
+		requests[i].result = batch[i].result;
+	}
+
+	return ret;
+}
+
+/*
+ * Fills |info| with the layout gralloc0_alloc() would give a buffer, without allocating one
+ * where the backend allows. No file descriptors are returned.
+ */
+static int gralloc0_query_layout(struct gralloc0_module *mod, int w, int h, int format, int usage,
+				 struct cros_gralloc0_buffer_info *info)
+{
+	int32_t ret;
+	uint32_t resolved_format;
+	struct drv_layout layout;
+	struct cros_gralloc_buffer_descriptor descriptor;
+
+	descriptor.width = w;
+	descriptor.height = h;
+	descriptor.droid_format = format;
+	descriptor.droid_usage = usage;
+	descriptor.drm_format = cros_gralloc_convert_format(format);
+	descriptor.use_flags = cros_gralloc_convert_usage(usage);
+	descriptor.reserved_region_size = 0;
+
+	ret = mod->driver->query_layout(&descriptor, &resolved_format, &layout);
+	if (ret)
+		return ret;
+
+	memset(info, 0, sizeof(*info));
+	info->drm_fourcc = drv_get_standard_fourcc(resolved_format);
+	info->num_fds = 0;
+	info->modifier = layout.format_modifier;
+	for (uint32_t i = 0; i < DRV_MAX_PLANES; i++) {
+		info->fds[i] = -1;
+		if (i < layout.num_planes) {
+			info->stride[i] = layout.strides[i];
+			info->offset[i] = layout.offsets[i];
+		}
+	}
+
+	return 0;
+}
+
 static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 {
 	va_list args;
@@ -228,6 +334,15 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 	uint32_t req_usage;
 	uint32_t gralloc_usage = 0;
 	uint32_t *out_gralloc_usage;
+	int usage, acquire_fence;
+	int32_t *ready_fence;
+	void **out_vaddr;
+	struct rectangle rect;
+	uint8_t *addr[DRV_MAX_PLANES] = { nullptr, nullptr, nullptr, nullptr };
+	struct cros_gralloc0_lock_request *lock_requests;
+	struct cros_gralloc0_unlock_request *unlock_requests;
+	uint32_t count;
+	int width, height, format;
 
 	if (!mod->initialized) {
 		if (gralloc0_init(mod, false))
@@ -242,6 +357,7 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 	case GRALLOC_DRM_GET_DIMENSIONS:
 	case GRALLOC_DRM_GET_BACKING_STORE:
 	case GRALLOC_DRM_GET_BUFFER_INFO:
+	case GRALLOC_DRM_LOCK_ASYNC:
 		/* retrieve handles for ops with buffer_handle_t */
 		handle = va_arg(args, buffer_handle_t);
 		hnd = cros_gralloc_convert_handle(handle);
@@ -252,6 +368,9 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 		}
 		break;
 	case GRALLOC_DRM_GET_USAGE:
+	case GRALLOC_DRM_LOCK_MANY:
+	case GRALLOC_DRM_UNLOCK_MANY:
+	case GRALLOC_DRM_QUERY_LAYOUT:
 		break;
 	default:
 		va_end(args);
@@ -316,6 +435,52 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 			gralloc_usage |= BUFFER_USAGE_FRONT_RENDERING;
 		*out_gralloc_usage = gralloc_usage;
 		break;
+	case GRALLOC_DRM_LOCK_ASYNC:
+		/*
+		 * Like lockAsync(), but returns a fence that signals when the CPU may access
+		 * the buffer instead of waiting on |acquire_fence| itself.
+		 */
+		usage = va_arg(args, int);
+		rect.x = static_cast<uint32_t>(va_arg(args, int));
+		rect.y = static_cast<uint32_t>(va_arg(args, int));
+		rect.width = static_cast<uint32_t>(va_arg(args, int));
+		rect.height = static_cast<uint32_t>(va_arg(args, int));
+		out_vaddr = va_arg(args, void **);
+		acquire_fence = va_arg(args, int);
+		ready_fence = va_arg(args, int32_t *);
+
+		if (hnd->droid_format == HAL_PIXEL_FORMAT_YCbCr_420_888) {
+			ALOGE("HAL_PIXEL_FORMAT_YCbCr_*_888 format not compatible.");
+			if (acquire_fence >= 0)
+				close(acquire_fence);
+			ret = -EINVAL;
+			break;
+		}
+
+		ret = mod->driver->lock_async(handle, acquire_fence, &rect,
+					      cros_gralloc_convert_map_usage(
+						  static_cast<uint64_t>(usage)),
+					      addr, ready_fence);
+		*out_vaddr = addr[0];
+		break;
+	case GRALLOC_DRM_LOCK_MANY:
+		lock_requests = va_arg(args, struct cros_gralloc0_lock_request *);
+		count = va_arg(args, uint32_t);
+		ret = gralloc0_lock_many(mod, lock_requests, count);
+		break;
+	case GRALLOC_DRM_UNLOCK_MANY:
+		unlock_requests = va_arg(args, struct cros_gralloc0_unlock_request *);
+		count = va_arg(args, uint32_t);
+		ret = gralloc0_unlock_many(mod, unlock_requests, count);
+		break;
+	case GRALLOC_DRM_QUERY_LAYOUT:
+		width = va_arg(args, int);
+		height = va_arg(args, int);
+		format = va_arg(args, int);
+		usage = va_arg(args, int);
+		info = va_arg(args, struct cros_gralloc0_buffer_info *);
+		ret = gralloc0_query_layout(mod, width, height, format, usage, info);
+		break;
 	default:
 		ret = -EINVAL;
 	}
@@ -12,9 +12,11 @@
  */
 
 #define _GNU_SOURCE
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cutils/native_handle.h>
@@ -43,6 +45,11 @@
 
 #define BUFFER_USAGE_FRONT_RENDERING GRALLOC_USAGE_PRIVATE_0
 
+#define CONTENTION_NUM_THREADS 16
+#define CONTENTION_NUM_ITERATIONS 1000
+
+#define LOCK_MANY_NUM_BUFFERS 4
+
 /* Private API enumeration -- see <gralloc_drm.h> */
 enum {
 	GRALLOC_DRM_GET_STRIDE,
@@ -51,12 +58,30 @@ enum {
 	GRALLOC_DRM_GET_BACKING_STORE,
 	GRALLOC_DRM_GET_BUFFER_INFO,
 	GRALLOC_DRM_GET_USAGE,
+	GRALLOC_DRM_LOCK_ASYNC,
+	GRALLOC_DRM_LOCK_MANY,
+	GRALLOC_DRM_UNLOCK_MANY,
 };
 
 enum {
 	GRALLOC_DRM_GET_USAGE_FRONT_RENDERING_BIT = 0x00000001,
 };
 
+struct cros_gralloc0_lock_request {
+	buffer_handle_t handle;
+	int usage;
+	int l, t, w, h;
+	int acquire_fence;
+	void *vaddr;
+	int result;
+};
+
+struct cros_gralloc0_unlock_request {
+	buffer_handle_t handle;
+	int release_fence;
+	int result;
+};
+
 struct gralloctest_context {
 	struct gralloc_module_t *module;
 	struct alloc_device_t *device;
@@ -653,6 +678,125 @@ static int test_async(struct gralloctest_context *ctx)
 	return 1;
 }
 
+struct contention_thread {
+	struct gralloctest_context *ctx;
+	struct grallocinfo info;
+	int success;
+};
+
+static void *lock_contention_thread(void *arg)
+{
+	struct contention_thread *thread = arg;
+	uint32_t i;
+
+	for (i = 0; i < CONTENTION_NUM_ITERATIONS; i++) {
+		if (!lock(thread->ctx->module, &thread->info) || !thread->info.vaddr)
+			return NULL;
+
+		*(volatile uint32_t *)thread->info.vaddr = i;
+
+		if (!unlock(thread->ctx->module, &thread->info))
+			return NULL;
+	}
+
+	thread->success = 1;
+	return NULL;
+}
+
+/*
+ * This function measures lock/unlock throughput while many threads each lock their own buffer,
+ * which should not contend on any process-wide lock.
+ */
+static int test_lock_contention(struct gralloctest_context *ctx)
+{
+	struct contention_thread threads[CONTENTION_NUM_THREADS];
+	pthread_t thread_ids[CONTENTION_NUM_THREADS];
+	struct timespec start, end;
+	double elapsed_us;
+	uint32_t i;
+
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < CONTENTION_NUM_THREADS; i++) {
+		threads[i].ctx = ctx;
+		grallocinfo_init(&threads[i].info, 512, 512, HAL_PIXEL_FORMAT_BGRA_8888,
+				 GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN);
+		CHECK(allocate(ctx->device, &threads[i].info));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < CONTENTION_NUM_THREADS; i++)
+		CHECK(pthread_create(&thread_ids[i], NULL, lock_contention_thread, &threads[i]) == 0);
+
+	for (i = 0; i < CONTENTION_NUM_THREADS; i++)
+		CHECK(pthread_join(thread_ids[i], NULL) == 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed_us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+	printf("[   INFO   ] %d threads x %d lock/unlock: %.2f us per pair, %.0f pairs/s\n",
+	       CONTENTION_NUM_THREADS, CONTENTION_NUM_ITERATIONS,
+	       elapsed_us / (CONTENTION_NUM_THREADS * CONTENTION_NUM_ITERATIONS),
+	       CONTENTION_NUM_THREADS * CONTENTION_NUM_ITERATIONS / (elapsed_us / 1e6));
+
+	for (i = 0; i < CONTENTION_NUM_THREADS; i++) {
+		CHECK(threads[i].success);
+		CHECK(deallocate(ctx->device, &threads[i].info));
+	}
+
+	return 1;
+}
+
+/* This function tests the batched lock/unlock perform ops. */
+static int test_lock_many(struct gralloctest_context *ctx)
+{
+	struct grallocinfo info[LOCK_MANY_NUM_BUFFERS];
+	struct cros_gralloc0_lock_request lock_requests[LOCK_MANY_NUM_BUFFERS];
+	struct cros_gralloc0_unlock_request unlock_requests[LOCK_MANY_NUM_BUFFERS];
+	struct gralloc_module_t *mod = ctx->module;
+	uint32_t i;
+
+	memset(lock_requests, 0, sizeof(lock_requests));
+	memset(unlock_requests, 0, sizeof(unlock_requests));
+
+	for (i = 0; i < LOCK_MANY_NUM_BUFFERS; i++) {
+		grallocinfo_init(&info[i], 64 * (i + 1), 64, HAL_PIXEL_FORMAT_BGRA_8888,
+				 GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN);
+		CHECK(allocate(ctx->device, &info[i]));
+
+		lock_requests[i].handle = info[i].handle;
+		lock_requests[i].usage = info[i].usage;
+		lock_requests[i].w = info[i].w;
+		lock_requests[i].h = info[i].h;
+		lock_requests[i].acquire_fence = -1;
+		unlock_requests[i].handle = info[i].handle;
+	}
+
+	CHECK(mod->perform(mod, GRALLOC_DRM_LOCK_MANY, lock_requests,
+			   (uint32_t)LOCK_MANY_NUM_BUFFERS) == 0);
+
+	for (i = 0; i < LOCK_MANY_NUM_BUFFERS; i++) {
+		CHECK(lock_requests[i].result == 0);
+		CHECK(lock_requests[i].vaddr);
+		memset(lock_requests[i].vaddr, 0xAA, info[i].w * 4);
+	}
+
+	CHECK(mod->perform(mod, GRALLOC_DRM_UNLOCK_MANY, unlock_requests,
+			   (uint32_t)LOCK_MANY_NUM_BUFFERS) == 0);
+
+	for (i = 0; i < LOCK_MANY_NUM_BUFFERS; i++) {
+		CHECK(unlock_requests[i].result == 0);
+		if (unlock_requests[i].release_fence >= 0) {
+			CHECK(sync_wait(unlock_requests[i].release_fence, 10000) >= 0);
+			close(unlock_requests[i].release_fence);
+		}
+
+		CHECK(deallocate(ctx->device, &info[i]));
+	}
+
+	return 1;
+}
+
 static const struct gralloc_testcase tests[] = {
 	{ "alloc_varying_sizes", test_alloc_varying_sizes, 1 },
 	{ "alloc_combinations", test_alloc_combinations, 1 },
@@ -663,6 +807,8 @@ static const struct gralloc_testcase tests[] = {
 	{ "ycbcr", test_ycbcr, 2 },
 	{ "yuv_info", test_yuv_info, 2 },
 	{ "async", test_async, 3 },
+	{ "lock_contention", test_lock_contention, 1 },
+	{ "lock_many", test_lock_many, 1 },
 };
 
 static void print_help(const char *argv0)
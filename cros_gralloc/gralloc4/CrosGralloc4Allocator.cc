@@ -62,33 +62,8 @@ Error CrosGralloc4Allocator::initializeMetadata(
     return Error::NONE;
 }
 
-Error CrosGralloc4Allocator::allocate(const BufferDescriptorInfo& descriptor, uint32_t* outStride,
-                                      hidl_handle* outHandle) {
-    if (!mDriver) {
-        ALOGE("Failed to allocate. Driver is uninitialized.");
-        return Error::NO_RESOURCES;
-    }
-
-    if (!outStride || !outHandle) {
-        return Error::NO_RESOURCES;
-    }
-
-    struct cros_gralloc_buffer_descriptor crosDescriptor;
-    if (convertToCrosDescriptor(descriptor, &crosDescriptor)) {
-        return Error::UNSUPPORTED;
-    }
-
-    crosDescriptor.reserved_region_size += sizeof(CrosGralloc4Metadata);
-
-    if (!mDriver->is_supported(&crosDescriptor)) {
-        std::string drmFormatString = get_drm_format_string(crosDescriptor.drm_format);
-        std::string pixelFormatString = getPixelFormatString(descriptor.format);
-        std::string usageString = getUsageString(descriptor.usage);
-        ALOGE("Unsupported combination -- pixel format: %s, drm format:%s, usage: %s",
-              pixelFormatString.c_str(), drmFormatString.c_str(), usageString.c_str());
-        return Error::UNSUPPORTED;
-    }
-
+Error CrosGralloc4Allocator::allocate(const struct cros_gralloc_buffer_descriptor& crosDescriptor,
+                                      uint32_t* outStride, hidl_handle* outHandle) {
     native_handle_t* handle;
     int ret = mDriver->allocate(&crosDescriptor, &handle);
     if (ret) {
@@ -122,30 +97,49 @@ Return<void> CrosGralloc4Allocator::allocate(const hidl_vec<uint8_t>& descriptor
     }
 
     BufferDescriptorInfo description;
+    struct cros_gralloc_buffer_descriptor crosDescriptor;
 
-    int ret = android::gralloc4::decodeBufferDescriptorInfo(descriptor, &description);
-    if (ret) {
-        ALOGE("Failed to allocate. Failed to decode buffer descriptor: %d.", ret);
+    int ret = mDescriptorCache.get(mDriver, descriptor.data(), descriptor.size(), &description,
+                                   &crosDescriptor);
+    if (ret == -EINVAL) {
+        ALOGE("Failed to allocate. Failed to decode buffer descriptor.");
         hidlCb(Error::BAD_DESCRIPTOR, 0, handles);
         return Void();
     }
+    if (ret) {
+        std::string drmFormatString = get_drm_format_string(crosDescriptor.drm_format);
+        std::string pixelFormatString = getPixelFormatString(description.format);
+        std::string usageString = getUsageString(description.usage);
+        ALOGE("Unsupported combination -- pixel format: %s, drm format:%s, usage: %s",
+              pixelFormatString.c_str(), drmFormatString.c_str(), usageString.c_str());
+        hidlCb(Error::UNSUPPORTED, 0, handles);
+        return Void();
+    }
 
     handles.resize(count);
+    std::vector<uint32_t> strides(count, 0);
+    std::vector<Error> errors(count, Error::NONE);
+
+    mWorkerPool.run(count, [&](uint32_t i) {
+        errors[i] = allocate(crosDescriptor, &strides[i], &handles[i]);
+    });
 
-    uint32_t stride = 0;
-    for (int i = 0; i < handles.size(); i++) {
-        Error err = allocate(description, &stride, &(handles[i]));
-        if (err != Error::NONE) {
-            for (int j = 0; j < i; j++) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (errors[i] == Error::NONE) {
+            continue;
+        }
+
+        for (uint32_t j = 0; j < count; j++) {
+            if (errors[j] == Error::NONE) {
                 mDriver->release(handles[j].getNativeHandle());
             }
-            handles.resize(0);
-            hidlCb(err, 0, handles);
-            return Void();
         }
+        handles.resize(0);
+        hidlCb(errors[i], 0, handles);
+        return Void();
     }
 
-    hidlCb(Error::NONE, stride, handles);
+    hidlCb(Error::NONE, count ? strides[0] : 0, handles);
 
     for (const hidl_handle& handle : handles) {
         mDriver->release(handle.getNativeHandle());
@@ -10,6 +10,7 @@
 #include "cros_gralloc/cros_gralloc_driver.h"
 #include "cros_gralloc/cros_gralloc_helpers.h"
 #include "cros_gralloc/gralloc4/CrosGralloc4Metadata.h"
+#include "cros_gralloc/gralloc4/CrosGralloc4Utils.h"
 
 class CrosGralloc4Allocator : public android::hardware::graphics::allocator::V4_0::IAllocator {
   public:
@@ -26,9 +27,10 @@ class CrosGralloc4Allocator : public android::hardware::graphics::allocator::V4_
             const struct cros_gralloc_buffer_descriptor& crosDescriptor);
 
     android::hardware::graphics::mapper::V4_0::Error allocate(
-            const android::hardware::graphics::mapper::V4_0::IMapper::BufferDescriptorInfo&
-                    description,
-            uint32_t* outStride, android::hardware::hidl_handle* outHandle);
+            const struct cros_gralloc_buffer_descriptor& crosDescriptor, uint32_t* outStride,
+            android::hardware::hidl_handle* outHandle);
 
     cros_gralloc_driver* mDriver = nullptr;
+    CrosGralloc4DescriptorCache mDescriptorCache;
+    CrosGralloc4WorkerPool mWorkerPool;
 };
@@ -12,6 +12,9 @@
 #include <aidl/android/hardware/graphics/common/Rect.h>
 #include <cutils/native_handle.h>
 #include <gralloctypes/Gralloc4.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
 
 #include "cros_gralloc/cros_gralloc_helpers.h"
 #include "cros_gralloc/gralloc4/CrosGralloc4Utils.h"
@@ -318,6 +321,11 @@ Return<void> CrosGralloc4Mapper::unlock(void* rawHandle, unlock_cb hidlCb) {
     }
 
     hidlCb(Error::NONE, releaseFenceHandle);
+
+    /* The fence fd was dup'ed by the HIDL transport; release our copy. */
+    if (releaseFenceFd >= 0) {
+        close(releaseFenceFd);
+    }
     return Void();
 }
 
@@ -352,6 +360,11 @@ Return<void> CrosGralloc4Mapper::flushLockedBuffer(void* rawHandle, flushLockedB
     }
 
     hidlCb(Error::NONE, releaseFenceHandle);
+
+    /* The fence fd was dup'ed by the HIDL transport; release our copy. */
+    if (releaseFenceFd >= 0) {
+        close(releaseFenceFd);
+    }
     return Void();
 }
 
@@ -394,6 +407,31 @@ Return<void> CrosGralloc4Mapper::isSupported(const BufferDescriptorInfo& descrip
     return Void();
 }
 
+namespace {
+
+// Metadata types whose values are derived only from cros_gralloc_handle fields, which never
+// change after allocation.
+bool isImmutableMetadataType(const MetadataType& metadataType) {
+    return metadataType == android::gralloc4::MetadataType_BufferId ||
+           metadataType == android::gralloc4::MetadataType_Width ||
+           metadataType == android::gralloc4::MetadataType_Height ||
+           metadataType == android::gralloc4::MetadataType_LayerCount ||
+           metadataType == android::gralloc4::MetadataType_PixelFormatRequested ||
+           metadataType == android::gralloc4::MetadataType_PixelFormatFourCC ||
+           metadataType == android::gralloc4::MetadataType_PixelFormatModifier ||
+           metadataType == android::gralloc4::MetadataType_Usage ||
+           metadataType == android::gralloc4::MetadataType_AllocationSize ||
+           metadataType == android::gralloc4::MetadataType_ProtectedContent ||
+           metadataType == android::gralloc4::MetadataType_Compression ||
+           metadataType == android::gralloc4::MetadataType_Interlaced ||
+           metadataType == android::gralloc4::MetadataType_ChromaSiting ||
+           metadataType == android::gralloc4::MetadataType_PlaneLayouts ||
+           metadataType == android::gralloc4::MetadataType_Crop ||
+           metadataType == android::gralloc4::MetadataType_Smpte2094_40;
+}
+
+}  // namespace
+
 Return<void> CrosGralloc4Mapper::get(void* rawHandle, const MetadataType& metadataType,
                                      get_cb hidlCb) {
     hidl_vec<uint8_t> encodedMetadata;
@@ -418,70 +456,53 @@ Return<void> CrosGralloc4Mapper::get(void* rawHandle, const MetadataType& metada
         return Void();
     }
 
+    // Metadata fixed at allocation time is served from the handle without a buffer lookup,
+    // once the handle is known to be imported.
+    if (isImmutableMetadataType(metadataType)) {
+        if (!mDriver->is_registered(crosHandle)) {
+            ALOGE("Failed to get. Handle is not imported.");
+            hidlCb(Error::BAD_BUFFER, encodedMetadata);
+            return Void();
+        }
+        return get(crosHandle, metadataType, hidlCb);
+    }
+
     mDriver->with_buffer(crosHandle, [&, this](cros_gralloc_buffer* crosBuffer) {
         get(crosBuffer, metadataType, hidlCb);
     });
     return Void();
 }
 
-Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
+Return<void> CrosGralloc4Mapper::get(cros_gralloc_handle_t crosHandle,
                                      const MetadataType& metadataType, get_cb hidlCb) {
     hidl_vec<uint8_t> encodedMetadata;
 
-    if (!mDriver) {
-        ALOGE("Failed to get. Driver is uninitialized.");
-        hidlCb(Error::NO_RESOURCES, encodedMetadata);
-        return Void();
-    }
-
-    if (!crosBuffer) {
-        ALOGE("Failed to get. Invalid buffer.");
-        hidlCb(Error::BAD_BUFFER, encodedMetadata);
-        return Void();
-    }
-
-    const CrosGralloc4Metadata* crosMetadata = nullptr;
-    if (metadataType == android::gralloc4::MetadataType_BlendMode ||
-        metadataType == android::gralloc4::MetadataType_Cta861_3 ||
-        metadataType == android::gralloc4::MetadataType_Dataspace ||
-        metadataType == android::gralloc4::MetadataType_Name ||
-        metadataType == android::gralloc4::MetadataType_Smpte2086) {
-        Error error = getMetadata(crosBuffer, &crosMetadata);
-        if (error != Error::NONE) {
-            ALOGE("Failed to get. Failed to get buffer metadata.");
-            hidlCb(Error::NO_RESOURCES, encodedMetadata);
-            return Void();
-        }
-    }
-
     android::status_t status = android::NO_ERROR;
     if (metadataType == android::gralloc4::MetadataType_BufferId) {
-        status = android::gralloc4::encodeBufferId(crosBuffer->get_id(), &encodedMetadata);
-    } else if (metadataType == android::gralloc4::MetadataType_Name) {
-        status = android::gralloc4::encodeName(crosMetadata->name, &encodedMetadata);
+        status = android::gralloc4::encodeBufferId(crosHandle->id, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Width) {
-        status = android::gralloc4::encodeWidth(crosBuffer->get_width(), &encodedMetadata);
+        status = android::gralloc4::encodeWidth(crosHandle->width, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Height) {
-        status = android::gralloc4::encodeHeight(crosBuffer->get_height(), &encodedMetadata);
+        status = android::gralloc4::encodeHeight(crosHandle->height, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_LayerCount) {
         status = android::gralloc4::encodeLayerCount(1, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_PixelFormatRequested) {
-        PixelFormat pixelFormat = static_cast<PixelFormat>(crosBuffer->get_android_format());
+        PixelFormat pixelFormat = static_cast<PixelFormat>(crosHandle->droid_format);
         status = android::gralloc4::encodePixelFormatRequested(pixelFormat, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_PixelFormatFourCC) {
         status = android::gralloc4::encodePixelFormatFourCC(
-                drv_get_standard_fourcc(crosBuffer->get_format()), &encodedMetadata);
+                drv_get_standard_fourcc(crosHandle->format), &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_PixelFormatModifier) {
-        status = android::gralloc4::encodePixelFormatModifier(crosBuffer->get_format_modifier(),
+        status = android::gralloc4::encodePixelFormatModifier(crosHandle->format_modifier,
                                                               &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Usage) {
-        status = android::gralloc4::encodeUsage(crosBuffer->get_android_usage(), &encodedMetadata);
+        status = android::gralloc4::encodeUsage(static_cast<uint64_t>(crosHandle->usage),
+                                                &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_AllocationSize) {
-        status = android::gralloc4::encodeAllocationSize(crosBuffer->get_total_size(),
-                                                         &encodedMetadata);
+        status = android::gralloc4::encodeAllocationSize(crosHandle->total_size, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_ProtectedContent) {
         uint64_t hasProtectedContent =
-                crosBuffer->get_android_usage() & BufferUsage::PROTECTED ? 1 : 0;
+                static_cast<uint64_t>(crosHandle->usage) & BufferUsage::PROTECTED ? 1 : 0;
         status = android::gralloc4::encodeProtectedContent(hasProtectedContent, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Compression) {
         status = android::gralloc4::encodeCompression(android::gralloc4::Compression_None,
@@ -494,24 +515,24 @@ Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
                                                        &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_PlaneLayouts) {
         std::vector<PlaneLayout> planeLayouts;
-        getPlaneLayouts(crosBuffer->get_format(), &planeLayouts);
+        getPlaneLayouts(crosHandle->format, &planeLayouts);
 
         for (size_t plane = 0; plane < planeLayouts.size(); plane++) {
             PlaneLayout& planeLayout = planeLayouts[plane];
-            planeLayout.offsetInBytes = crosBuffer->get_plane_offset(plane);
-            planeLayout.strideInBytes = crosBuffer->get_plane_stride(plane);
-            planeLayout.totalSizeInBytes = crosBuffer->get_plane_size(plane);
+            planeLayout.offsetInBytes = crosHandle->offsets[plane];
+            planeLayout.strideInBytes = crosHandle->strides[plane];
+            planeLayout.totalSizeInBytes = crosHandle->sizes[plane];
             planeLayout.widthInSamples =
-                    crosBuffer->get_width() / planeLayout.horizontalSubsampling;
+                    crosHandle->width / planeLayout.horizontalSubsampling;
             planeLayout.heightInSamples =
-                    crosBuffer->get_height() / planeLayout.verticalSubsampling;
+                    crosHandle->height / planeLayout.verticalSubsampling;
         }
 
         status = android::gralloc4::encodePlaneLayouts(planeLayouts, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Crop) {
-        const uint32_t numPlanes = crosBuffer->get_num_planes();
-        const uint32_t w = crosBuffer->get_width();
-        const uint32_t h = crosBuffer->get_height();
+        const uint32_t numPlanes = crosHandle->num_planes;
+        const uint32_t w = crosHandle->width;
+        const uint32_t h = crosHandle->height;
         std::vector<aidl::android::hardware::graphics::common::Rect> crops;
         for (uint32_t plane = 0; plane < numPlanes; plane++) {
             aidl::android::hardware::graphics::common::Rect crop;
@@ -523,6 +544,60 @@ Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
         }
 
         status = android::gralloc4::encodeCrop(crops, &encodedMetadata);
+    } else if (metadataType == android::gralloc4::MetadataType_Smpte2094_40) {
+        status = android::gralloc4::encodeSmpte2094_40(std::nullopt, &encodedMetadata);
+    } else {
+        hidlCb(Error::UNSUPPORTED, encodedMetadata);
+        return Void();
+    }
+
+    if (status != android::NO_ERROR) {
+        hidlCb(Error::NO_RESOURCES, encodedMetadata);
+        ALOGE("Failed to get. Failed to encode metadata.");
+        return Void();
+    }
+
+    hidlCb(Error::NONE, encodedMetadata);
+    return Void();
+}
+
+Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
+                                     const MetadataType& metadataType, get_cb hidlCb) {
+    hidl_vec<uint8_t> encodedMetadata;
+
+    if (!mDriver) {
+        ALOGE("Failed to get. Driver is uninitialized.");
+        hidlCb(Error::NO_RESOURCES, encodedMetadata);
+        return Void();
+    }
+
+    if (!crosBuffer) {
+        ALOGE("Failed to get. Invalid buffer.");
+        hidlCb(Error::BAD_BUFFER, encodedMetadata);
+        return Void();
+    }
+
+    if (isImmutableMetadataType(metadataType)) {
+        return get(crosBuffer->get_handle(), metadataType, hidlCb);
+    }
+
+    const CrosGralloc4Metadata* crosMetadata = nullptr;
+    if (metadataType == android::gralloc4::MetadataType_BlendMode ||
+        metadataType == android::gralloc4::MetadataType_Cta861_3 ||
+        metadataType == android::gralloc4::MetadataType_Dataspace ||
+        metadataType == android::gralloc4::MetadataType_Name ||
+        metadataType == android::gralloc4::MetadataType_Smpte2086) {
+        Error error = getMetadata(crosBuffer, &crosMetadata);
+        if (error != Error::NONE) {
+            ALOGE("Failed to get. Failed to get buffer metadata.");
+            hidlCb(Error::NO_RESOURCES, encodedMetadata);
+            return Void();
+        }
+    }
+
+    android::status_t status = android::NO_ERROR;
+    if (metadataType == android::gralloc4::MetadataType_Name) {
+        status = android::gralloc4::encodeName(crosMetadata->name, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Dataspace) {
         status = android::gralloc4::encodeDataspace(crosMetadata->dataspace, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_BlendMode) {
@@ -531,8 +606,6 @@ Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
         status = android::gralloc4::encodeSmpte2086(crosMetadata->smpte2086, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Cta861_3) {
         status = android::gralloc4::encodeCta861_3(crosMetadata->cta861_3, &encodedMetadata);
-    } else if (metadataType == android::gralloc4::MetadataType_Smpte2094_40) {
-        status = android::gralloc4::encodeSmpte2094_40(std::nullopt, &encodedMetadata);
     } else {
         hidlCb(Error::UNSUPPORTED, encodedMetadata);
         return Void();
@@ -677,6 +750,16 @@ int CrosGralloc4Mapper::getResolvedDrmFormat(PixelFormat pixelFormat, uint64_t b
     return 0;
 }
 
+int CrosGralloc4Mapper::queryLayout(const BufferDescriptorInfo& descriptor, uint32_t* outDrmFormat,
+                                    struct drv_layout* outLayout) {
+    struct cros_gralloc_buffer_descriptor crosDescriptor;
+    if (convertToCrosDescriptor(descriptor, &crosDescriptor)) {
+        return -EINVAL;
+    }
+
+    return mDriver->query_layout(&crosDescriptor, outDrmFormat, outLayout);
+}
+
 Return<void> CrosGralloc4Mapper::getFromBufferDescriptorInfo(
         const BufferDescriptorInfo& descriptor, const MetadataType& metadataType,
         getFromBufferDescriptorInfo_cb hidlCb) {
@@ -707,6 +790,41 @@ Return<void> CrosGralloc4Mapper::getFromBufferDescriptorInfo(
         }
         status = android::gralloc4::encodePixelFormatFourCC(drv_get_standard_fourcc(drmFormat),
                                                             &encodedMetadata);
+    } else if (metadataType == android::gralloc4::MetadataType_PixelFormatModifier ||
+               metadataType == android::gralloc4::MetadataType_AllocationSize ||
+               metadataType == android::gralloc4::MetadataType_PlaneLayouts) {
+        uint32_t drmFormat;
+        struct drv_layout layout;
+        if (queryLayout(descriptor, &drmFormat, &layout)) {
+            hidlCb(Error::BAD_VALUE, encodedMetadata);
+            return Void();
+        }
+
+        if (metadataType == android::gralloc4::MetadataType_PixelFormatModifier) {
+            status = android::gralloc4::encodePixelFormatModifier(layout.format_modifier,
+                                                                  &encodedMetadata);
+        } else if (metadataType == android::gralloc4::MetadataType_AllocationSize) {
+            // Like the allocator, account for the reserved region holding the metadata.
+            uint64_t allocationSize =
+                    layout.total_size + descriptor.reservedSize + sizeof(CrosGralloc4Metadata);
+            status = android::gralloc4::encodeAllocationSize(allocationSize, &encodedMetadata);
+        } else {
+            std::vector<PlaneLayout> planeLayouts;
+            getPlaneLayouts(drmFormat, &planeLayouts);
+
+            for (size_t plane = 0; plane < planeLayouts.size(); plane++) {
+                PlaneLayout& planeLayout = planeLayouts[plane];
+                planeLayout.offsetInBytes = layout.offsets[plane];
+                planeLayout.strideInBytes = layout.strides[plane];
+                planeLayout.totalSizeInBytes = layout.sizes[plane];
+                planeLayout.widthInSamples =
+                        descriptor.width / planeLayout.horizontalSubsampling;
+                planeLayout.heightInSamples =
+                        descriptor.height / planeLayout.verticalSubsampling;
+            }
+
+            status = android::gralloc4::encodePlaneLayouts(planeLayouts, &encodedMetadata);
+        }
     } else if (metadataType == android::gralloc4::MetadataType_Usage) {
         status = android::gralloc4::encodeUsage(descriptor.usage, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_ProtectedContent) {
@@ -750,6 +868,16 @@ Return<void> CrosGralloc4Mapper::getFromBufferDescriptorInfo(
         status = android::gralloc4::encodeCta861_3(std::nullopt, &encodedMetadata);
     } else if (metadataType == android::gralloc4::MetadataType_Smpte2094_40) {
         status = android::gralloc4::encodeSmpte2094_40(std::nullopt, &encodedMetadata);
+    } else if (metadataType == kCrosGralloc4MetadataType_SupportedModifiers) {
+        struct cros_gralloc_buffer_descriptor crosDescriptor;
+        std::vector<uint64_t> modifiers;
+        if (convertToCrosDescriptor(descriptor, &crosDescriptor) ||
+            mDriver->get_supported_modifiers(&crosDescriptor, &modifiers)) {
+            hidlCb(Error::BAD_VALUE, encodedMetadata);
+            return Void();
+        }
+        encodedMetadata.resize(modifiers.size() * sizeof(uint64_t));
+        memcpy(encodedMetadata.data(), modifiers.data(), encodedMetadata.size());
     } else {
         hidlCb(Error::UNSUPPORTED, encodedMetadata);
         return Void();
@@ -894,6 +1022,13 @@ Return<void> CrosGralloc4Mapper::listSupportedMetadataTypes(listSupportedMetadat
                     /*isGettable=*/true,
                     /*isSettable=*/false,
             },
+            {
+                    kCrosGralloc4MetadataType_SupportedModifiers,
+                    "Format modifiers a buffer descriptor can be allocated with, most "
+                    "preferred first. Only available from getFromBufferDescriptorInfo().",
+                    /*isGettable=*/false,
+                    /*isSettable=*/false,
+            },
     });
 
     hidlCb(Error::NONE, supported);
@@ -1142,3 +1277,107 @@ Return<void> CrosGralloc4Mapper::getReservedRegion(void* rawHandle, getReservedR
 android::hardware::graphics::mapper::V4_0::IMapper* HIDL_FETCH_IMapper(const char* /*name*/) {
     return static_cast<android::hardware::graphics::mapper::V4_0::IMapper*>(new CrosGralloc4Mapper);
 }
+
+int32_t CrosGralloc4Mapper_lockMany(CrosGralloc4LockRequest* requests, uint32_t count) {
+    cros_gralloc_driver* driver = cros_gralloc_driver::get_instance();
+    std::vector<cros_gralloc_lock_request> batch;
+    std::vector<uint32_t> indices;
+    Error firstError = Error::NONE;
+
+    for (uint32_t i = 0; i < count; i++) {
+        CrosGralloc4LockRequest& request = requests[i];
+        cros_gralloc_handle_t crosHandle =
+                cros_gralloc_convert_handle(reinterpret_cast<buffer_handle_t>(request.rawHandle));
+        uint32_t mapUsage = 0;
+
+        request.outData = nullptr;
+        request.outError = static_cast<int32_t>(Error::NONE);
+
+        if (!driver) {
+            request.outError = static_cast<int32_t>(Error::NO_RESOURCES);
+        } else if (!crosHandle) {
+            request.outError = static_cast<int32_t>(Error::BAD_BUFFER);
+        } else if (request.cpuUsage == 0 || convertToMapUsage(request.cpuUsage, &mapUsage) ||
+                   request.left < 0 || request.top < 0 || request.width < 0 ||
+                   request.height < 0 || request.width > crosHandle->width ||
+                   request.height > crosHandle->height) {
+            request.outError = static_cast<int32_t>(Error::BAD_VALUE);
+        }
+
+        if (request.outError != static_cast<int32_t>(Error::NONE)) {
+            ALOGE("Failed to lockMany. Bad request %u.", i);
+            if (request.acquireFence >= 0) {
+                close(request.acquireFence);
+            }
+            if (firstError == Error::NONE) {
+                firstError = static_cast<Error>(request.outError);
+            }
+            continue;
+        }
+
+        struct rectangle rect = {static_cast<uint32_t>(request.left),
+                                 static_cast<uint32_t>(request.top),
+                                 static_cast<uint32_t>(request.width),
+                                 static_cast<uint32_t>(request.height)};
+
+        // An access region of all zeros means the entire buffer.
+        if (rect.x == 0 && rect.y == 0 && rect.width == 0 && rect.height == 0) {
+            rect.width = crosHandle->width;
+            rect.height = crosHandle->height;
+        }
+
+        cros_gralloc_lock_request lockRequest = {};
+        lockRequest.handle = reinterpret_cast<buffer_handle_t>(request.rawHandle);
+        lockRequest.acquire_fence = request.acquireFence;
+        lockRequest.rect = rect;
+        lockRequest.map_flags = mapUsage;
+        batch.push_back(lockRequest);
+        indices.push_back(i);
+    }
+
+    if (!batch.empty()) {
+        driver->lock_many(batch.data(), batch.size());
+    }
+
+    for (uint32_t i = 0; i < batch.size(); i++) {
+        CrosGralloc4LockRequest& request = requests[indices[i]];
+        if (batch[i].result) {
+            request.outError = static_cast<int32_t>(Error::BAD_VALUE);
+            if (firstError == Error::NONE) {
+                firstError = Error::BAD_VALUE;
+            }
+            continue;
+        }
+
+        request.outData = batch[i].addr[0];
+    }
+
+    return static_cast<int32_t>(firstError);
+}
+
+int32_t CrosGralloc4Mapper_unlockMany(CrosGralloc4UnlockRequest* requests, uint32_t count) {
+    cros_gralloc_driver* driver = cros_gralloc_driver::get_instance();
+    if (!driver) {
+        ALOGE("Failed to unlockMany. Driver is uninitialized.");
+        return static_cast<int32_t>(Error::BAD_BUFFER);
+    }
+
+    std::vector<cros_gralloc_unlock_request> batch(count);
+    for (uint32_t i = 0; i < count; i++) {
+        batch[i].handle = reinterpret_cast<buffer_handle_t>(requests[i].rawHandle);
+    }
+
+    driver->unlock_many(batch.data(), count);
+
+    Error firstError = Error::NONE;
+    for (uint32_t i = 0; i < count; i++) {
+        requests[i].outReleaseFence = batch[i].release_fence;
+        requests[i].outError =
+                static_cast<int32_t>(batch[i].result ? Error::BAD_BUFFER : Error::NONE);
+        if (batch[i].result && firstError == Error::NONE) {
+            firstError = Error::BAD_BUFFER;
+        }
+    }
+
+    return static_cast<int32_t>(firstError);
+}
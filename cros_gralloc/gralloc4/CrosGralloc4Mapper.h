@@ -84,6 +84,9 @@ class CrosGralloc4Mapper : public android::hardware::graphics::mapper::V4_0::IMa
     android::hardware::graphics::mapper::V4_0::Error getMutableMetadata(
             cros_gralloc_buffer* crosBuffer, CrosGralloc4Metadata** outMetadata);
 
+    android::hardware::Return<void> get(cros_gralloc_handle_t crosHandle,
+                                        const MetadataType& metadataType, get_cb hidlCb);
+
     android::hardware::Return<void> get(const cros_gralloc_buffer* crosBuffer,
                                         const MetadataType& metadataType, get_cb hidlCb);
 
@@ -97,7 +100,38 @@ class CrosGralloc4Mapper : public android::hardware::graphics::mapper::V4_0::IMa
     int getResolvedDrmFormat(android::hardware::graphics::common::V1_2::PixelFormat pixelFormat,
                              uint64_t bufferUsage, uint32_t* outDrmFormat);
 
+    int queryLayout(const BufferDescriptorInfo& descriptor, uint32_t* outDrmFormat,
+                    struct drv_layout* outLayout);
+
     cros_gralloc_driver* mDriver = cros_gralloc_driver::get_instance();
 };
 
 extern "C" android::hardware::graphics::mapper::V4_0::IMapper* HIDL_FETCH_IMapper(const char* name);
+
+/*
+ * Vendor extension for clients that lock several buffers back to back (camera HALs, multi-plane
+ * codecs). IMapper 4.0 cannot be extended, so these are looked up with dlsym() on the mapper
+ * library. Acquire fences are always consumed. outError holds a V4_0::Error value per buffer;
+ * the first error is returned.
+ */
+struct CrosGralloc4LockRequest {
+    void* rawHandle;
+    uint64_t cpuUsage;
+    int32_t left;
+    int32_t top;
+    int32_t width;
+    int32_t height;
+    int acquireFence;
+    void* outData;
+    int32_t outError;
+};
+
+struct CrosGralloc4UnlockRequest {
+    void* rawHandle;
+    int outReleaseFence;
+    int32_t outError;
+};
+
+extern "C" int32_t CrosGralloc4Mapper_lockMany(CrosGralloc4LockRequest* requests, uint32_t count);
+extern "C" int32_t CrosGralloc4Mapper_unlockMany(CrosGralloc4UnlockRequest* requests,
+                                                 uint32_t count);
@@ -6,6 +6,7 @@
 
 #include "cros_gralloc/gralloc4/CrosGralloc4Utils.h"
 
+#include <algorithm>
 #include <array>
 #include <unordered_map>
 
@@ -16,7 +17,9 @@
 #include <cutils/native_handle.h>
 #include <gralloctypes/Gralloc4.h>
 
+#include "cros_gralloc/cros_gralloc_driver.h"
 #include "cros_gralloc/cros_gralloc_helpers.h"
+#include "cros_gralloc/gralloc4/CrosGralloc4Metadata.h"
 
 using aidl::android::hardware::graphics::common::PlaneLayout;
 using aidl::android::hardware::graphics::common::PlaneLayoutComponent;
@@ -28,6 +31,9 @@ using android::hardware::graphics::common::V1_2::PixelFormat;
 
 using BufferDescriptorInfo =
         android::hardware::graphics::mapper::V4_0::IMapper::BufferDescriptorInfo;
+using MetadataType = android::hardware::graphics::mapper::V4_0::IMapper::MetadataType;
+
+const MetadataType kCrosGralloc4MetadataType_SupportedModifiers = {"org.chromium.minigbm", 1};
 
 std::string getPixelFormatString(PixelFormat format) {
     return android::hardware::graphics::common::V1_2::toString(format);
@@ -404,3 +410,138 @@ int getPlaneLayouts(uint32_t drmFormat, std::vector<PlaneLayout>* outPlaneLayout
     *outPlaneLayouts = it->second;
     return 0;
 }
+
+CrosGralloc4WorkerPool::~CrosGralloc4WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_all();
+
+    for (auto& thread : mThreads) {
+        thread.join();
+    }
+}
+
+bool CrosGralloc4WorkerPool::claimLocked(Job* job, uint32_t* outIndex) {
+    if (job->next >= job->count) {
+        return false;
+    }
+
+    *outIndex = job->next++;
+    if (job->next == job->count) {
+        mJobs.erase(std::find(mJobs.begin(), mJobs.end(), job));
+    }
+    return true;
+}
+
+void CrosGralloc4WorkerPool::finishLocked(Job* job) {
+    if (--job->pending == 0) {
+        job->done.notify_all();
+    }
+}
+
+void CrosGralloc4WorkerPool::workerLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (true) {
+        mCondition.wait(lock, [this] { return mStopping || !mJobs.empty(); });
+        if (mJobs.empty()) {
+            return;
+        }
+
+        // Exhausted jobs are dropped from the queue, so the front one always has an index left.
+        Job* job = mJobs.front();
+        uint32_t index;
+        claimLocked(job, &index);
+
+        lock.unlock();
+        (*job->function)(index);
+        lock.lock();
+
+        finishLocked(job);
+    }
+}
+
+void CrosGralloc4WorkerPool::run(uint32_t count, const std::function<void(uint32_t)>& function) {
+    if (count <= 1) {
+        for (uint32_t i = 0; i < count; i++) {
+            function(i);
+        }
+        return;
+    }
+
+    Job job;
+    job.function = &function;
+    job.count = count;
+    job.next = 0;
+    job.pending = count;
+
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (mThreads.size() + 1 < CROS_GRALLOC4_MAX_PARALLEL_THREADS) {
+        mThreads.emplace_back(&CrosGralloc4WorkerPool::workerLoop, this);
+    }
+
+    mJobs.push_back(&job);
+    mCondition.notify_all();
+
+    uint32_t index;
+    while (claimLocked(&job, &index)) {
+        lock.unlock();
+        function(index);
+        lock.lock();
+
+        finishLocked(&job);
+    }
+
+    job.done.wait(lock, [&job] { return job.pending == 0; });
+}
+
+int CrosGralloc4DescriptorCache::get(cros_gralloc_driver* driver, const uint8_t* encoded,
+                                     size_t encodedSize, BufferDescriptorInfo* outDescriptor,
+                                     struct cros_gralloc_buffer_descriptor* outCrosDescriptor) {
+    std::string key(reinterpret_cast<const char*>(encoded), encodedSize);
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mEntries.find(key);
+        if (it != mEntries.end()) {
+            *outDescriptor = it->second.descriptor;
+            *outCrosDescriptor = it->second.crosDescriptor;
+            return it->second.result;
+        }
+    }
+
+    android::hardware::hidl_vec<uint8_t> encodedVec;
+    encodedVec.setToExternal(const_cast<uint8_t*>(encoded), encodedSize);
+
+    int ret = android::gralloc4::decodeBufferDescriptorInfo(encodedVec, outDescriptor);
+    if (ret) {
+        ALOGE("Failed to decode buffer descriptor: %d.", ret);
+        return -EINVAL;
+    }
+
+    Entry entry = {};
+    entry.descriptor = *outDescriptor;
+    entry.result = 0;
+    if (convertToCrosDescriptor(entry.descriptor, &entry.crosDescriptor)) {
+        entry.result = -ENOTSUP;
+    } else {
+        entry.crosDescriptor.reserved_region_size += sizeof(CrosGralloc4Metadata);
+        if (!driver->is_supported(&entry.crosDescriptor)) {
+            entry.result = -ENOTSUP;
+        }
+    }
+
+    *outCrosDescriptor = entry.crosDescriptor;
+    ret = entry.result;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mEntries.size() >= CROS_GRALLOC4_DESCRIPTOR_CACHE_SIZE) {
+        mEntries.clear();
+    }
+    mEntries.emplace(std::move(key), std::move(entry));
+
+    return ret;
+}
@@ -4,14 +4,31 @@
  * found in the LICENSE file.
  */
 
+#ifndef CROSGRALLOC4UTILS_H
+#define CROSGRALLOC4UTILS_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <aidl/android/hardware/graphics/common/PlaneLayout.h>
 #include <android/hardware/graphics/common/1.2/types.h>
 #include <android/hardware/graphics/mapper/4.0/IMapper.h>
 
-struct cros_gralloc_buffer_descriptor;
+#include "cros_gralloc/cros_gralloc_helpers.h"
+
+class cros_gralloc_driver;
+
+/* Maximum number of decoded descriptors kept by CrosGralloc4DescriptorCache. */
+#define CROS_GRALLOC4_DESCRIPTOR_CACHE_SIZE 64
+
+/* Maximum number of threads, including the calling one, used by a CrosGralloc4WorkerPool. */
+#define CROS_GRALLOC4_MAX_PARALLEL_THREADS 4
 
 std::string getPixelFormatString(android::hardware::graphics::common::V1_2::PixelFormat format);
 
@@ -37,3 +54,76 @@ int convertToFenceHandle(int fence_fd, android::hardware::hidl_handle* out_fence
 int getPlaneLayouts(
         uint32_t drm_format,
         std::vector<aidl::android::hardware::graphics::common::PlaneLayout>* out_layouts);
+
+/*
+ * minigbm specific metadata type, only available through getFromBufferDescriptorInfo(), that
+ * lists the format modifiers the descriptor can be allocated with, most preferred first, as an
+ * array of uint64_t in host byte order.
+ */
+extern const android::hardware::graphics::mapper::V4_0::IMapper::MetadataType
+        kCrosGralloc4MetadataType_SupportedModifiers;
+
+/*
+ * Worker threads owned by an allocator for the lifetime of the service. They are started on the
+ * first run() that has more than one index and are shared by concurrent run() calls.
+ */
+class CrosGralloc4WorkerPool {
+  public:
+    ~CrosGralloc4WorkerPool();
+
+    /*
+     * Calls |function| once for every index below |count| and returns when all calls are done.
+     * The calling thread takes part, together with up to CROS_GRALLOC4_MAX_PARALLEL_THREADS - 1
+     * workers, so |function| must be safe to run concurrently.
+     */
+    void run(uint32_t count, const std::function<void(uint32_t)>& function);
+
+  private:
+    struct Job {
+        const std::function<void(uint32_t)>* function;
+        uint32_t count;
+        uint32_t next;
+        uint32_t pending;
+        std::condition_variable done;
+    };
+
+    bool claimLocked(Job* job, uint32_t* outIndex);
+    void finishLocked(Job* job);
+    void workerLoop();
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    /* Jobs with indices left to hand out, oldest first. */
+    std::deque<Job*> mJobs;
+    std::vector<std::thread> mThreads;
+    bool mStopping = false;
+};
+
+/*
+ * Allocation descriptors that have already been decoded, converted and checked against the
+ * driver, keyed by their encoded bytes. Clients tend to allocate the same kinds of buffers over
+ * and over, so this skips the decode and the support check for all but the first allocation.
+ */
+class CrosGralloc4DescriptorCache {
+  public:
+    /*
+     * Returns 0 on success, -EINVAL if the encoded descriptor cannot be decoded or -ENOTSUP if
+     * the driver cannot allocate it. |outDescriptor| is filled in whenever decoding succeeded.
+     * |outCrosDescriptor| already includes room for the gralloc4 metadata in its reserved region.
+     */
+    int get(cros_gralloc_driver* driver, const uint8_t* encoded, size_t encodedSize,
+            android::hardware::graphics::mapper::V4_0::IMapper::BufferDescriptorInfo* outDescriptor,
+            struct cros_gralloc_buffer_descriptor* outCrosDescriptor);
+
+  private:
+    struct Entry {
+        android::hardware::graphics::mapper::V4_0::IMapper::BufferDescriptorInfo descriptor;
+        struct cros_gralloc_buffer_descriptor crosDescriptor;
+        int result;
+    };
+
+    std::mutex mMutex;
+    std::unordered_map<std::string, Entry> mEntries;
+};
+
+#endif
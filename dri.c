@@ -251,6 +251,9 @@ int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suf
 			      (const __DRIextension **)&dri->flush_extension))
 		goto free_context;
 
+	if (pthread_mutex_init(&dri->context_lock, NULL))
+		goto free_context;
+
 	return 0;
 
 free_context:
@@ -272,6 +275,7 @@ void dri_close(struct driver *drv)
 {
 	struct dri_driver *dri = drv->priv;
 
+	pthread_mutex_destroy(&dri->context_lock);
 	dri->core_extension->destroyContext(dri->context);
 	dri->core_extension->destroyScreen(dri->device);
 	dlclose(dri->driver_handle);
@@ -425,10 +429,12 @@ void *dri_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flag
 {
 	struct dri_driver *dri = bo->drv->priv;
 
-	/* GBM flags and DRI flags are the same. */
+	/* The DRI context is not thread-safe. GBM flags and DRI flags are the same. */
+	pthread_mutex_lock(&dri->context_lock);
 	vma->addr = dri->image_extension->mapImage(dri->context, bo->priv, 0, 0, bo->meta.width,
 						   bo->meta.height, map_flags,
 						   (int *)&vma->map_strides[plane], &vma->priv);
+	pthread_mutex_unlock(&dri->context_lock);
 	if (!vma->addr)
 		return MAP_FAILED;
 
@@ -440,6 +446,7 @@ int dri_bo_unmap(struct bo *bo, struct vma *vma)
 	struct dri_driver *dri = bo->drv->priv;
 
 	assert(vma->priv);
+	pthread_mutex_lock(&dri->context_lock);
 	dri->image_extension->unmapImage(dri->context, bo->priv, vma->priv);
 
 	/*
@@ -451,6 +458,7 @@ int dri_bo_unmap(struct bo *bo, struct vma *vma)
 	 */
 
 	dri->flush_extension->flush_with_flags(dri->context, NULL, __DRI2_FLUSH_CONTEXT, 0);
+	pthread_mutex_unlock(&dri->context_lock);
 	return 0;
 }
 
@@ -6,6 +6,8 @@
 
 #ifdef DRV_AMDGPU
 
+#include <pthread.h>
+
 // Avoid transitively including a bunch of unnecessary headers.
 #define GL_GLEXT_LEGACY
 #include "GL/internal/dri_interface.h"
@@ -18,6 +20,7 @@ struct dri_driver {
 	void *driver_handle;
 	__DRIscreen *device;
 	__DRIcontext *context; /* Needed for map/unmap operations. */
+	pthread_mutex_t context_lock; /* bo_map may run on several threads at once. */
 	const __DRIextension **extensions;
 	const __DRIcoreExtension *core_extension;
 	const __DRIdri2Extension *dri2_extension;
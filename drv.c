@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <xf86drm.h>
@@ -145,20 +146,43 @@ struct driver *drv_create(int fd)
 	if (!drv->mappings)
 		goto free_mappings_lock;
 
+	drv->pending_maps = drv_array_init(sizeof(struct pending_map));
+	if (!drv->pending_maps)
+		goto free_mappings;
+
+	if (pthread_cond_init(&drv->pending_maps_cond, NULL))
+		goto free_pending_maps;
+
+	if (pthread_mutex_init(&drv->layout_cache_lock, NULL))
+		goto free_pending_maps_cond;
+
+	if (pthread_mutex_init(&drv->scanout_formats_lock, NULL))
+		goto free_layout_cache_lock;
+
 	drv->combos = drv_array_init(sizeof(struct combination));
 	if (!drv->combos)
-		goto free_mappings;
+		goto free_scanout_formats_lock;
 
 	if (drv->backend->init) {
 		ret = drv->backend->init(drv);
 		if (ret) {
+			if (drv->scanout_formats)
+				drv_array_destroy(drv->scanout_formats);
 			drv_array_destroy(drv->combos);
-			goto free_mappings;
+			goto free_scanout_formats_lock;
 		}
 	}
 
 	return drv;
 
+free_scanout_formats_lock:
+	pthread_mutex_destroy(&drv->scanout_formats_lock);
+free_layout_cache_lock:
+	pthread_mutex_destroy(&drv->layout_cache_lock);
+free_pending_maps_cond:
+	pthread_cond_destroy(&drv->pending_maps_cond);
+free_pending_maps:
+	drv_array_destroy(drv->pending_maps);
 free_mappings:
 	drv_array_destroy(drv->mappings);
 free_mappings_lock:
@@ -178,7 +202,14 @@ void drv_destroy(struct driver *drv)
 		drv->backend->close(drv);
 
 	drv_array_destroy(drv->combos);
+	if (drv->scanout_formats)
+		drv_array_destroy(drv->scanout_formats);
+	pthread_mutex_destroy(&drv->scanout_formats_lock);
+
+	pthread_mutex_destroy(&drv->layout_cache_lock);
 
+	pthread_cond_destroy(&drv->pending_maps_cond);
+	drv_array_destroy(drv->pending_maps);
 	drv_array_destroy(drv->mappings);
 	pthread_mutex_destroy(&drv->mappings_lock);
 
@@ -200,21 +231,110 @@ const char *drv_get_name(struct driver *drv)
 
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags)
 {
-	struct combination *curr, *best;
+	struct combination *curr, *best, *fallback;
 
 	if (format == DRM_FORMAT_NONE || use_flags == BO_USE_NONE)
 		return 0;
 
 	best = NULL;
+	fallback = NULL;
 	uint32_t i;
 	for (i = 0; i < drv_array_size(drv->combos); i++) {
 		curr = drv_array_at_idx(drv->combos, i);
-		if ((format == curr->format) && use_flags == (curr->use_flags & use_flags))
-			if (!best || best->metadata.priority < curr->metadata.priority)
-				best = curr;
+		if ((format != curr->format) || use_flags != (curr->use_flags & use_flags))
+			continue;
+
+		/* Prefer layouts the display planes can actually scan out. */
+		if ((use_flags & BO_USE_SCANOUT) &&
+		    !drv_is_scanout_capable(drv, format, curr->metadata.modifier)) {
+			if (!fallback || fallback->metadata.priority < curr->metadata.priority)
+				fallback = curr;
+			continue;
+		}
+
+		if (!best || best->metadata.priority < curr->metadata.priority)
+			best = curr;
 	}
 
-	return best;
+	return best ? best : fallback;
+}
+
+/*
+ * Lists the modifiers of the combinations usable for |format| and |use_flags|, highest priority
+ * first and otherwise in the order they were added.
+ */
+static uint32_t drv_get_combination_modifiers(struct driver *drv, uint32_t format,
+					      uint64_t use_flags,
+					      uint64_t modifiers[DRV_MAX_MODIFIERS])
+{
+	uint32_t priorities[DRV_MAX_MODIFIERS];
+	uint32_t i, j, count = 0;
+	struct combination *combo;
+
+	for (i = 0; i < drv_array_size(drv->combos); i++) {
+		combo = drv_array_at_idx(drv->combos, i);
+		if (combo->format != format || (combo->use_flags & use_flags) != use_flags)
+			continue;
+
+		for (j = 0; j < count; j++)
+			if (modifiers[j] == combo->metadata.modifier)
+				break;
+
+		if (j < count) {
+			if (priorities[j] < combo->metadata.priority)
+				priorities[j] = combo->metadata.priority;
+		} else if (count < DRV_MAX_MODIFIERS) {
+			modifiers[count] = combo->metadata.modifier;
+			priorities[count++] = combo->metadata.priority;
+		}
+	}
+
+	for (i = 1; i < count; i++) {
+		uint64_t modifier = modifiers[i];
+		uint32_t priority = priorities[i];
+
+		for (j = i; j > 0 && priorities[j - 1] < priority; j--) {
+			modifiers[j] = modifiers[j - 1];
+			priorities[j] = priorities[j - 1];
+		}
+
+		modifiers[j] = modifier;
+		priorities[j] = priority;
+	}
+
+	return count;
+}
+
+uint32_t drv_get_modifiers(struct driver *drv, uint32_t format, uint64_t use_flags,
+			   uint64_t *modifiers, uint32_t max)
+{
+	uint64_t supported[DRV_MAX_MODIFIERS];
+	uint32_t count;
+
+	if (use_flags != BO_USE_NONE && !drv_get_combination(drv, format, use_flags))
+		return 0;
+
+	if (drv->backend->get_modifiers)
+		count = drv->backend->get_modifiers(drv, format, use_flags, supported);
+	else
+		count = drv_get_combination_modifiers(drv, format, use_flags, supported);
+
+	/* Only list what the display planes accept for scanout, unless that is nothing. */
+	if (use_flags & BO_USE_SCANOUT) {
+		uint32_t i, kept = 0;
+
+		for (i = 0; i < count; i++)
+			if (drv_is_scanout_capable(drv, format, supported[i]))
+				supported[kept++] = supported[i];
+
+		if (kept)
+			count = kept;
+	}
+
+	if (modifiers)
+		memcpy(modifiers, supported, (count < max ? count : max) * sizeof(*modifiers));
+
+	return count;
 }
 
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
@@ -338,6 +458,21 @@ static bool drv_bo_release(struct bo *bo)
 	return true;
 }
 
+/* Computes the layout drv_bo_create() would give |bo| without allocating it. */
+static int drv_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				 uint64_t use_flags)
+{
+	const struct backend *backend = bo->drv->backend;
+
+	if (backend->bo_compute_metadata)
+		return backend->bo_compute_metadata(bo, width, height, format, use_flags, NULL, 0);
+
+	if (backend->bo_compute_layout)
+		return backend->bo_compute_layout(bo, width, height, format, use_flags);
+
+	return -EINVAL;
+}
+
 struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 			 uint64_t use_flags)
 {
@@ -353,13 +488,14 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 	if (!bo)
 		return NULL;
 
-	ret = -EINVAL;
-	if (drv->backend->bo_compute_metadata) {
+	if (is_test_alloc) {
+		ret = drv_bo_compute_layout(bo, width, height, format, use_flags);
+	} else if (drv->backend->bo_compute_metadata) {
 		ret = drv->backend->bo_compute_metadata(bo, width, height, format, use_flags, NULL,
 							0);
-		if (!is_test_alloc && ret == 0)
+		if (ret == 0)
 			ret = drv->backend->bo_create_from_metadata(bo);
-	} else if (!is_test_alloc) {
+	} else {
 		ret = drv->backend->bo_create(bo, width, height, format, use_flags);
 	}
 
@@ -374,33 +510,92 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 	return bo;
 }
 
-struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
-					uint32_t format, const uint64_t *modifiers, uint32_t count)
+/*
+ * Drops the modifiers that the backend's combinations rule out for |use_flags|, and for scanout
+ * the ones no display plane accepts. Modifiers the backend never listed a combination for are
+ * left for the backend to judge. Returns the number of modifiers kept in |out|, or |count|
+ * unfiltered ones if none would be left.
+ */
+static uint32_t drv_filter_modifiers(struct driver *drv, uint32_t format, uint64_t use_flags,
+				     const uint64_t *modifiers, uint32_t count, uint64_t *out)
+{
+	struct combination *combo;
+	uint32_t i, j, kept = 0;
+
+	for (i = 0; i < count; i++) {
+		bool listed = false;
+		bool usable = false;
+
+		if ((use_flags & BO_USE_SCANOUT) &&
+		    !drv_is_scanout_capable(drv, format, modifiers[i]))
+			continue;
+
+		for (j = 0; j < drv_array_size(drv->combos); j++) {
+			combo = drv_array_at_idx(drv->combos, j);
+			if (combo->format != format || combo->metadata.modifier != modifiers[i])
+				continue;
+
+			listed = true;
+			if ((combo->use_flags & use_flags) == use_flags) {
+				usable = true;
+				break;
+			}
+		}
+
+		if (usable || !listed)
+			out[kept++] = modifiers[i];
+	}
+
+	if (kept)
+		return kept;
+
+	memcpy(out, modifiers, count * sizeof(*modifiers));
+	return count;
+}
+
+struct bo *drv_bo_create_with_modifiers2(struct driver *drv, uint32_t width, uint32_t height,
+					 uint32_t format, uint64_t use_flags,
+					 const uint64_t *modifiers, uint32_t count)
 {
 	int ret;
 	struct bo *bo;
+	uint64_t *usable_modifiers = NULL;
 
 	if (!drv->backend->bo_create_with_modifiers && !drv->backend->bo_compute_metadata) {
 		errno = ENOENT;
 		return NULL;
 	}
 
-	bo = drv_bo_new(drv, width, height, format, BO_USE_NONE, false);
+	if (use_flags != BO_USE_NONE && count) {
+		usable_modifiers = calloc(count, sizeof(*usable_modifiers));
+		if (!usable_modifiers)
+			return NULL;
 
-	if (!bo)
+		count = drv_filter_modifiers(drv, format, use_flags, modifiers, count,
+					     usable_modifiers);
+		modifiers = usable_modifiers;
+	}
+
+	bo = drv_bo_new(drv, width, height, format, use_flags, false);
+
+	if (!bo) {
+		free(usable_modifiers);
 		return NULL;
+	}
 
 	ret = -EINVAL;
 	if (drv->backend->bo_compute_metadata) {
-		ret = drv->backend->bo_compute_metadata(bo, width, height, format, BO_USE_NONE,
+		ret = drv->backend->bo_compute_metadata(bo, width, height, format, use_flags,
 							modifiers, count);
 		if (ret == 0)
 			ret = drv->backend->bo_create_from_metadata(bo);
 	} else {
-		ret = drv->backend->bo_create_with_modifiers(bo, width, height, format, modifiers,
-							     count);
+		ret = drv->backend->bo_create_with_modifiers(bo, width, height, format, use_flags,
+							     modifiers, count);
 	}
 
+	free(usable_modifiers);
+
 	if (ret) {
 		free(bo);
 		return NULL;
@@ -411,6 +606,13 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 	return bo;
 }
 
+struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
+					uint32_t format, const uint64_t *modifiers, uint32_t count)
+{
+	return drv_bo_create_with_modifiers2(drv, width, height, format, BO_USE_NONE, modifiers,
+					     count);
+}
+
 void drv_bo_destroy(struct bo *bo)
 {
 	if (!bo->is_test_buffer && drv_bo_release(bo)) {
@@ -421,12 +623,123 @@ void drv_bo_destroy(struct bo *bo)
 	free(bo);
 }
 
+static bool drv_layout_cache_lookup(struct driver *drv, uint32_t width, uint32_t height,
+				    uint32_t format, uint64_t use_flags, struct bo_metadata *meta)
+{
+	struct layout_cache_entry *entry;
+	bool found = false;
+	uint32_t i;
+
+	pthread_mutex_lock(&drv->layout_cache_lock);
+	for (i = 0; i < drv->layout_cache_size; i++) {
+		entry = &drv->layout_cache[i];
+		if (entry->width == width && entry->height == height && entry->format == format &&
+		    entry->use_flags == use_flags) {
+			*meta = entry->meta;
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&drv->layout_cache_lock);
+
+	return found;
+}
+
+static void drv_layout_cache_insert(struct driver *drv, uint32_t width, uint32_t height,
+				    uint32_t format, uint64_t use_flags,
+				    const struct bo_metadata *meta)
+{
+	struct layout_cache_entry *entry;
+
+	pthread_mutex_lock(&drv->layout_cache_lock);
+	entry = &drv->layout_cache[drv->layout_cache_next];
+	entry->width = width;
+	entry->height = height;
+	entry->format = format;
+	entry->use_flags = use_flags;
+	entry->meta = *meta;
+
+	drv->layout_cache_next = (drv->layout_cache_next + 1) % DRV_LAYOUT_CACHE_SIZE;
+	if (drv->layout_cache_size < DRV_LAYOUT_CACHE_SIZE)
+		drv->layout_cache_size++;
+	pthread_mutex_unlock(&drv->layout_cache_lock);
+}
+
+/*
+ * Returns the layout drv_bo_create() would give a buffer, without allocating one when the
+ * backend can compute layouts on its own. Other backends only learn the layout from the kernel,
+ * so a buffer is allocated and freed again. Either way the layout is cached for later queries.
+ */
+int drv_bo_query_layout(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, struct drv_layout *layout)
+{
+	struct bo_metadata meta;
+	struct bo *bo;
+	size_t plane;
+	int ret;
+
+	if (!drv_layout_cache_lookup(drv, width, height, format, use_flags, &meta)) {
+		if (drv->backend->bo_compute_metadata || drv->backend->bo_compute_layout) {
+			bo = drv_bo_new(drv, width, height, format, use_flags, true);
+			if (!bo)
+				return -errno;
+
+			ret = drv_bo_compute_layout(bo, width, height, format, use_flags);
+			meta = bo->meta;
+			free(bo);
+			if (ret)
+				return ret;
+		} else {
+			bo = drv_bo_create(drv, width, height, format, use_flags);
+			if (!bo)
+				return errno ? -errno : -EINVAL;
+
+			meta = bo->meta;
+			drv_bo_destroy(bo);
+		}
+
+		drv_layout_cache_insert(drv, width, height, format, use_flags, &meta);
+	}
+
+	memset(layout, 0, sizeof(*layout));
+	layout->num_planes = meta.num_planes;
+	for (plane = 0; plane < meta.num_planes; plane++) {
+		layout->strides[plane] = meta.strides[plane];
+		layout->offsets[plane] = meta.offsets[plane];
+		layout->sizes[plane] = meta.sizes[plane];
+	}
+	layout->format_modifier = meta.format_modifier;
+	layout->tiling = meta.tiling;
+	layout->total_size = meta.total_size;
+
+	return 0;
+}
+
+/* Returns the size of the dma-buf behind |fd|, preferring a single fstat() over seeking. */
+static int64_t drv_dmabuf_size(int fd)
+{
+	struct stat st;
+	off_t seek_end;
+
+	if (!fstat(fd, &st) && st.st_size > 0)
+		return st.st_size;
+
+	seek_end = lseek(fd, 0, SEEK_END);
+	if (seek_end == (off_t)(-1)) {
+		drv_loge("lseek() failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	return seek_end;
+}
+
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 {
 	int ret;
 	size_t plane;
 	struct bo *bo;
-	off_t seek_end;
+	int64_t buf_size = 0;
 
 	bo = drv_bo_new(drv, data->width, data->height, data->format, data->use_flags, false);
 
@@ -446,19 +759,20 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 		bo->meta.strides[plane] = data->strides[plane];
 		bo->meta.offsets[plane] = data->offsets[plane];
 
-		seek_end = lseek(data->fds[plane], 0, SEEK_END);
-		if (seek_end == (off_t)(-1)) {
-			drv_loge("lseek() failed with %s\n", strerror(errno));
-			goto destroy_bo;
+		if (plane == 0 || data->fds[plane] != data->fds[plane - 1]) {
+			buf_size = drv_dmabuf_size(data->fds[plane]);
+			if (buf_size < 0)
+				goto destroy_bo;
 		}
 
-		lseek(data->fds[plane], 0, SEEK_SET);
-		if (plane == bo->meta.num_planes - 1 || data->offsets[plane + 1] == 0)
-			bo->meta.sizes[plane] = seek_end - data->offsets[plane];
+		if (data->sizes[plane])
+			bo->meta.sizes[plane] = data->sizes[plane];
+		else if (plane == bo->meta.num_planes - 1 || data->offsets[plane + 1] == 0)
+			bo->meta.sizes[plane] = buf_size - data->offsets[plane];
 		else
 			bo->meta.sizes[plane] = data->offsets[plane + 1] - data->offsets[plane];
 
-		if ((int64_t)bo->meta.offsets[plane] + bo->meta.sizes[plane] > seek_end) {
+		if ((int64_t)bo->meta.offsets[plane] + bo->meta.sizes[plane] > buf_size) {
 			drv_loge("buffer size is too large.\n");
 			goto destroy_bo;
 		}
@@ -473,13 +787,60 @@ destroy_bo:
 	return NULL;
 }
 
-void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
-		 struct mapping **map_data, size_t plane)
+/*
+ * Buffers whose use flags only allow CPU access never hand their contents to a device, so they
+ * stay CPU-owned once synchronized. Buffers created without any use flags may go anywhere.
+ */
+static bool drv_bo_device_accessible(struct bo *bo)
+{
+	if (bo->meta.use_flags == BO_USE_NONE)
+		return true;
+
+	return bo->meta.use_flags & ~(BO_USE_SW_READ_OFTEN | BO_USE_SW_READ_RARELY |
+				      BO_USE_SW_WRITE_OFTEN | BO_USE_SW_WRITE_RARELY |
+				      BO_USE_LINEAR | BO_USE_TEST_ALLOC);
+}
+
+/* Assumes drv->mappings_lock is held. */
+static void drv_bo_cpu_access_done(struct bo *bo, struct mapping *mapping)
+{
+	mapping->cpu_access = false;
+	if (--bo->cpu_users || !drv_bo_device_accessible(bo))
+		return;
+
+	/* The device may access the buffer from now on; the next CPU access resynchronizes. */
+	bo->cpu_owned = false;
+	bo->cpu_access = 0;
+}
+
+/* Assumes drv->mappings_lock is held. */
+static int drv_find_pending_map(struct driver *drv, const struct pending_map *pending)
+{
+	uint32_t i;
+
+	for (i = 0; i < drv_array_size(drv->pending_maps); i++) {
+		struct pending_map *map = drv_array_at_idx(drv->pending_maps, i);
+		if (map->handle == pending->handle && map->map_flags == pending->map_flags)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Maps the buffer without starting a CPU access. The caller must call drv_bo_begin_cpu_access()
+ * before touching the memory, which allows the mapping to be set up while the device is still
+ * using the buffer if drv_bo_map_is_pure_mmap().
+ */
+void *drv_bo_map_unsynchronized(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+				struct mapping **map_data, size_t plane)
 {
 	struct driver *drv = bo->drv;
 	uint32_t i;
-	uint8_t *addr;
+	uint8_t *addr = MAP_FAILED;
+	struct vma *vma;
 	struct mapping mapping = { 0 };
+	struct pending_map pending;
 
 	assert(rect->width >= 0);
 	assert(rect->height >= 0);
@@ -495,12 +856,15 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	mapping.rect = *rect;
 	mapping.refcount = 1;
 
+	pending.handle = bo->handles[plane].u32;
+	pending.map_flags = map_flags;
+
 	pthread_mutex_lock(&drv->mappings_lock);
 
+retry:
 	for (i = 0; i < drv_array_size(drv->mappings); i++) {
 		struct mapping *prior = (struct mapping *)drv_array_at_idx(drv->mappings, i);
-		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
+		if (prior->vma->handle != pending.handle || prior->vma->map_flags != map_flags)
 			continue;
 
 		if (rect->x != prior->rect.x || rect->y != prior->rect.y ||
@@ -514,8 +878,7 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 
 	for (i = 0; i < drv_array_size(drv->mappings); i++) {
 		struct mapping *prior = (struct mapping *)drv_array_at_idx(drv->mappings, i);
-		if (prior->vma->handle != bo->handles[plane].u32 ||
-		    prior->vma->map_flags != map_flags)
+		if (prior->vma->handle != pending.handle || prior->vma->map_flags != map_flags)
 			continue;
 
 		prior->vma->refcount++;
@@ -523,50 +886,102 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 		goto success;
 	}
 
-	mapping.vma = calloc(1, sizeof(*mapping.vma));
-	if (!mapping.vma) {
-		*map_data = NULL;
-		pthread_mutex_unlock(&drv->mappings_lock);
-		return MAP_FAILED;
+	/* Another thread is mapping this handle; wait for it and share its vma. */
+	if (drv_find_pending_map(drv, &pending) >= 0) {
+		pthread_cond_wait(&drv->pending_maps_cond, &drv->mappings_lock);
+		goto retry;
 	}
 
-	memcpy(mapping.vma->map_strides, bo->meta.strides, sizeof(mapping.vma->map_strides));
-	addr = drv->backend->bo_map(bo, mapping.vma, plane, map_flags);
-	if (addr == MAP_FAILED) {
-		*map_data = NULL;
-		free(mapping.vma);
+	drv_array_append(drv->pending_maps, &pending);
+	pthread_mutex_unlock(&drv->mappings_lock);
+
+	/*
+	 * Creating a CPU mapping can be slow (staging copies, host round-trips), so it is done
+	 * without mappings_lock. The pending entry keeps a second bo_map of the same handle out.
+	 */
+	vma = calloc(1, sizeof(*vma));
+	if (vma) {
+		memcpy(vma->map_strides, bo->meta.strides, sizeof(vma->map_strides));
+		addr = drv->backend->bo_map(bo, vma, plane, map_flags);
+	}
+
+	pthread_mutex_lock(&drv->mappings_lock);
+	drv_array_remove(drv->pending_maps, drv_find_pending_map(drv, &pending));
+	pthread_cond_broadcast(&drv->pending_maps_cond);
+
+	if (!vma || addr == MAP_FAILED) {
 		pthread_mutex_unlock(&drv->mappings_lock);
+		*map_data = NULL;
+		free(vma);
 		return MAP_FAILED;
 	}
 
-	mapping.vma->refcount = 1;
-	mapping.vma->addr = addr;
-	mapping.vma->handle = bo->handles[plane].u32;
-	mapping.vma->map_flags = map_flags;
+	vma->refcount = 1;
+	vma->addr = addr;
+	vma->handle = pending.handle;
+	vma->map_flags = map_flags;
+	mapping.vma = vma;
 
 success:
 	*map_data = drv_array_append(drv->mappings, &mapping);
 exact_match:
-	drv_bo_invalidate(bo, *map_data);
+	pthread_mutex_unlock(&drv->mappings_lock);
 	addr = (uint8_t *)((*map_data)->vma->addr);
 	addr += drv_bo_get_plane_offset(bo, plane);
-	pthread_mutex_unlock(&drv->mappings_lock);
 	return (void *)addr;
 }
 
+void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+		 struct mapping **map_data, size_t plane)
+{
+	void *addr = drv_bo_map_unsynchronized(bo, rect, map_flags, map_data, plane);
+	int ret;
+
+	if (addr == MAP_FAILED)
+		return addr;
+
+	ret = drv_bo_begin_cpu_access(bo, *map_data);
+	if (ret) {
+		drv_bo_unmap(bo, *map_data);
+		*map_data = NULL;
+		errno = -ret;
+		return MAP_FAILED;
+	}
+
+	return addr;
+}
+
 int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
+{
+	return drv_bo_unmap_with_fence(bo, mapping, NULL);
+}
+
+/*
+ * Unmaps the mapping. If release_fence is non-NULL, a backend that writes back on unmap may
+ * return a sync_file in it instead of waiting for the write-back; it is -1 otherwise.
+ */
+int drv_bo_unmap_with_fence(struct bo *bo, struct mapping *mapping, int *release_fence)
 {
 	struct driver *drv = bo->drv;
 	uint32_t i;
 	int ret = 0;
 
+	if (release_fence)
+		*release_fence = -1;
+
 	pthread_mutex_lock(&drv->mappings_lock);
 
 	if (--mapping->refcount)
 		goto out;
 
+	if (mapping->cpu_access)
+		drv_bo_cpu_access_done(bo, mapping);
+
 	if (!--mapping->vma->refcount) {
-		ret = drv->backend->bo_unmap(bo, mapping->vma);
+		if (release_fence && drv->backend->bo_unmap_with_fence)
+			ret = drv->backend->bo_unmap_with_fence(bo, mapping->vma, release_fence);
+		else
+			ret = drv->backend->bo_unmap(bo, mapping->vma);
 		free(mapping->vma);
 	}
 
@@ -598,6 +1013,15 @@ int drv_bo_invalidate(struct bo *bo, struct mapping *mapping)
 }
 
 int drv_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	return drv_bo_flush_with_fence(bo, mapping, NULL);
+}
+
+/*
+ * Flushes CPU writes through the mapping. If release_fence is non-NULL, the backend may return
+ * a sync_file in it instead of waiting for the flush to complete; it is -1 otherwise.
+ */
+int drv_bo_flush_with_fence(struct bo *bo, struct mapping *mapping, int *release_fence)
 {
 	int ret = 0;
 
@@ -606,7 +1030,12 @@ int drv_bo_flush(struct bo *bo, struct mapping *mapping)
 	assert(mapping->refcount > 0);
 	assert(mapping->vma->refcount > 0);
 
-	if (bo->drv->backend->bo_flush)
+	if (release_fence)
+		*release_fence = -1;
+
+	if (bo->drv->backend->bo_flush_with_fence)
+		ret = bo->drv->backend->bo_flush_with_fence(bo, mapping, release_fence);
+	else if (bo->drv->backend->bo_flush)
 		ret = bo->drv->backend->bo_flush(bo, mapping);
 
 	return ret;
@@ -614,6 +1043,12 @@ int drv_bo_flush(struct bo *bo, struct mapping *mapping)
 
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 {
+	return drv_bo_flush_or_unmap_with_fence(bo, mapping, NULL);
+}
+
+int drv_bo_flush_or_unmap_with_fence(struct bo *bo, struct mapping *mapping, int *release_fence)
+{
+	int unmap_fence;
 	int ret = 0;
 
 	assert(mapping);
@@ -622,14 +1057,129 @@ int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 	assert(mapping->vma->refcount > 0);
 	assert(!(bo->meta.use_flags & BO_USE_PROTECTED));
 
-	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, mapping);
-	else
-		ret = drv_bo_unmap(bo, mapping);
+	if (release_fence)
+		*release_fence = -1;
+
+	ret = drv_bo_end_cpu_access(bo, mapping, release_fence);
+	if (bo->drv->backend->bo_flush || bo->drv->backend->bo_flush_with_fence)
+		return ret;
+
+	if (!release_fence)
+		return drv_bo_unmap(bo, mapping);
+
+	/* Backends without a flush hook write back on unmap; hand out both fences as one. */
+	ret = drv_bo_unmap_with_fence(bo, mapping, &unmap_fence);
+	drv_fence_merge(release_fence, unmap_fence);
+
+	return ret;
+}
+
+/* Assumes drv->mappings_lock is held. */
+static void drv_bo_cpu_access_started(struct bo *bo, struct mapping *mapping)
+{
+	bo->cpu_owned = true;
+	bo->cpu_access |= mapping->vma->map_flags;
+	if (!mapping->cpu_access) {
+		mapping->cpu_access = true;
+		bo->cpu_users++;
+	}
+}
+
+/*
+ * Starts a CPU access through the mapping if that needs no cache maintenance, i.e. the backend
+ * has no invalidate hook or the buffer is already CPU-owned for the mapping's access flags.
+ * Returns -EAGAIN otherwise, without touching the buffer.
+ */
+int drv_bo_try_begin_cpu_access(struct bo *bo, struct mapping *mapping)
+{
+	struct driver *drv = bo->drv;
+	uint32_t map_flags = mapping->vma->map_flags;
+	int ret = -EAGAIN;
+
+	pthread_mutex_lock(&drv->mappings_lock);
+	if (!drv->backend->bo_invalidate ||
+	    (bo->cpu_owned && (bo->cpu_access & map_flags) == map_flags)) {
+		drv_bo_cpu_access_started(bo, mapping);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&drv->mappings_lock);
+
+	return ret;
+}
+
+/*
+ * Starts a CPU access through the mapping. Caches are only invalidated when the buffer is not
+ * already CPU-owned for the mapping's access flags, e.g. not for concurrent or nested readers,
+ * and the backend can't tell cheaply that the device left nothing to wait for or invalidate.
+ */
+int drv_bo_begin_cpu_access(struct bo *bo, struct mapping *mapping)
+{
+	struct driver *drv = bo->drv;
+	bool invalidated = false;
+	int ret;
+
+	if (!drv_bo_try_begin_cpu_access(bo, mapping))
+		return 0;
+
+	if (!drv->backend->bo_needs_invalidate || drv->backend->bo_needs_invalidate(bo, mapping)) {
+		ret = drv_bo_invalidate(bo, mapping);
+		if (ret)
+			return ret;
+
+		invalidated = true;
+	}
+
+	pthread_mutex_lock(&drv->mappings_lock);
+	drv_bo_cpu_access_started(bo, mapping);
+	mapping->invalidated = invalidated;
+	pthread_mutex_unlock(&drv->mappings_lock);
+
+	return 0;
+}
+
+/*
+ * Ends a CPU access through the mapping. Writable mappings are flushed, as are read-only ones
+ * whose access invalidated caches, so the backend can close what its invalidate opened (e.g. a
+ * DMA_BUF_SYNC_START). Once the last CPU access ends, ownership returns to the device.
+ */
+int drv_bo_end_cpu_access(struct bo *bo, struct mapping *mapping, int *release_fence)
+{
+	struct driver *drv = bo->drv;
+	int ret = 0;
+
+	if (release_fence)
+		*release_fence = -1;
+
+	if ((mapping->vma->map_flags & BO_MAP_WRITE) || mapping->invalidated)
+		ret = drv_bo_flush_with_fence(bo, mapping, release_fence);
+
+	pthread_mutex_lock(&drv->mappings_lock);
+	mapping->invalidated = false;
+	if (mapping->cpu_access)
+		drv_bo_cpu_access_done(bo, mapping);
+	pthread_mutex_unlock(&drv->mappings_lock);
 
 	return ret;
 }
 
+/*
+ * Whether a mapping may be kept across CPU accesses, i.e. the backend either makes CPU writes
+ * visible with a flush or needs nothing but munmap() to tear the mapping down.
+ */
+bool drv_bo_can_cache_mapping(struct bo *bo)
+{
+	const struct backend *backend = bo->drv->backend;
+
+	return backend->bo_flush || backend->bo_flush_with_fence ||
+	       backend->bo_unmap == drv_bo_munmap;
+}
+
+/* Whether drv_bo_map_unsynchronized() may run before the buffer's acquire fence signals. */
+bool drv_bo_map_is_pure_mmap(struct bo *bo)
+{
+	return bo->drv->backend->map_is_pure_mmap;
+}
+
 uint32_t drv_bo_get_width(struct bo *bo)
 {
 	return bo->meta.width;
@@ -828,6 +1378,11 @@ int drv_resource_info(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 	return 0;
 }
 
+bool drv_resource_info_is_static(struct driver *drv)
+{
+	return !drv->backend->resource_info;
+}
+
 uint32_t drv_get_max_texture_2d_size(struct driver *drv)
 {
 	if (drv->backend->get_max_texture_2d_size)
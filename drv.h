@@ -98,6 +98,8 @@ struct drv_import_fd_data {
 	int fds[DRV_MAX_PLANES];
 	uint32_t strides[DRV_MAX_PLANES];
 	uint32_t offsets[DRV_MAX_PLANES];
+	/* Optional plane sizes, derived from the offsets and the dma-buf size when zero. */
+	uint32_t sizes[DRV_MAX_PLANES];
 	uint64_t format_modifier;
 	uint32_t width;
 	uint32_t height;
@@ -106,6 +108,17 @@ struct drv_import_fd_data {
 	uint64_t use_flags;
 };
 
+/* Layout of a buffer that was not necessarily allocated, see drv_bo_query_layout(). */
+struct drv_layout {
+	uint32_t num_planes;
+	uint32_t strides[DRV_MAX_PLANES];
+	uint32_t offsets[DRV_MAX_PLANES];
+	uint32_t sizes[DRV_MAX_PLANES];
+	uint64_t format_modifier;
+	uint32_t tiling;
+	uint64_t total_size;
+};
+
 struct vma {
 	void *addr;
 	size_t length;
@@ -127,6 +140,10 @@ struct mapping {
 	struct vma *vma;
 	struct rectangle rect;
 	uint32_t refcount;
+	/* Whether a CPU access begun through this mapping has not been ended yet. */
+	bool cpu_access;
+	/* Whether that access invalidated caches, so ending it must flush even if read-only. */
+	bool invalidated;
 };
 
 struct driver *drv_create(int fd);
@@ -148,21 +165,47 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count);
 
+struct bo *drv_bo_create_with_modifiers2(struct driver *drv, uint32_t width, uint32_t height,
+					 uint32_t format, uint64_t use_flags,
+					 const uint64_t *modifiers, uint32_t count);
+
 void drv_bo_destroy(struct bo *bo);
 
+int drv_bo_query_layout(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, struct drv_layout *layout);
+
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data);
 
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
 		 struct mapping **map_data, size_t plane);
 
+void *drv_bo_map_unsynchronized(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+				struct mapping **map_data, size_t plane);
+
 int drv_bo_unmap(struct bo *bo, struct mapping *mapping);
 
+int drv_bo_unmap_with_fence(struct bo *bo, struct mapping *mapping, int *release_fence);
+
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_flush(struct bo *bo, struct mapping *mapping);
 
+int drv_bo_flush_with_fence(struct bo *bo, struct mapping *mapping, int *release_fence);
+
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping);
 
+int drv_bo_flush_or_unmap_with_fence(struct bo *bo, struct mapping *mapping, int *release_fence);
+
+int drv_bo_try_begin_cpu_access(struct bo *bo, struct mapping *mapping);
+
+int drv_bo_begin_cpu_access(struct bo *bo, struct mapping *mapping);
+
+int drv_bo_end_cpu_access(struct bo *bo, struct mapping *mapping, int *release_fence);
+
+bool drv_bo_can_cache_mapping(struct bo *bo);
+
+bool drv_bo_map_is_pure_mmap(struct bo *bo);
+
 uint32_t drv_bo_get_width(struct bo *bo);
 
 uint32_t drv_bo_get_height(struct bo *bo);
@@ -206,11 +249,22 @@ size_t drv_num_planes_from_format(uint32_t format);
 
 size_t drv_num_planes_from_modifier(struct driver *drv, uint32_t format, uint64_t modifier);
 
+/*
+ * Stores up to |max| of the modifiers |format| can be allocated with for |use_flags| in
+ * |modifiers|, most preferred first, and returns the total number of them. BO_USE_NONE matches
+ * any usage.
+ */
+uint32_t drv_get_modifiers(struct driver *drv, uint32_t format, uint64_t use_flags,
+			   uint64_t *modifiers, uint32_t max);
+
 uint32_t drv_num_buffers_per_bo(struct bo *bo);
 
 int drv_resource_info(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 		      uint32_t offsets[DRV_MAX_PLANES], uint64_t *format_modifier);
 
+/* Whether drv_resource_info() always reports the layout the bo was created or imported with. */
+bool drv_resource_info_is_static(struct driver *drv);
+
 uint32_t drv_get_max_texture_2d_size(struct driver *drv);
 
 enum drv_log_level {
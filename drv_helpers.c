@@ -8,13 +8,19 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/sync_file.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <xf86drm.h>
+#include <xf86drmMode.h>
 
 #include "drv_priv.h"
 #include "util.h"
@@ -264,6 +270,49 @@ static uint32_t subsample_stride(uint32_t stride, uint32_t format, size_t plane)
 	return stride;
 }
 
+/*
+ * Folds the constraints of |constraints| that apply to |format| and |use_flags| into |merged|,
+ * keeping the strictest alignment and the largest padding of each kind.
+ */
+void drv_merge_layout_constraints(const struct layout_constraint *constraints, uint32_t count,
+				  uint32_t format, uint64_t use_flags,
+				  struct layout_constraint *merged)
+{
+	const struct layout_constraint *c;
+	uint32_t i;
+	size_t p;
+
+	for (i = 0; i < count; i++) {
+		c = &constraints[i];
+		if ((c->format && c->format != format) || (use_flags & c->use_flags) != c->use_flags)
+			continue;
+
+		merged->width_align = MAX(merged->width_align, c->width_align);
+		merged->stride_align = MAX(merged->stride_align, c->stride_align);
+		for (p = 0; p < DRV_MAX_PLANES; p++)
+			merged->height_align[p] = MAX(merged->height_align[p], c->height_align[p]);
+		merged->offset_align = MAX(merged->offset_align, c->offset_align);
+		merged->size_align = MAX(merged->size_align, c->size_align);
+		merged->padding_height = MAX(merged->padding_height, c->padding_height);
+	}
+}
+
+/*
+ * Returns in |constraint| what the backend's constraints require of |bo| laid out as |format|.
+ */
+void drv_bo_get_layout_constraint(struct bo *bo, uint32_t format,
+				  struct layout_constraint *constraint)
+{
+	memset(constraint, 0, sizeof(*constraint));
+	drv_merge_layout_constraints(bo->drv->layout_constraints, bo->drv->num_layout_constraints,
+				     format, bo->meta.use_flags, constraint);
+}
+
+static uint32_t round_up(uint32_t value, uint32_t alignment)
+{
+	return alignment ? DIV_ROUND_UP(value, alignment) * alignment : value;
+}
+
 /*
  * This function fills in the buffer object given the driver aligned stride of
  * the first plane, height and a format. This function assumes there is just
@@ -280,6 +329,7 @@ int drv_bo_from_format_and_padding(struct bo *bo, uint32_t stride, uint32_t alig
 {
 	size_t p, num_planes;
 	uint32_t offset = 0;
+	struct layout_constraint constraint;
 
 	num_planes = drv_num_planes_from_format(format);
 	assert(num_planes);
@@ -295,19 +345,42 @@ int drv_bo_from_format_and_padding(struct bo *bo, uint32_t stride, uint32_t alig
 		assert(stride == ALIGN(stride, 32));
 	}
 
+	drv_bo_get_layout_constraint(bo, format, &constraint);
+	if (constraint.width_align)
+		stride = round_up(stride, drv_stride_from_format(format, constraint.width_align, 0));
+	stride = round_up(stride, constraint.stride_align);
+	aligned_height = round_up(aligned_height, constraint.height_align[0]);
+
 	for (p = 0; p < num_planes; p++) {
+		uint32_t height = drv_height_from_format(format, aligned_height, p);
+
+		if (p > 0) {
+			height = round_up(height, constraint.height_align[p]);
+			offset = round_up(offset, constraint.offset_align);
+		}
+
+		height += constraint.padding_height / drv_vertical_subsampling_from_format(format, p);
+
 		bo->meta.strides[p] = subsample_stride(stride, format, p);
-		bo->meta.sizes[p] =
-		    drv_size_from_format(format, bo->meta.strides[p], aligned_height, p) +
-		    padding[p];
+		bo->meta.sizes[p] = bo->meta.strides[p] * height + padding[p];
 		bo->meta.offsets[p] = offset;
 		offset += bo->meta.sizes[p];
 	}
 
-	bo->meta.total_size = offset;
+	bo->meta.total_size = round_up(offset, constraint.size_align);
 	return 0;
 }
 
+/*
+ * HAL_PIXEL_FORMAT_Y16 requires that the buffer's width be 16 pixel aligned, see
+ * hardware/interfaces/graphics/common/1.0/types.hal. HAL_PIXEL_FORMAT_YV12 buffers are 32 pixel
+ * aligned so chroma strides are 16 bytes as Android requires.
+ */
+static const struct layout_constraint dumb_layout_constraints[] = {
+	{ .format = DRM_FORMAT_R16, .width_align = 16 },
+	{ .format = DRM_FORMAT_YVU420_ANDROID, .width_align = 32 },
+};
+
 int drv_dumb_bo_create_ex(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			  uint64_t use_flags, uint64_t quirks)
 {
@@ -315,25 +388,20 @@ int drv_dumb_bo_create_ex(struct bo *bo, uint32_t width, uint32_t height, uint32
 	size_t plane;
 	uint32_t aligned_width, aligned_height;
 	struct drm_mode_create_dumb create_dumb = { 0 };
+	struct layout_constraint constraint = { 0 };
+
+	drv_merge_layout_constraints(dumb_layout_constraints, ARRAY_SIZE(dumb_layout_constraints),
+				     format, use_flags, &constraint);
 
-	aligned_width = width;
-	aligned_height = height;
+	aligned_width = round_up(width, constraint.width_align);
+	aligned_height = round_up(height, constraint.height_align[0]);
 	switch (format) {
-	case DRM_FORMAT_R16:
-		/* HAL_PIXEL_FORMAT_Y16 requires that the buffer's width be 16 pixel
-		 * aligned. See hardware/interfaces/graphics/common/1.0/types.hal. */
-		aligned_width = ALIGN(width, 16);
-		break;
 	case DRM_FORMAT_YVU420_ANDROID:
 		/* HAL_PIXEL_FORMAT_YV12 requires that the buffer's height not
 		 * be aligned. Update 'height' so that drv_bo_from_format below
 		 * uses the non-aligned height. */
 		height = bo->meta.height;
 
-		/* Align width to 32 pixels, so chroma strides are 16 bytes as
-		 * Android requires. */
-		aligned_width = ALIGN(width, 32);
-
 		/* Adjust the height to include room for chroma planes. */
 		aligned_height = 3 * DIV_ROUND_UP(height, 2);
 		break;
@@ -489,6 +557,76 @@ int drv_get_prot(uint32_t map_flags)
 	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
 }
 
+/*
+ * Starts or ends a CPU access to a dma-buf for the BO_MAP_* flags. Starting waits for the devices
+ * using the buffer and both do whatever cache maintenance the exporter needs.
+ */
+int drv_dmabuf_sync(int dmabuf_fd, uint32_t map_flags, bool start)
+{
+	struct dma_buf_sync sync = { 0 };
+	int ret;
+
+	sync.flags = start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END;
+	if (map_flags & BO_MAP_READ)
+		sync.flags |= DMA_BUF_SYNC_READ;
+	if (map_flags & BO_MAP_WRITE)
+		sync.flags |= DMA_BUF_SYNC_WRITE;
+
+	do {
+		ret = ioctl(dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+	} while (ret && (errno == EINTR || errno == EAGAIN));
+
+	if (ret) {
+		drv_loge("DMA_BUF_IOCTL_SYNC failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+void drv_fence_wait_and_close(int fence)
+{
+	struct pollfd pfd = { .fd = fence, .events = POLLIN };
+
+	while (poll(&pfd, 1, -1) < 0 && (errno == EINTR || errno == EAGAIN))
+		;
+
+	close(fence);
+}
+
+/*
+ * Merges the sync_file |fence| into |*merged|, taking ownership of both; either may be -1. If
+ * the kernel can't merge them, both are waited on here and *merged becomes -1.
+ */
+int drv_fence_merge(int *merged, int fence)
+{
+	struct sync_merge_data data = { .name = "minigbm", .fd2 = fence };
+	int ret;
+
+	if (fence < 0)
+		return 0;
+
+	if (*merged < 0) {
+		*merged = fence;
+		return 0;
+	}
+
+	ret = drmIoctl(*merged, SYNC_IOC_MERGE, &data);
+	if (ret) {
+		ret = -errno;
+		drv_loge("SYNC_IOC_MERGE failed with %s\n", strerror(errno));
+		drv_fence_wait_and_close(*merged);
+		drv_fence_wait_and_close(fence);
+		*merged = -1;
+		return ret;
+	}
+
+	close(*merged);
+	close(fence);
+	*merged = data.fence;
+	return 0;
+}
+
 void drv_add_combination(struct driver *drv, const uint32_t format,
 			 struct format_metadata *metadata, uint64_t use_flags)
 {
@@ -573,6 +711,194 @@ bool drv_has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier)
 	return false;
 }
 
+/*
+ * Whether a combination allocates |format| with |modifier| and supports all of |use_flags|.
+ */
+bool drv_has_combination_with_modifier(struct driver *drv, uint32_t format, uint64_t use_flags,
+				       uint64_t modifier)
+{
+	uint32_t i;
+	struct combination *combo;
+
+	for (i = 0; i < drv_array_size(drv->combos); i++) {
+		combo = drv_array_at_idx(drv->combos, i);
+		if (combo->format == format && combo->metadata.modifier == modifier &&
+		    (combo->use_flags & use_flags) == use_flags)
+			return true;
+	}
+
+	return false;
+}
+
+struct scanout_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+static void drv_add_scanout_format(struct drv_array *table, uint32_t format, uint64_t modifier)
+{
+	struct scanout_format entry = { format, modifier };
+	struct scanout_format *curr;
+	uint32_t i;
+
+	for (i = 0; i < drv_array_size(table); i++) {
+		curr = drv_array_at_idx(table, i);
+		if (curr->format == format && curr->modifier == modifier)
+			return;
+	}
+
+	drv_array_append(table, &entry);
+}
+
+static void drv_add_in_formats_blob(struct drv_array *table, const void *data, uint32_t length)
+{
+	const struct drm_format_modifier_blob *header = data;
+	const struct drm_format_modifier *modifiers;
+	const uint32_t *formats;
+	uint32_t i, j;
+
+	if (length < sizeof(*header) ||
+	    header->formats_offset + (uint64_t)header->count_formats * sizeof(*formats) > length ||
+	    header->modifiers_offset + (uint64_t)header->count_modifiers * sizeof(*modifiers) >
+		length)
+		return;
+
+	formats = (const void *)((const uint8_t *)data + header->formats_offset);
+	modifiers = (const void *)((const uint8_t *)data + header->modifiers_offset);
+
+	for (i = 0; i < header->count_modifiers; i++) {
+		for (j = 0; j < 64 && modifiers[i].offset + j < header->count_formats; j++) {
+			if (modifiers[i].formats & (1ULL << j))
+				drv_add_scanout_format(table, formats[modifiers[i].offset + j],
+						       modifiers[i].modifier);
+		}
+	}
+}
+
+static void drv_add_plane_formats(struct drv_array *table, int fd, drmModePlanePtr plane)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	drmModePropertyBlobPtr blob;
+	bool has_in_formats = false;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+	for (i = 0; props && i < props->count_props && !has_in_formats; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, "IN_FORMATS")) {
+			blob = drmModeGetPropertyBlob(fd, props->prop_values[i]);
+			if (blob) {
+				drv_add_in_formats_blob(table, blob->data, blob->length);
+				drmModeFreePropertyBlob(blob);
+				has_in_formats = true;
+			}
+		}
+
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	/* Planes without IN_FORMATS only take buffers without explicit modifiers. */
+	if (!has_in_formats) {
+		for (i = 0; i < plane->count_formats; i++)
+			drv_add_scanout_format(table, plane->formats[i], DRM_FORMAT_MOD_LINEAR);
+	}
+}
+
+/*
+ * Reads the formats and modifiers the KMS planes of the device behind |fd| accept, through its
+ * primary node so that render node users get them too. The node is opened read-only and any
+ * DRM master the open handed out is dropped right away. Returns NULL if the device has no
+ * planes or they can't be queried.
+ */
+struct drv_array *drv_load_scanout_formats(int fd)
+{
+	struct drv_array *table = NULL;
+	drmModePlaneResPtr resources;
+	drmModePlanePtr plane;
+	char *primary_name;
+	int kms_fd;
+	uint32_t i;
+
+	primary_name = drmGetPrimaryDeviceNameFromFd(fd);
+	if (!primary_name)
+		return NULL;
+
+	kms_fd = open(primary_name, O_RDONLY | O_CLOEXEC);
+	free(primary_name);
+	if (kms_fd < 0)
+		return NULL;
+
+	/* Opening the primary node of a device without a master makes the opener master. */
+	if (drmIsMaster(kms_fd))
+		drmDropMaster(kms_fd);
+
+	if (drmSetClientCap(kms_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1))
+		goto close_fd;
+
+	resources = drmModeGetPlaneResources(kms_fd);
+	if (!resources)
+		goto close_fd;
+
+	table = drv_array_init(sizeof(struct scanout_format));
+	if (!table)
+		goto free_resources;
+
+	for (i = 0; i < resources->count_planes; i++) {
+		plane = drmModeGetPlane(kms_fd, resources->planes[i]);
+		if (!plane)
+			continue;
+
+		drv_add_plane_formats(table, kms_fd, plane);
+		drmModeFreePlane(plane);
+	}
+
+	if (!drv_array_size(table)) {
+		drv_array_destroy(table);
+		table = NULL;
+	}
+
+free_resources:
+	drmModeFreePlaneResources(resources);
+close_fd:
+	close(kms_fd);
+	return table;
+}
+
+/*
+ * Whether some KMS plane can scan out |format| laid out with |modifier|. Without plane
+ * information every layout is assumed to be scanout capable.
+ */
+bool drv_is_scanout_capable(struct driver *drv, uint32_t format, uint64_t modifier)
+{
+	struct scanout_format *curr;
+	uint32_t i;
+
+	if (!__atomic_load_n(&drv->scanout_formats_loaded, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&drv->scanout_formats_lock);
+		if (!drv->scanout_formats_loaded) {
+			drv->scanout_formats = drv_load_scanout_formats(drv->fd);
+			__atomic_store_n(&drv->scanout_formats_loaded, true, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&drv->scanout_formats_lock);
+	}
+
+	if (!drv->scanout_formats)
+		return true;
+
+	for (i = 0; i < drv_array_size(drv->scanout_formats); i++) {
+		curr = drv_array_at_idx(drv->scanout_formats, i);
+		if (curr->format == format && curr->modifier == modifier)
+			return true;
+	}
+
+	return false;
+}
+
 void drv_resolve_format_and_use_flags_helper(struct driver *drv, uint32_t format,
 					     uint64_t use_flags, uint32_t *out_format,
 					     uint64_t *out_use_flags)
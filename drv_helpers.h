@@ -17,10 +17,16 @@
 #endif
 
 struct format_metadata;
+struct layout_constraint;
 
 uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane);
 uint32_t drv_vertical_subsampling_from_format(uint32_t format, size_t plane);
 uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height, size_t plane);
+void drv_merge_layout_constraints(const struct layout_constraint *constraints, uint32_t count,
+				  uint32_t format, uint64_t use_flags,
+				  struct layout_constraint *merged);
+void drv_bo_get_layout_constraint(struct bo *bo, uint32_t format,
+				  struct layout_constraint *constraint);
 int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height, uint32_t format);
 int drv_bo_from_format_and_padding(struct bo *bo, uint32_t stride, uint32_t aligned_height,
 				   uint32_t format, uint32_t padding[DRV_MAX_PLANES]);
@@ -34,6 +40,9 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data);
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 int drv_bo_munmap(struct bo *bo, struct vma *vma);
 int drv_get_prot(uint32_t map_flags);
+int drv_dmabuf_sync(int dmabuf_fd, uint32_t map_flags, bool start);
+void drv_fence_wait_and_close(int fence);
+int drv_fence_merge(int *merged, int fence);
 void drv_add_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			 uint64_t usage);
 void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
@@ -44,6 +53,10 @@ int drv_modify_linear_combinations(struct driver *drv);
 uint64_t drv_pick_modifier(const uint64_t *modifiers, uint32_t count,
 			   const uint64_t *modifier_order, uint32_t order_count);
 bool drv_has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier);
+bool drv_has_combination_with_modifier(struct driver *drv, uint32_t format, uint64_t use_flags,
+				       uint64_t modifier);
+struct drv_array *drv_load_scanout_formats(int fd);
+bool drv_is_scanout_capable(struct driver *drv, uint32_t format, uint64_t modifier);
 void drv_resolve_format_and_use_flags_helper(struct driver *drv, uint32_t format,
 					     uint64_t use_flags, uint32_t *out_format,
 					     uint64_t *out_use_flags);
@@ -15,6 +15,12 @@
 
 #include "drv.h"
 
+/* Maximum number of modifiers a backend can list for one format and usage. */
+#define DRV_MAX_MODIFIERS 64
+
+/* Number of layouts drv_bo_query_layout() remembers per driver. */
+#define DRV_LAYOUT_CACHE_SIZE 32
+
 struct bo_metadata {
 	uint32_t width;
 	uint32_t height;
@@ -46,6 +52,14 @@ struct bo {
 	bool is_test_buffer;
 	union bo_handle handles[DRV_MAX_PLANES];
 	void *priv;
+	/*
+	 * CPU/device ownership of the contents, guarded by drv->mappings_lock. While cpu_owned,
+	 * CPU caches are in sync for the BO_MAP_* flags in cpu_access, so further CPU accesses
+	 * need no invalidate. cpu_users counts mappings inside a begin/end CPU access.
+	 */
+	bool cpu_owned;
+	uint32_t cpu_access;
+	uint32_t cpu_users;
 };
 
 struct format_metadata {
@@ -60,6 +74,35 @@ struct combination {
 	uint64_t use_flags;
 };
 
+/*
+ * Layout requirements of the devices a buffer is shared with. A constraint applies to |format|,
+ * or to every format if zero, when all of |use_flags| are requested. Zero fields impose nothing
+ * and alignments must be powers of two.
+ */
+struct layout_constraint {
+	uint32_t format;
+	uint64_t use_flags;
+	uint32_t width_align;			/* pixels */
+	uint32_t stride_align;			/* bytes, of the first plane */
+	uint32_t height_align[DRV_MAX_PLANES];	/* rows; the first plane's also sets the others' */
+	uint32_t offset_align;			/* bytes, of every plane but the first */
+	uint32_t size_align;			/* bytes, of the whole buffer */
+	uint32_t padding_height;		/* rows added to every plane, before subsampling */
+};
+
+struct layout_cache_entry {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+	struct bo_metadata meta;
+};
+
+struct pending_map {
+	uint32_t handle;
+	uint32_t map_flags;
+};
+
 struct driver {
 	int fd;
 	const struct backend *backend;
@@ -68,7 +111,31 @@ struct driver {
 	void *buffer_table;
 	pthread_mutex_t mappings_lock;
 	struct drv_array *mappings;
+	/*
+	 * (handle, map_flags) pairs a bo_map is in flight for, guarded by mappings_lock. Other
+	 * maps of the same pair wait on pending_maps_cond and share the resulting vma.
+	 */
+	struct drv_array *pending_maps;
+	pthread_cond_t pending_maps_cond;
 	struct drv_array *combos;
+	/*
+	 * Formats and modifiers the KMS planes accept, or NULL if unknown. Only read once a
+	 * scanout layout is asked about, so most processes never open the primary node.
+	 */
+	pthread_mutex_t scanout_formats_lock;
+	bool scanout_formats_loaded;
+	struct drv_array *scanout_formats;
+	/*
+	 * Applied by drv_bo_from_format_and_padding(), so backends setting these must compute the
+	 * layout before allocating.
+	 */
+	const struct layout_constraint *layout_constraints;
+	uint32_t num_layout_constraints;
+	/* Recently queried layouts, replaced round robin once full. */
+	pthread_mutex_t layout_cache_lock;
+	struct layout_cache_entry layout_cache[DRV_LAYOUT_CACHE_SIZE];
+	uint32_t layout_cache_size;
+	uint32_t layout_cache_next;
 	bool compression;
 };
 
@@ -79,27 +146,71 @@ struct backend {
 	int (*bo_create)(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			 uint64_t use_flags);
 	int (*bo_create_with_modifiers)(struct bo *bo, uint32_t width, uint32_t height,
-					uint32_t format, const uint64_t *modifiers, uint32_t count);
+					uint32_t format, uint64_t use_flags,
+					const uint64_t *modifiers, uint32_t count);
 	// Either both or neither _metadata functions must be implemented.
 	// If the functions are implemented, bo_create and bo_create_with_modifiers must not be.
 	int (*bo_compute_metadata)(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 				   uint64_t use_flags, const uint64_t *modifiers, uint32_t count);
 	int (*bo_create_from_metadata)(struct bo *bo);
+	/*
+	 * Optional for backends without the _metadata functions: fills in bo->meta exactly like
+	 * bo_create would, without allocating anything or calling into the kernel.
+	 */
+	int (*bo_compute_layout)(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				 uint64_t use_flags);
 	/* Called for every non-test-buffer BO on free */
 	int (*bo_release)(struct bo *bo);
 	/* Called on free if this bo is the last object referencing the contained GEM BOs */
 	int (*bo_destroy)(struct bo *bo);
 	int (*bo_import)(struct bo *bo, struct drv_import_fd_data *data);
+	/*
+	 * Called without the driver's mappings lock, but never concurrently for the same GEM
+	 * handle and map flags. Maps of the same handle with other flags may run concurrently,
+	 * so backends must serialize any per-handle state they share themselves.
+	 */
 	void *(*bo_map)(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 	int (*bo_unmap)(struct bo *bo, struct vma *vma);
+	/*
+	 * Set if bo_map only maps the buffer's memory and reads none of its contents, so a
+	 * mapping may be set up before the GPU is done writing the buffer. Backends that copy
+	 * or blit at map time must leave it unset.
+	 */
+	bool map_is_pure_mmap;
+	/*
+	 * Optional variant of bo_unmap for backends that write back on unmap. It returns a
+	 * sync_file in out_fence signaling completion of the write-back; same contract as
+	 * bo_flush_with_fence.
+	 */
+	int (*bo_unmap_with_fence)(struct bo *bo, struct vma *vma, int *out_fence);
+	/*
+	 * Optional cheap check, run before bo_invalidate when a CPU access starts, of whether the
+	 * device may still hold work the access has to wait for or caches it has to invalidate.
+	 * Returning false skips bo_invalidate, and with it the matching end-of-access flush of
+	 * read-only mappings.
+	 */
+	bool (*bo_needs_invalidate)(struct bo *bo, struct mapping *mapping);
 	int (*bo_invalidate)(struct bo *bo, struct mapping *mapping);
 	int (*bo_flush)(struct bo *bo, struct mapping *mapping);
+	/*
+	 * Optional variant of bo_flush that returns a sync_file in out_fence signaling completion
+	 * of the flush instead of waiting for it. out_fence may be NULL if the caller can't take
+	 * a fence, in which case the backend must finish the flush synchronously.
+	 */
+	int (*bo_flush_with_fence)(struct bo *bo, struct mapping *mapping, int *out_fence);
 	int (*bo_get_plane_fd)(struct bo *bo, size_t plane);
 	uint32_t (*bo_get_map_stride)(struct bo *bo);
 	void (*resolve_format_and_use_flags)(struct driver *drv, uint32_t format,
 					     uint64_t use_flags, uint32_t *out_format,
 					     uint64_t *out_use_flags);
 	size_t (*num_planes_from_modifier)(struct driver *drv, uint32_t format, uint64_t modifier);
+	/*
+	 * Optional: fills |modifiers| with the modifiers |format| can be allocated with for
+	 * |use_flags|, most preferred first, and returns how many there are. Without it the
+	 * modifiers of the usable combinations are listed in order of priority.
+	 */
+	uint32_t (*get_modifiers)(struct driver *drv, uint32_t format, uint64_t use_flags,
+				  uint64_t modifiers[DRV_MAX_MODIFIERS]);
 	int (*resource_info)(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 			     uint32_t offsets[DRV_MAX_PLANES], uint64_t *format_modifier);
 	uint32_t (*get_max_texture_2d_size)(struct driver *drv);
@@ -20,6 +20,7 @@
 		.bo_import = drv_prime_bo_import,                                                  \
 		.bo_map = drv_dumb_bo_map,                                                         \
 		.bo_unmap = drv_bo_munmap,                                                         \
+		.map_is_pure_mmap = true,                                                          \
 		.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,           \
 	};
 
@@ -51,11 +52,12 @@ static int dumb_driver_init(struct driver *drv)
 }
 
 static int dumb_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
-					 uint32_t format, const uint64_t *modifiers, uint32_t count)
+					 uint32_t format, uint64_t use_flags,
+					 const uint64_t *modifiers, uint32_t count)
 {
 	for (uint32_t i = 0; i < count; i++) {
 		if (modifiers[i] == DRM_FORMAT_MOD_LINEAR) {
-			return drv_dumb_bo_create(bo, width, height, format, 0);
+			return drv_dumb_bo_create(bo, width, height, format, use_flags);
 		}
 	}
 
@@ -5,15 +5,18 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <xf86drm.h>
 
 #include "drv.h"
+#include "drv_helpers.h"
 #include "gbm_helpers.h"
 #include "gbm_priv.h"
 #include "util.h"
@@ -44,7 +47,18 @@ PUBLIC int gbm_device_is_format_supported(struct gbm_device *gbm, uint32_t forma
 PUBLIC int gbm_device_get_format_modifier_plane_count(struct gbm_device *gbm, uint32_t format,
 						      uint64_t modifier)
 {
-	return 0;
+	size_t num_planes = drv_num_planes_from_modifier(gbm->drv, format, modifier);
+
+	return num_planes ? (int)num_planes : -1;
+}
+
+PUBLIC int gbm_device_get_format_modifiers(struct gbm_device *gbm, uint32_t format, uint32_t usage,
+					   uint64_t *modifiers, uint32_t max)
+{
+	if (usage & GBM_BO_USE_CURSOR && usage & GBM_BO_USE_RENDERING)
+		return 0;
+
+	return drv_get_modifiers(gbm->drv, format, gbm_convert_usage(usage), modifiers, max);
 }
 
 PUBLIC struct gbm_device *gbm_create_device(int fd)
@@ -71,14 +85,42 @@ PUBLIC void gbm_device_destroy(struct gbm_device *gbm)
 	free(gbm);
 }
 
+static struct gbm_surface *gbm_surface_new(struct gbm_device *gbm)
+{
+	struct gbm_surface *surface;
+	uint32_t i;
+
+	surface = (struct gbm_surface *)calloc(1, sizeof(*surface));
+	if (!surface)
+		return NULL;
+
+	surface->gbm = gbm;
+	pthread_mutex_init(&surface->lock, NULL);
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++)
+		surface->buffers[i].release_fence = -1;
+
+	return surface;
+}
+
 PUBLIC struct gbm_surface *gbm_surface_create(struct gbm_device *gbm, uint32_t width,
 					      uint32_t height, uint32_t format, uint32_t usage)
 {
-	struct gbm_surface *surface = (struct gbm_surface *)malloc(sizeof(*surface));
+	struct gbm_surface *surface;
+	uint32_t i;
 
+	surface = gbm_surface_new(gbm);
 	if (!surface)
 		return NULL;
 
+	/* All buffers are allocated up front and recycled for the lifetime of the surface. */
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		surface->buffers[i].bo = gbm_bo_create(gbm, width, height, format, usage);
+		if (!surface->buffers[i].bo) {
+			gbm_surface_destroy(surface);
+			return NULL;
+		}
+	}
+
 	return surface;
 }
 
@@ -87,28 +129,178 @@ PUBLIC struct gbm_surface *gbm_surface_create_with_modifiers(struct gbm_device *
 							     const uint64_t *modifiers,
 							     const unsigned int count)
 {
-	if (count != 0 || modifiers != NULL)
+	return gbm_surface_create_with_modifiers2(gbm, width, height, format, modifiers, count, 0);
+}
+
+PUBLIC struct gbm_surface *gbm_surface_create_with_modifiers2(struct gbm_device *gbm,
+							      uint32_t width, uint32_t height,
+							      uint32_t format,
+							      const uint64_t *modifiers,
+							      const unsigned int count, uint32_t usage)
+{
+	struct gbm_surface *surface;
+	uint32_t i;
+
+	if (count == 0 || modifiers == NULL)
+		return gbm_surface_create(gbm, width, height, format, usage);
+
+	surface = gbm_surface_new(gbm);
+	if (!surface)
 		return NULL;
 
-	return gbm_surface_create(gbm, width, height, format, 0);
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		surface->buffers[i].bo = gbm_bo_create_with_modifiers2(gbm, width, height, format,
+								       modifiers, count, usage);
+		if (!surface->buffers[i].bo) {
+			gbm_surface_destroy(surface);
+			return NULL;
+		}
+	}
+
+	return surface;
 }
 
-PUBLIC struct gbm_bo *gbm_surface_lock_front_buffer(struct gbm_surface *surface)
+/* Assumes surface->lock is held. */
+static struct gbm_surface_buffer *gbm_surface_find_buffer(struct gbm_surface *surface,
+							  struct gbm_bo *bo)
 {
+	uint32_t i;
+
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (surface->buffers[i].bo == bo)
+			return &surface->buffers[i];
+	}
+
 	return NULL;
 }
 
+PUBLIC struct gbm_bo *gbm_surface_acquire_back_buffer(struct gbm_surface *surface,
+						      int *release_fence)
+{
+	struct gbm_surface_buffer *buffer = NULL;
+	uint32_t i, index;
+	int fence;
+
+	pthread_mutex_lock(&surface->lock);
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		index = (surface->next_back + i) % GBM_SURFACE_NUM_BUFFERS;
+		if (surface->buffers[index].state == GBM_SURFACE_BUFFER_FREE) {
+			buffer = &surface->buffers[index];
+			surface->next_back = (index + 1) % GBM_SURFACE_NUM_BUFFERS;
+			break;
+		}
+	}
+
+	if (!buffer) {
+		pthread_mutex_unlock(&surface->lock);
+		return NULL;
+	}
+
+	buffer->state = GBM_SURFACE_BUFFER_BACK;
+	fence = buffer->release_fence;
+	buffer->release_fence = -1;
+	pthread_mutex_unlock(&surface->lock);
+
+	if (release_fence)
+		*release_fence = fence;
+	else if (fence >= 0)
+		drv_fence_wait_and_close(fence);
+
+	return buffer->bo;
+}
+
+PUBLIC int gbm_surface_queue_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
+{
+	struct gbm_surface_buffer *buffer;
+	int ret = 0;
+
+	pthread_mutex_lock(&surface->lock);
+	buffer = gbm_surface_find_buffer(surface, bo);
+	if (buffer && buffer->state == GBM_SURFACE_BUFFER_BACK) {
+		buffer->state = GBM_SURFACE_BUFFER_QUEUED;
+		buffer->queue_seq = surface->next_queue_seq++;
+	} else {
+		drv_loge("Queued a buffer that was not acquired from the surface.\n");
+		ret = -EINVAL;
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	return ret;
+}
+
+PUBLIC struct gbm_bo *gbm_surface_lock_front_buffer(struct gbm_surface *surface)
+{
+	struct gbm_surface_buffer *buffer = NULL;
+	uint32_t i;
+
+	pthread_mutex_lock(&surface->lock);
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (surface->buffers[i].state != GBM_SURFACE_BUFFER_QUEUED)
+			continue;
+
+		if (!buffer || surface->buffers[i].queue_seq < buffer->queue_seq)
+			buffer = &surface->buffers[i];
+	}
+
+	if (buffer)
+		buffer->state = GBM_SURFACE_BUFFER_FRONT;
+	pthread_mutex_unlock(&surface->lock);
+
+	return buffer ? buffer->bo : NULL;
+}
+
+PUBLIC void gbm_surface_release_buffer_with_fence(struct gbm_surface *surface, struct gbm_bo *bo,
+						  int release_fence)
+{
+	struct gbm_surface_buffer *buffer;
+
+	pthread_mutex_lock(&surface->lock);
+	buffer = gbm_surface_find_buffer(surface, bo);
+	if (buffer && buffer->state == GBM_SURFACE_BUFFER_FRONT) {
+		buffer->state = GBM_SURFACE_BUFFER_FREE;
+		drv_fence_merge(&buffer->release_fence, release_fence);
+		release_fence = -1;
+	} else {
+		drv_loge("Released a buffer that was not locked from the surface.\n");
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	if (release_fence >= 0)
+		close(release_fence);
+}
+
 PUBLIC void gbm_surface_release_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
 {
+	gbm_surface_release_buffer_with_fence(surface, bo, -1);
 }
 
 PUBLIC int gbm_surface_has_free_buffers(struct gbm_surface *surface)
 {
-	return 0;
+	int num_free = 0;
+	uint32_t i;
+
+	pthread_mutex_lock(&surface->lock);
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (surface->buffers[i].state == GBM_SURFACE_BUFFER_FREE)
+			num_free++;
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	return num_free;
 }
 
 PUBLIC void gbm_surface_destroy(struct gbm_surface *surface)
 {
+	uint32_t i;
+
+	for (i = 0; i < GBM_SURFACE_NUM_BUFFERS; i++) {
+		if (surface->buffers[i].bo)
+			gbm_bo_destroy(surface->buffers[i].bo);
+		if (surface->buffers[i].release_fence >= 0)
+			close(surface->buffers[i].release_fence);
+	}
+
+	pthread_mutex_destroy(&surface->lock);
 	free(surface);
 }
 
@@ -160,6 +352,14 @@ PUBLIC struct gbm_bo *gbm_bo_create(struct gbm_device *gbm, uint32_t width, uint
 PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint32_t width,
 						   uint32_t height, uint32_t format,
 						   const uint64_t *modifiers, uint32_t count)
+{
+	return gbm_bo_create_with_modifiers2(gbm, width, height, format, modifiers, count, 0);
+}
+
+PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers2(struct gbm_device *gbm, uint32_t width,
+						    uint32_t height, uint32_t format,
+						    const uint64_t *modifiers,
+						    const unsigned int count, uint32_t usage)
 {
 	struct gbm_bo *bo;
 
@@ -168,7 +368,8 @@ PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint3
 	if (!bo)
 		return NULL;
 
-	bo->bo = drv_bo_create_with_modifiers(gbm->drv, width, height, format, modifiers, count);
+	bo->bo = drv_bo_create_with_modifiers2(gbm->drv, width, height, format,
+					       gbm_convert_usage(usage), modifiers, count);
 
 	if (!bo->bo) {
 		free(bo);
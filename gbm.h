@@ -339,6 +339,15 @@ gbm_bo_create_with_modifiers(struct gbm_device *gbm,
                              uint32_t format,
                              const uint64_t *modifiers,
                              const unsigned int count);
+
+struct gbm_bo *
+gbm_bo_create_with_modifiers2(struct gbm_device *gbm,
+                              uint32_t width, uint32_t height,
+                              uint32_t format,
+                              const uint64_t *modifiers,
+                              const unsigned int count,
+                              uint32_t flags);
+
 #define GBM_BO_IMPORT_WL_BUFFER         0x5501
 #define GBM_BO_IMPORT_EGL_IMAGE         0x5502
 #define GBM_BO_IMPORT_FD                0x5503
@@ -473,6 +482,14 @@ gbm_surface_create_with_modifiers(struct gbm_device *gbm,
                                   const uint64_t *modifiers,
                                   const unsigned int count);
 
+struct gbm_surface *
+gbm_surface_create_with_modifiers2(struct gbm_device *gbm,
+                                   uint32_t width, uint32_t height,
+                                   uint32_t format,
+                                   const uint64_t *modifiers,
+                                   const unsigned int count,
+                                   uint32_t flags);
+
 struct gbm_bo *
 gbm_surface_lock_front_buffer(struct gbm_surface *surface);
 
@@ -508,6 +525,39 @@ gbm_bo_map2(struct gbm_bo *bo,
 	   uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 	   uint32_t flags, uint32_t *stride, void **map_data, int plane);
 
+/*
+ * Producer side of gbm_surface for clients that render into the surface
+ * themselves. gbm_surface_acquire_back_buffer() hands out a free buffer and,
+ * if release_fence is not NULL, the fence to wait on before writing to it
+ * (or -1); with a NULL release_fence it waits itself. The buffer is handed to
+ * gbm_surface_lock_front_buffer() by gbm_surface_queue_buffer(). Buffers
+ * belong to the surface and must not be destroyed by the caller.
+ */
+struct gbm_bo *
+gbm_surface_acquire_back_buffer(struct gbm_surface *surface, int *release_fence);
+
+int
+gbm_surface_queue_buffer(struct gbm_surface *surface, struct gbm_bo *bo);
+
+/*
+ * Like gbm_surface_release_buffer(), but the buffer is only written to again
+ * once release_fence (a sync_file, ownership of which is taken) signals.
+ */
+void
+gbm_surface_release_buffer_with_fence(struct gbm_surface *surface,
+				      struct gbm_bo *bo, int release_fence);
+
+/*
+ * Stores up to max of the modifiers format can be allocated with for usage
+ * in modifiers, most preferred first, and returns how many there are in
+ * total. modifiers may be NULL to only query the count. A usage of 0 matches
+ * any usage.
+ */
+int
+gbm_device_get_format_modifiers(struct gbm_device *gbm, uint32_t format,
+                                uint32_t usage, uint64_t *modifiers,
+                                uint32_t max);
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,6 +36,7 @@ extern "C" {
 #include <iterator>
 #include <linux/dma-buf.h>
 #include <log/log.h>
+#include <mutex>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
@@ -134,6 +135,8 @@ struct GbmMesaDriver {
 	struct gbm_ops *wrapper = nullptr;
 	struct gbm_device *gbm_dev = nullptr;
 	void *dl_handle = nullptr;
+	/* gbm_bo_map() may blit through the device's shared DRI context, which isn't thread-safe. */
+	std::mutex map_lock;
 
 	UniqueFd gbm_node_fd;
 	UniqueFd gpu_node_fd;
@@ -344,6 +347,15 @@ static void gbm_mesa_inode_to_handle(struct bo *bo)
 	}
 }
 
+/* Alignment for the RPI4 CSI camera and hwcodecs. Since we do not care about other cameras and
+ * codecs, keep this globally for now. */
+static const struct layout_constraint layout_constraints[] = {
+	{ .use_flags = BO_USE_CAMERA_READ, .width_align = 32, .size_align = 4096 },
+	{ .use_flags = BO_USE_CAMERA_WRITE, .width_align = 32, .size_align = 4096 },
+	{ .use_flags = BO_USE_HW_VIDEO_DECODER, .width_align = 32, .size_align = 4096 },
+	{ .use_flags = BO_USE_HW_VIDEO_ENCODER, .width_align = 32, .size_align = 4096 },
+};
+
 int gbm_mesa_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 		       uint64_t use_flags)
 {
@@ -352,6 +364,7 @@ int gbm_mesa_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t
 	bool scanout_strong = false;
 	bool bo_layout_ready = false;
 	uint32_t size_align = 1;
+	struct layout_constraint constraint = {};
 	int err = 0;
 
 	auto drv = gbm_mesa_get_or_init_driver(bo->drv, false);
@@ -372,23 +385,19 @@ int gbm_mesa_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t
 		.use_scanout = (use_flags & BO_USE_SCANOUT) != 0,
 	};
 
-	/* Alignment for RPI4 CSI camera. Since we do not care about other cameras, keep this
-	 * globally for now.
-	 * TODO: Create/use constraints table for camera/codecs */
-	if (use_flags & (BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE)) {
+	/* RPI4 camera and hwcodecs buffers must be allocated in CMA. */
+	if (use_flags & (BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE | BO_USE_HW_VIDEO_DECODER |
+			 BO_USE_HW_VIDEO_ENCODER)) {
 		scanout_strong = true;
 		alloc_args.use_scanout = true;
-		alloc_args.width = ALIGN(alloc_args.width, 32);
-		size_align = 4096;
 	}
 
-	/* RPI4 hwcodecs */
-	if (use_flags & (BO_USE_HW_VIDEO_DECODER | BO_USE_HW_VIDEO_ENCODER)) {
-		scanout_strong = true;
-		alloc_args.use_scanout = true;
-		alloc_args.width = ALIGN(alloc_args.width, 32);
-		size_align = 4096;
-	}
+	drv_merge_layout_constraints(layout_constraints, ARRAY_SIZE(layout_constraints), format,
+				     use_flags, &constraint);
+	if (constraint.width_align)
+		alloc_args.width = ALIGN(alloc_args.width, constraint.width_align);
+	if (constraint.size_align)
+		size_align = constraint.size_align;
 
 	/* Allocate blobs in CMA */
 	if (format == DRM_FORMAT_R8) {
@@ -525,6 +534,7 @@ void *gbm_mesa_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map
 		s_height = 1;
 	}
 
+	std::lock_guard<std::mutex> lock(drv->map_lock);
 	wr->map(priv->gbm_bo, s_width, s_height, &buf, &vma->priv);
 
 	return buf;
@@ -538,6 +548,7 @@ int gbm_mesa_bo_unmap(struct bo *bo, struct vma *vma)
 	auto priv = (GbmMesaBoPriv *)bo->priv;
 	assert(priv->gbm_bo != nullptr);
 	assert(vma->priv != nullptr);
+	std::lock_guard<std::mutex> lock(drv->map_lock);
 	wr->unmap(priv->gbm_bo, vma->priv);
 	vma->priv = nullptr;
 	return 0;
@@ -7,6 +7,7 @@
 #ifndef GBM_PRIV_H
 #define GBM_PRIV_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -18,7 +19,36 @@ struct gbm_device {
 	struct driver *drv;
 };
 
+/* Number of buffers preallocated for every gbm_surface. */
+#define GBM_SURFACE_NUM_BUFFERS 3
+
+enum gbm_surface_buffer_state {
+	/* Available to the producer. */
+	GBM_SURFACE_BUFFER_FREE,
+	/* Handed to the producer, being rendered. */
+	GBM_SURFACE_BUFFER_BACK,
+	/* Rendered, waiting for gbm_surface_lock_front_buffer(). */
+	GBM_SURFACE_BUFFER_QUEUED,
+	/* Locked by the consumer, e.g. being scanned out. */
+	GBM_SURFACE_BUFFER_FRONT,
+};
+
+struct gbm_surface_buffer {
+	struct gbm_bo *bo;
+	enum gbm_surface_buffer_state state;
+	/* Signaled once the consumer is done with a released buffer, or -1. */
+	int release_fence;
+	/* Queued buffers are locked in the order they were queued in. */
+	uint64_t queue_seq;
+};
+
 struct gbm_surface {
+	struct gbm_device *gbm;
+	pthread_mutex_t lock;
+	struct gbm_surface_buffer buffers[GBM_SURFACE_NUM_BUFFERS];
+	uint64_t next_queue_seq;
+	/* Free buffers are handed out round-robin, starting from here. */
+	uint32_t next_back;
 };
 
 struct gbm_bo {
@@ -62,6 +62,9 @@ struct i915_device {
 	/*TODO : cleanup is_mtl to avoid adding variables for every new platforms */
 	bool is_mtl;
 	int32_t num_fences_avail;
+	bool has_mmap_offset;
+	/* Discrete parts only accept I915_MMAP_OFFSET_FIXED and have no SET_DOMAIN. */
+	bool has_mmap_offset_fixed;
 };
 
 static void i915_info_from_device_id(struct i915_device *i915)
@@ -390,6 +393,51 @@ static void i915_clflush(void *start, size_t size)
 	}
 }
 
+/*
+ * Gen11 and Gen12 align the height of the chroma plane of these formats to the largest coded
+ * unit, assuming that the buffer may be used for video, to be consistent with gmmlib's
+ * GmmIsYUVFormatLCUAligned().
+ */
+static const struct layout_constraint lcu_layout_constraints[] = {
+	{ .format = DRM_FORMAT_NV12, .height_align = { 0, 64 } },
+	{ .format = DRM_FORMAT_P010, .height_align = { 0, 64 } },
+	{ .format = DRM_FORMAT_P016, .height_align = { 0, 64 } },
+};
+
+/*
+ * I915_GEM_MMAP_OFFSET is available from MMAP_GTT_VERSION 4. Which of its modes the kernel accepts
+ * depends on the platform, so try FIXED, which only discrete parts take, on a scratch object.
+ */
+static void i915_probe_mmap_offset(struct driver *drv, struct i915_device *i915)
+{
+	int ret, mmap_gtt_version = 0;
+	drm_i915_getparam_t get_param = { 0 };
+	struct drm_i915_gem_create gem_create = { 0 };
+	struct drm_i915_gem_mmap_offset gem_map = { 0 };
+	struct drm_gem_close gem_close = { 0 };
+
+	get_param.param = I915_PARAM_MMAP_GTT_VERSION;
+	get_param.value = &mmap_gtt_version;
+	ret = drmIoctl(drv->fd, DRM_IOCTL_I915_GETPARAM, &get_param);
+	if (ret || mmap_gtt_version < 4)
+		return;
+
+	i915->has_mmap_offset = true;
+
+	gem_create.size = getpagesize();
+	ret = drmIoctl(drv->fd, DRM_IOCTL_I915_GEM_CREATE, &gem_create);
+	if (ret)
+		return;
+
+	gem_map.handle = gem_create.handle;
+	gem_map.flags = I915_MMAP_OFFSET_FIXED;
+	if (!drmIoctl(drv->fd, DRM_IOCTL_I915_GEM_MMAP_OFFSET, &gem_map))
+		i915->has_mmap_offset_fixed = true;
+
+	gem_close.handle = gem_create.handle;
+	drmIoctl(drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+}
+
 static int i915_init(struct driver *drv)
 {
 	int ret;
@@ -432,39 +480,30 @@ static int i915_init(struct driver *drv)
 		return -EINVAL;
 	}
 
+	i915_probe_mmap_offset(drv, i915);
+
 	if (i915->graphics_version >= 12)
 		i915->has_hw_protection = 1;
 
+	if (i915->graphics_version == 11 || i915->graphics_version == 12) {
+		drv->layout_constraints = lcu_layout_constraints;
+		drv->num_layout_constraints = ARRAY_SIZE(lcu_layout_constraints);
+	}
+
 	drv->priv = i915;
 	return i915_add_combinations(drv);
 }
 
-/*
- * Returns true if the height of a buffer of the given format should be aligned
- * to the largest coded unit (LCU) assuming that it will be used for video. This
- * is based on gmmlib's GmmIsYUVFormatLCUAligned().
- */
-static bool i915_format_needs_LCU_alignment(uint32_t format, size_t plane,
-					    const struct i915_device *i915)
-{
-	switch (format) {
-	case DRM_FORMAT_NV12:
-	case DRM_FORMAT_P010:
-	case DRM_FORMAT_P016:
-		return (i915->graphics_version == 11 || i915->graphics_version == 12) && plane == 1;
-	}
-	return false;
-}
-
 static int i915_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, uint32_t format)
 {
 	uint32_t offset;
 	size_t plane;
 	int ret, pagesize;
-	struct i915_device *i915 = bo->drv->priv;
+	struct layout_constraint constraint;
 
 	offset = 0;
 	pagesize = getpagesize();
+	drv_bo_get_layout_constraint(bo, format, &constraint);
 
 	for (plane = 0; plane < drv_num_planes_from_format(format); plane++) {
 		uint32_t stride = drv_stride_from_format(format, width, plane);
@@ -477,14 +516,8 @@ static int i915_bo_from_format(struct bo *bo, uint32_t width, uint32_t height, u
 		if (ret)
 			return ret;
 
-		if (i915_format_needs_LCU_alignment(format, plane, i915)) {
-			/*
-			 * Align the height of the V plane for certain formats to the
-			 * largest coded unit (assuming that this BO may be used for video)
-			 * to be consistent with gmmlib.
-			 */
-			plane_height = ALIGN(plane_height, 64);
-		}
+		if (constraint.height_align[plane])
+			plane_height = ALIGN(plane_height, constraint.height_align[plane]);
 
 		bo->meta.strides[plane] = stride;
 		bo->meta.sizes[plane] = stride * plane_height;
@@ -509,6 +542,72 @@ static size_t i915_num_planes_from_modifier(struct driver *drv, uint32_t format,
 	return num_planes;
 }
 
+/* Compressed and 4-tiled buffers can't be given a linear CPU view by i915_bo_map(). */
+static bool i915_modifier_is_mappable(uint64_t modifier)
+{
+	return modifier != I915_FORMAT_MOD_Y_TILED_CCS &&
+	       modifier != I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS &&
+	       modifier != I915_FORMAT_MOD_4_TILED;
+}
+
+/*
+ * Picks the preferred modifier out of |modifiers|, skipping unmappable ones for buffers the CPU
+ * is going to access as long as a mappable one was offered.
+ */
+static uint64_t i915_pick_modifier(struct i915_device *i915, uint64_t use_flags,
+				   const uint64_t *modifiers, uint32_t count)
+{
+	uint32_t i;
+
+	if (use_flags & BO_USE_SW_MASK) {
+		for (i = 0; i < i915->modifier.count; i++) {
+			uint64_t modifier = i915->modifier.order[i];
+			if (i915_modifier_is_mappable(modifier) &&
+			    drv_has_modifier(modifiers, count, modifier))
+				return modifier;
+		}
+	}
+
+	return drv_pick_modifier(modifiers, count, i915->modifier.order, i915->modifier.count);
+}
+
+/*
+ * Lists the modifiers in the order i915_bo_compute_metadata() prefers them. Compressed modifiers
+ * have no combinations of their own and are offered wherever Y-tiling is.
+ */
+static uint32_t i915_get_modifiers(struct driver *drv, uint32_t format, uint64_t use_flags,
+				   uint64_t modifiers[DRV_MAX_MODIFIERS])
+{
+	struct i915_device *i915 = drv->priv;
+	uint32_t i, count = 0;
+
+	for (i = 0; i < i915->modifier.count && count < DRV_MAX_MODIFIERS; i++) {
+		uint64_t modifier = i915->modifier.order[i];
+
+		if (modifier == I915_FORMAT_MOD_Y_TILED_CCS ||
+		    modifier == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS) {
+			if (!drv->compression || drv_num_planes_from_format(format) != 1 ||
+			    !drv_has_combination_with_modifier(drv, format, use_flags,
+							       I915_FORMAT_MOD_Y_TILED))
+				continue;
+		} else if (!drv_has_combination_with_modifier(drv, format, use_flags, modifier)) {
+			continue;
+		}
+
+		/* Gen 8 and earlier only allocate ARGB8888 linear. */
+		if (i915->graphics_version <= 8 && format == DRM_FORMAT_ARGB8888 &&
+		    modifier != DRM_FORMAT_MOD_LINEAR)
+			continue;
+
+		if ((use_flags & BO_USE_SW_MASK) && !i915_modifier_is_mappable(modifier))
+			continue;
+
+		modifiers[count++] = modifier;
+	}
+
+	return count;
+}
+
 static int i915_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 				    uint64_t use_flags, const uint64_t *modifiers, uint32_t count)
 {
@@ -517,8 +616,7 @@ static int i915_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t heig
 	bool huge_bo = (i915->graphics_version < 11) && (width > 4096);
 
 	if (modifiers) {
-		modifier =
-		    drv_pick_modifier(modifiers, count, i915->modifier.order, i915->modifier.count);
+		modifier = i915_pick_modifier(i915, use_flags, modifiers, count);
 	} else {
 		struct combination *combo = drv_get_combination(bo->drv, format, use_flags);
 		if (!combo)
@@ -779,29 +877,82 @@ static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	return 0;
 }
 
+/*
+ * Returns the domain CPU access to |bo| goes through: GTT for X/Y-tiled buffers while fences are
+ * available to detile them through the aperture, otherwise WC or CPU (WB). The aperture can't
+ * detile anything else, so other tiled buffers are mapped as they are laid out.
+ */
+static uint32_t i915_bo_cpu_domain(struct bo *bo)
+{
+	struct i915_device *i915 = bo->drv->priv;
+	uint64_t use_flags = bo->meta.use_flags;
+
+	if ((bo->meta.tiling == I915_TILING_X || bo->meta.tiling == I915_TILING_Y) &&
+	    i915->num_fences_avail > 0)
+		return I915_GEM_DOMAIN_GTT;
+
+	/*
+	 * Care must be taken not to use WC mappings for Renderscript and camera use cases, as
+	 * they're performance-sensitive.
+	 */
+	if (use_flags & (BO_USE_RENDERSCRIPT | BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE))
+		return I915_GEM_DOMAIN_CPU;
+
+	/*
+	 * TODO(b/118799155): We don't seem to have a good way to detect the use cases for which WC
+	 * mapping is really needed. The current heuristic seems overly coarse and may be slowing
+	 * down some other use cases unnecessarily.
+	 */
+	if (use_flags & BO_USE_SCANOUT)
+		return I915_GEM_DOMAIN_WC;
+
+	/* Without an LLC, a WB mapping the CPU only writes to costs a clflush on every unlock. */
+	if (!i915->has_llc && !(use_flags & BO_USE_SW_READ_OFTEN))
+		return I915_GEM_DOMAIN_WC;
+
+	return I915_GEM_DOMAIN_CPU;
+}
+
+static void *i915_bo_mmap_offset(struct bo *bo, uint64_t flags, uint32_t map_flags)
+{
+	int ret;
+	struct drm_i915_gem_mmap_offset gem_map = { 0 };
+
+	gem_map.handle = bo->handles[0].u32;
+	gem_map.flags = flags;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP_OFFSET, &gem_map);
+	if (ret)
+		return MAP_FAILED;
+
+	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
+		    gem_map.offset);
+}
+
 static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
 	void *addr = MAP_FAILED;
+	struct i915_device *i915 = bo->drv->priv;
+	uint32_t domain = i915_bo_cpu_domain(bo);
 
-	if ((bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_CCS) ||
-	    (bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS) ||
-	    (bo->meta.format_modifier == I915_FORMAT_MOD_4_TILED))
+	/* Compressed buffers have no meaningful CPU view. */
+	if (bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_CCS ||
+	    bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS)
 		return MAP_FAILED;
 
-	if (bo->meta.tiling == I915_TILING_NONE) {
+	if (i915->has_mmap_offset_fixed) {
+		/* The kernel picks the caching mode from the object's placement. */
+		addr = i915_bo_mmap_offset(bo, I915_MMAP_OFFSET_FIXED, map_flags);
+	} else if (i915->has_mmap_offset && domain != I915_GEM_DOMAIN_GTT) {
+		addr = i915_bo_mmap_offset(bo,
+					   domain == I915_GEM_DOMAIN_WC ? I915_MMAP_OFFSET_WC
+									: I915_MMAP_OFFSET_WB,
+					   map_flags);
+	} else if (domain != I915_GEM_DOMAIN_GTT) {
 		struct drm_i915_gem_mmap gem_map = { 0 };
-		/* TODO(b/118799155): We don't seem to have a good way to
-		 * detect the use cases for which WC mapping is really needed.
-		 * The current heuristic seems overly coarse and may be slowing
-		 * down some other use cases unnecessarily.
-		 *
-		 * For now, care must be taken not to use WC mappings for
-		 * Renderscript and camera use cases, as they're
-		 * performance-sensitive. */
-		if ((bo->meta.use_flags & BO_USE_SCANOUT) &&
-		    !(bo->meta.use_flags &
-		      (BO_USE_RENDERSCRIPT | BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE)))
+
+		if (domain == I915_GEM_DOMAIN_WC)
 			gem_map.flags = I915_MMAP_WC;
 
 		gem_map.handle = bo->handles[0].u32;
@@ -820,7 +971,8 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 			addr = (void *)(uintptr_t)gem_map.addr_ptr;
 	}
 
-	if (addr == MAP_FAILED) {
+	/* Last resort: the GTT aperture is slow, small and absent on newer parts. */
+	if (addr == MAP_FAILED && !i915->has_mmap_offset_fixed) {
 		struct drm_i915_gem_mmap_gtt gem_map = { 0 };
 
 		gem_map.handle = bo->handles[0].u32;
@@ -843,22 +995,57 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 	return addr;
 }
 
+/*
+ * The domain change in i915_bo_invalidate() only has to wait for the GPU when the CPU view is
+ * coherent: FIXED mappings, WC mappings and WB mappings on LLC parts. There, an object GEM_BUSY
+ * reports idle for the access (no writer for reads, nothing at all for writes) needs none.
+ */
+static bool i915_bo_needs_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	struct i915_device *i915 = bo->drv->priv;
+	struct drm_i915_gem_busy busy = { 0 };
+	uint32_t domain = i915_bo_cpu_domain(bo);
+
+	if (!i915->has_mmap_offset_fixed && domain != I915_GEM_DOMAIN_WC &&
+	    !(domain == I915_GEM_DOMAIN_CPU && i915->has_llc))
+		return true;
+
+	busy.handle = bo->handles[0].u32;
+	if (drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_BUSY, &busy))
+		return true;
+
+	if (mapping->vma->map_flags & BO_MAP_WRITE)
+		return busy.busy != 0;
+
+	return (busy.busy & 0xffff) != 0;
+}
+
 static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
 	struct drm_i915_gem_set_domain set_domain = { 0 };
+	struct i915_device *i915 = bo->drv->priv;
 
-	set_domain.handle = bo->handles[0].u32;
-	if (bo->meta.tiling == I915_TILING_NONE) {
-		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
-		if (mapping->vma->map_flags & BO_MAP_WRITE)
-			set_domain.write_domain = I915_GEM_DOMAIN_CPU;
-	} else {
-		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
-		if (mapping->vma->map_flags & BO_MAP_WRITE)
-			set_domain.write_domain = I915_GEM_DOMAIN_GTT;
+	if (i915->has_mmap_offset_fixed) {
+		/* FIXED mappings are coherent; only wait for outstanding GPU access. */
+		struct drm_i915_gem_wait gem_wait = { 0 };
+
+		gem_wait.bo_handle = bo->handles[0].u32;
+		gem_wait.timeout_ns = -1;
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_WAIT, &gem_wait);
+		if (ret) {
+			drv_loge("DRM_IOCTL_I915_GEM_WAIT failed with %d\n", errno);
+			return -errno;
+		}
+
+		return 0;
 	}
 
+	set_domain.handle = bo->handles[0].u32;
+	set_domain.read_domains = i915_bo_cpu_domain(bo);
+	if (mapping->vma->map_flags & BO_MAP_WRITE)
+		set_domain.write_domain = set_domain.read_domains;
+
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
 	if (ret) {
 		drv_loge("DRM_IOCTL_I915_GEM_SET_DOMAIN with %d\n", ret);
@@ -871,7 +1058,13 @@ static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 static int i915_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct i915_device *i915 = bo->drv->priv;
-	if (!i915->has_llc && bo->meta.tiling == I915_TILING_NONE)
+
+	/* Nothing to write back from a read-only mapping. */
+	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	if (!i915->has_llc && !i915->has_mmap_offset_fixed &&
+	    i915_bo_cpu_domain(bo) == I915_GEM_DOMAIN_CPU)
 		i915_clflush(mapping->vma->addr, mapping->vma->length);
 
 	return 0;
@@ -887,10 +1080,13 @@ const struct backend backend_i915 = {
 	.bo_import = i915_bo_import,
 	.bo_map = i915_bo_map,
 	.bo_unmap = drv_bo_munmap,
+	.map_is_pure_mmap = true,
+	.bo_needs_invalidate = i915_bo_needs_invalidate,
 	.bo_invalidate = i915_bo_invalidate,
 	.bo_flush = i915_bo_flush,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
 	.num_planes_from_modifier = i915_num_planes_from_modifier,
+	.get_modifiers = i915_get_modifiers,
 };
 
 #endif
@@ -10,7 +10,6 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -56,6 +55,10 @@
 struct mediatek_private_map_data {
 	void *cached_addr;
 	void *gem_addr;
+};
+
+struct mediatek_private_bo_data {
+	/* The bo's dma-buf for DMA_BUF_IOCTL_SYNC, exported on first use. */
 	int prime_fd;
 };
 
@@ -95,10 +98,32 @@ static bool is_video_yuv_format(uint32_t format)
 	return false;
 }
 
+static const struct layout_constraint layout_constraints[] = {
+	/*
+	 * The video encoder needs 32 row aligned planes followed by 32 rows of padding. ChromeOS
+	 * Camera App buffers, identified by these two USE flags, are encoded too.
+	 */
+	{ .use_flags = BO_USE_HW_VIDEO_ENCODER, .height_align = { 32 }, .padding_height = 32 },
+	{ .use_flags = BO_USE_SCANOUT | BO_USE_CAMERA_WRITE,
+	  .height_align = { 32 },
+	  .padding_height = 32 },
+#ifdef SUPPORTS_YUV422
+	/*
+	 * JPEG Encoder Accelerator requires 16x16 alignment. We want the buffer
+	 * from camera can be put in JEA directly so align the height to 16
+	 * bytes.
+	 */
+	{ .format = DRM_FORMAT_NV12, .height_align = { 16 } },
+#endif
+};
+
 static int mediatek_init(struct driver *drv)
 {
 	struct format_metadata metadata;
 
+	drv->layout_constraints = layout_constraints;
+	drv->num_layout_constraints = ARRAY_SIZE(layout_constraints);
+
 	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
 			     &LINEAR_METADATA, BO_USE_RENDER_MASK | BO_USE_SCANOUT);
 
@@ -156,26 +181,10 @@ static int mediatek_init(struct driver *drv)
 	return drv_modify_linear_combinations(drv);
 }
 
-static int mediatek_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
-					     uint32_t format, const uint64_t *modifiers,
-					     uint32_t count)
+static int mediatek_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height,
+				      uint32_t format, uint64_t use_flags)
 {
-	int ret;
-	size_t plane;
 	uint32_t stride;
-	struct drm_mtk_gem_create gem_create = { 0 };
-	/*
-	 * We identify the ChromeOS Camera App buffers via these two USE flags. Those buffers need
-	 * the same alignment as the video hardware encoding.
-	 */
-	const bool is_camera_preview =
-	    (bo->meta.use_flags & BO_USE_SCANOUT) && (bo->meta.use_flags & BO_USE_CAMERA_WRITE);
-
-	if (!drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_LINEAR)) {
-		errno = EINVAL;
-		drv_loge("no usable modifier found\n");
-		return -EINVAL;
-	}
 
 	/*
 	 * Since the ARM L1 cache line size is 64 bytes, align to that as a
@@ -191,70 +200,83 @@ static int mediatek_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 	stride = ALIGN(stride, 64);
 #endif
 
-	if ((bo->meta.use_flags & BO_USE_HW_VIDEO_ENCODER) || is_camera_preview) {
-		uint32_t aligned_height = ALIGN(height, 32);
-		uint32_t padding[DRV_MAX_PLANES] = { 0 };
+	/* The layout constraints add what the encoder and the JPEG accelerator need. */
+	drv_bo_from_format(bo, stride, height, format);
 
-		for (plane = 0; plane < bo->meta.num_planes; ++plane) {
-			uint32_t plane_stride = drv_stride_from_format(format, stride, plane);
-			padding[plane] = plane_stride *
-					 (32 / drv_vertical_subsampling_from_format(format, plane));
-		}
+#ifdef USE_EXTRA_PADDING_FOR_YVU420
+	/*
+	 * Apply extra padding for YV12 if the height does not meet round up requirement and
+	 * the image is to be sampled by gpu, unless the constraints padded it already.
+	 */
+	struct layout_constraint constraint;
+	static const uint32_t required_round_up = 4;
+	const uint32_t height_mod = height % required_round_up;
 
-		drv_bo_from_format_and_padding(bo, stride, aligned_height, format, padding);
-	} else {
-#ifdef SUPPORTS_YUV422
-		/*
-		 * JPEG Encoder Accelerator requires 16x16 alignment. We want the buffer
-		 * from camera can be put in JEA directly so align the height to 16
-		 * bytes.
-		 */
-		if (format == DRM_FORMAT_NV12)
-			height = ALIGN(height, 16);
-#endif
-		drv_bo_from_format(bo, stride, height, format);
+	drv_bo_get_layout_constraint(bo, format, &constraint);
+	if ((format == DRM_FORMAT_YVU420 || format == DRM_FORMAT_YVU420_ANDROID) &&
+	    (bo->meta.use_flags & BO_USE_TEXTURE) && height_mod && !constraint.padding_height) {
+		const uint32_t height_padding = required_round_up - height_mod;
+		const uint32_t u_padding =
+		    drv_size_from_format(format, bo->meta.strides[2], height_padding, 2);
+
+		bo->meta.total_size += u_padding;
 
-#ifdef USE_EXTRA_PADDING_FOR_YVU420
 		/*
-		 * Apply extra padding for YV12 if the height does not meet round up requirement and
-		 * the image is to be sampled by gpu.
+		 * Since we are not aligning Y, we must make sure that its padding fits
+		 * inside the rest of the space allocated for the V/U planes.
 		 */
-		static const uint32_t required_round_up = 4;
-		const uint32_t height_mod = height % required_round_up;
-		if ((format == DRM_FORMAT_YVU420 || format == DRM_FORMAT_YVU420_ANDROID) &&
-		    (bo->meta.use_flags & BO_USE_TEXTURE) && height_mod) {
-			const uint32_t height_padding = required_round_up - height_mod;
-			const uint32_t u_padding =
-			    drv_size_from_format(format, bo->meta.strides[2], height_padding, 2);
-
-			bo->meta.total_size += u_padding;
-
-			/*
-			 * Since we are not aligning Y, we must make sure that its padding fits
-			 * inside the rest of the space allocated for the V/U planes.
-			 */
-			const uint32_t y_padding =
-			    drv_size_from_format(format, bo->meta.strides[0], height_padding, 0);
-			const uint32_t vu_size = drv_bo_get_plane_size(bo, 2) * 2;
-			if (y_padding > vu_size) {
-				/* Align with mali workaround to pad all 3 planes. */
-				bo->meta.total_size += y_padding + u_padding;
-			}
+		const uint32_t y_padding =
+		    drv_size_from_format(format, bo->meta.strides[0], height_padding, 0);
+		const uint32_t vu_size = drv_bo_get_plane_size(bo, 2) * 2;
+		if (y_padding > vu_size) {
+			/* Align with mali workaround to pad all 3 planes. */
+			bo->meta.total_size += y_padding + u_padding;
 		}
+	}
 #endif
+
+	return 0;
+}
+
+static int mediatek_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
+					     uint32_t format, uint64_t use_flags,
+					     const uint64_t *modifiers, uint32_t count)
+{
+	int ret;
+	size_t plane;
+	struct drm_mtk_gem_create gem_create = { 0 };
+	struct mediatek_private_bo_data *priv;
+
+	if (!drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_LINEAR)) {
+		errno = EINVAL;
+		drv_loge("no usable modifier found\n");
+		return -EINVAL;
 	}
 
+	ret = mediatek_bo_compute_layout(bo, width, height, format, use_flags);
+	if (ret)
+		return ret;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		return -ENOMEM;
+
 	gem_create.size = bo->meta.total_size;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_MTK_GEM_CREATE, &gem_create);
 	if (ret) {
+		ret = -errno;
 		drv_loge("DRM_IOCTL_MTK_GEM_CREATE failed (size=%" PRIu64 ")\n", gem_create.size);
-		return -errno;
+		free(priv);
+		return ret;
 	}
 
 	for (plane = 0; plane < bo->meta.num_planes; plane++)
 		bo->handles[plane].u32 = gem_create.handle;
 
+	priv->prime_fd = -1;
+	bo->priv = priv;
+
 	return 0;
 }
 
@@ -262,13 +284,75 @@ static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 			      uint64_t use_flags)
 {
 	uint64_t modifiers[] = { DRM_FORMAT_MOD_LINEAR };
-	return mediatek_bo_create_with_modifiers(bo, width, height, format, modifiers,
+	return mediatek_bo_create_with_modifiers(bo, width, height, format, use_flags, modifiers,
 						 ARRAY_SIZE(modifiers));
 }
 
+static int mediatek_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	struct mediatek_private_bo_data *priv;
+	int ret;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		return -ENOMEM;
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret) {
+		free(priv);
+		return ret;
+	}
+
+	priv->prime_fd = -1;
+	bo->priv = priv;
+
+	return 0;
+}
+
+static int mediatek_bo_release(struct bo *bo)
+{
+	struct mediatek_private_bo_data *priv = bo->priv;
+
+	if (priv) {
+		if (priv->prime_fd >= 0)
+			close(priv->prime_fd);
+		free(priv);
+		bo->priv = NULL;
+	}
+
+	return 0;
+}
+
+/* Returns the bo's dma-buf, which stays open until the bo is released. */
+static int mediatek_bo_get_prime_fd(struct bo *bo)
+{
+	struct mediatek_private_bo_data *priv = bo->priv;
+	int expected = -1;
+	int fd;
+
+	fd = __atomic_load_n(&priv->prime_fd, __ATOMIC_ACQUIRE);
+	if (fd >= 0)
+		return fd;
+
+	fd = drv_bo_get_plane_fd(bo, 0);
+	if (fd < 0) {
+		drv_loge("Failed to get a prime fd\n");
+		return -EINVAL;
+	}
+
+	/* Keep the first export if several threads raced to it. */
+	if (!__atomic_compare_exchange_n(&priv->prime_fd, &expected, fd, false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		close(fd);
+		fd = expected;
+	}
+
+	return fd;
+}
+
 static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
-	int ret, prime_fd;
+	int ret;
 	struct drm_mtk_gem_map_off gem_map = { 0 };
 	struct mediatek_private_map_data *priv;
 	void *addr = NULL;
@@ -281,43 +365,41 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 		return MAP_FAILED;
 	}
 
-	prime_fd = drv_bo_get_plane_fd(bo, 0);
-	if (prime_fd < 0) {
-		drv_loge("Failed to get a prime fd\n");
+	/* Mapped buffers will need their dma-buf for every CPU access. */
+	if (mediatek_bo_get_prime_fd(bo) < 0)
 		return MAP_FAILED;
-	}
 
 	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
 		    gem_map.offset);
 	if (addr == MAP_FAILED)
-		goto out_close_prime_fd;
+		return MAP_FAILED;
 
 	vma->length = bo->meta.total_size;
 
-	priv = calloc(1, sizeof(*priv));
-	if (!priv)
-		goto out_unmap_addr;
+	/*
+	 * GEM mappings are write-combined, which makes reading them slow. RenderScript reads
+	 * from a cached shadow copy instead; writes go straight to the buffer.
+	 */
+	if ((bo->meta.use_flags & BO_USE_RENDERSCRIPT) && (map_flags & BO_MAP_READ)) {
+		priv = calloc(1, sizeof(*priv));
+		if (!priv)
+			goto out_unmap_addr;
 
-	if (bo->meta.use_flags & BO_USE_RENDERSCRIPT) {
 		priv->cached_addr = calloc(1, bo->meta.total_size);
 		if (!priv->cached_addr)
 			goto out_free_priv;
 
 		priv->gem_addr = addr;
+		vma->priv = priv;
 		addr = priv->cached_addr;
 	}
 
-	priv->prime_fd = prime_fd;
-	vma->priv = priv;
-
 	return addr;
 
 out_free_priv:
 	free(priv);
 out_unmap_addr:
 	munmap(addr, bo->meta.total_size);
-out_close_prime_fd:
-	close(prime_fd);
 	return MAP_FAILED;
 }
 
@@ -326,12 +408,8 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 	if (vma->priv) {
 		struct mediatek_private_map_data *priv = vma->priv;
 
-		if (priv->cached_addr) {
-			vma->addr = priv->gem_addr;
-			free(priv->cached_addr);
-		}
-
-		close(priv->prime_fd);
+		vma->addr = priv->gem_addr;
+		free(priv->cached_addr);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -342,25 +420,18 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
+	int prime_fd, ret;
 
-	if (priv) {
-		struct pollfd fds = {
-			.fd = priv->prime_fd,
-		};
-
-		if (mapping->vma->map_flags & BO_MAP_WRITE)
-			fds.events |= POLLOUT;
+	prime_fd = mediatek_bo_get_prime_fd(bo);
+	if (prime_fd < 0)
+		return prime_fd;
 
-		if (mapping->vma->map_flags & BO_MAP_READ)
-			fds.events |= POLLIN;
+	ret = drv_dmabuf_sync(prime_fd, mapping->vma->map_flags, true);
+	if (ret)
+		return ret;
 
-		poll(&fds, 1, -1);
-		if (fds.revents != fds.events)
-			drv_loge("poll prime_fd failed\n");
-
-		if (priv->cached_addr)
-			memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
-	}
+	if (priv)
+		memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
 
 	return 0;
 }
@@ -368,10 +439,17 @@ static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 static int mediatek_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
-	if (priv && priv->cached_addr && (mapping->vma->map_flags & BO_MAP_WRITE))
+	int prime_fd;
+
+	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
 		memcpy(priv->gem_addr, priv->cached_addr, bo->meta.total_size);
 
-	return 0;
+	/* Also called for read-only mappings, to end the sync their invalidate started. */
+	prime_fd = mediatek_bo_get_prime_fd(bo);
+	if (prime_fd < 0)
+		return prime_fd;
+
+	return drv_dmabuf_sync(prime_fd, mapping->vma->map_flags, false);
 }
 
 static void mediatek_resolve_format_and_use_flags(struct driver *drv, uint32_t format,
@@ -430,11 +508,14 @@ const struct backend backend_mediatek = {
 	.name = "mediatek",
 	.init = mediatek_init,
 	.bo_create = mediatek_bo_create,
+	.bo_compute_layout = mediatek_bo_compute_layout,
 	.bo_create_with_modifiers = mediatek_bo_create_with_modifiers,
+	.bo_release = mediatek_bo_release,
 	.bo_destroy = drv_gem_bo_destroy,
-	.bo_import = drv_prime_bo_import,
+	.bo_import = mediatek_bo_import,
 	.bo_map = mediatek_bo_map,
 	.bo_unmap = mediatek_bo_unmap,
+	.map_is_pure_mmap = true,
 	.bo_invalidate = mediatek_bo_invalidate,
 	.bo_flush = mediatek_bo_flush,
 	.resolve_format_and_use_flags = mediatek_resolve_format_and_use_flags,
@@ -68,6 +68,18 @@ static uint32_t get_ubwc_meta_size(uint32_t width, uint32_t height, uint32_t til
 	return ALIGN(macrotile_width * macrotile_height, PLANE_SIZE_ALIGN);
 }
 
+/* Alignments the venus video codec needs for NV12 and P010 buffers. */
+static const struct layout_constraint layout_constraints[] = {
+	{ .format = DRM_FORMAT_NV12,
+	  .stride_align = VENUS_STRIDE_ALIGN,
+	  .height_align = { VENUS_SCANLINE_ALIGN * 2 },
+	  .size_align = BUFFER_SIZE_ALIGN },
+	{ .format = DRM_FORMAT_P010,
+	  .stride_align = VENUS_STRIDE_ALIGN,
+	  .height_align = { VENUS_SCANLINE_ALIGN * 2 },
+	  .size_align = BUFFER_SIZE_ALIGN },
+};
+
 static unsigned get_pitch_alignment(struct bo *bo)
 {
 	switch (bo->meta.format) {
@@ -99,15 +111,18 @@ static void msm_calculate_layout(struct bo *bo)
 	if (bo->meta.format == DRM_FORMAT_NV12 || bo->meta.format == DRM_FORMAT_P010) {
 		uint32_t y_stride, uv_stride, y_scanline, uv_scanline, y_plane, uv_plane, size,
 		    extra_padding;
+		struct layout_constraint constraint;
+
+		drv_bo_get_layout_constraint(bo, bo->meta.format, &constraint);
 
 		// P010 has the same layout as NV12.  The difference is that each
 		// pixel in P010 takes 2 bytes, while in NV12 each pixel takes 1 byte.
 		if (bo->meta.format == DRM_FORMAT_P010)
 			width *= 2;
 
-		y_stride = ALIGN(width, VENUS_STRIDE_ALIGN);
-		uv_stride = ALIGN(width, VENUS_STRIDE_ALIGN);
-		y_scanline = ALIGN(height, VENUS_SCANLINE_ALIGN * 2);
+		y_stride = ALIGN(width, constraint.stride_align);
+		uv_stride = ALIGN(width, constraint.stride_align);
+		y_scanline = ALIGN(height, constraint.height_align[0]);
 		uv_scanline = ALIGN(DIV_ROUND_UP(height, 2),
 				    VENUS_SCANLINE_ALIGN * (bo->meta.tiling ? 2 : 1));
 		y_plane = y_stride * y_scanline;
@@ -128,7 +143,7 @@ static void msm_calculate_layout(struct bo *bo)
 		bo->meta.offsets[1] = y_plane;
 		bo->meta.strides[1] = uv_stride;
 		size = y_plane + uv_plane + extra_padding;
-		bo->meta.total_size = ALIGN(size, BUFFER_SIZE_ALIGN);
+		bo->meta.total_size = ALIGN(size, constraint.size_align);
 		bo->meta.sizes[1] = bo->meta.total_size - bo->meta.sizes[0];
 	} else {
 		uint32_t stride, alignw, alignh;
@@ -190,6 +205,10 @@ static void msm_add_ubwc_combinations(struct driver *drv, const uint32_t *format
 	}
 }
 
+/* Uses that need the pixel data in memory to be current, which UBWC can't guarantee. */
+#define MSM_UBWC_INCOMPATIBLE_USE_FLAGS                                                            \
+	(BO_USE_RENDERSCRIPT | BO_USE_SW_MASK | BO_USE_LINEAR | BO_USE_FRONT_RENDERING)
+
 /**
  * Check for buggy apps that are known to not support modifiers, to avoid surprising them
  * with a UBWC buffer.
@@ -224,8 +243,10 @@ static int msm_init(struct driver *drv)
 	 * compressed in this case because the UBWC flags/meta data can be out of
 	 * sync with pixel data while the GPU is writing a frame out to memory.
 	 */
-	uint64_t sw_flags =
-	    (BO_USE_RENDERSCRIPT | BO_USE_SW_MASK | BO_USE_LINEAR | BO_USE_FRONT_RENDERING);
+	uint64_t sw_flags = MSM_UBWC_INCOMPATIBLE_USE_FLAGS;
+
+	drv->layout_constraints = layout_constraints;
+	drv->num_layout_constraints = ARRAY_SIZE(layout_constraints);
 
 	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
 			     &LINEAR_METADATA, render_use_flags);
@@ -289,6 +310,13 @@ static int msm_init(struct driver *drv)
 	return 0;
 }
 
+static void msm_bo_layout_for_modifier(struct bo *bo, const uint64_t modifier)
+{
+	bo->meta.tiling = (modifier == DRM_FORMAT_MOD_QCOM_COMPRESSED) ? MSM_UBWC_TILING : 0;
+	msm_calculate_layout(bo);
+	bo->meta.format_modifier = modifier;
+}
+
 static int msm_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
 				      uint32_t format, const uint64_t modifier)
 {
@@ -296,8 +324,7 @@ static int msm_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t he
 	int ret;
 	size_t i;
 
-	bo->meta.tiling = (modifier == DRM_FORMAT_MOD_QCOM_COMPRESSED) ? MSM_UBWC_TILING : 0;
-	msm_calculate_layout(bo);
+	msm_bo_layout_for_modifier(bo, modifier);
 
 	req.flags = MSM_BO_WC | MSM_BO_SCANOUT;
 	req.size = bo->meta.total_size;
@@ -315,12 +342,12 @@ static int msm_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t he
 	for (i = 0; i < bo->meta.num_planes; i++)
 		bo->handles[i].u32 = req.handle;
 
-	bo->meta.format_modifier = modifier;
 	return 0;
 }
 
 static int msm_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
-					uint32_t format, const uint64_t *modifiers, uint32_t count)
+					uint32_t format, uint64_t use_flags,
+					const uint64_t *modifiers, uint32_t count)
 {
 	static const uint64_t modifier_order[] = {
 		DRM_FORMAT_MOD_QCOM_COMPRESSED,
@@ -333,6 +360,11 @@ static int msm_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t
 	if (!bo->drv->compression && modifier == DRM_FORMAT_MOD_QCOM_COMPRESSED)
 		modifier = DRM_FORMAT_MOD_LINEAR;
 
+	if (modifier == DRM_FORMAT_MOD_QCOM_COMPRESSED &&
+	    (use_flags & MSM_UBWC_INCOMPATIBLE_USE_FLAGS) &&
+	    drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_LINEAR))
+		modifier = DRM_FORMAT_MOD_LINEAR;
+
 	return msm_bo_create_for_modifier(bo, width, height, format, modifier);
 }
 
@@ -350,6 +382,18 @@ static int msm_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_
 	return msm_bo_create_for_modifier(bo, width, height, format, combo->metadata.modifier);
 }
 
+static int msm_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				 uint64_t flags)
+{
+	struct combination *combo = drv_get_combination(bo->drv, format, flags);
+
+	if (!combo)
+		return -EINVAL;
+
+	msm_bo_layout_for_modifier(bo, combo->metadata.modifier);
+	return 0;
+}
+
 static void *msm_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -372,10 +416,12 @@ const struct backend backend_msm = {
 	.init = msm_init,
 	.bo_create = msm_bo_create,
 	.bo_create_with_modifiers = msm_bo_create_with_modifiers,
+	.bo_compute_layout = msm_bo_compute_layout,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = drv_prime_bo_import,
 	.bo_map = msm_bo_map,
 	.bo_unmap = drv_bo_munmap,
+	.map_is_pure_mmap = true,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
 };
 #endif /* DRV_MSM */
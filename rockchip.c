@@ -113,16 +113,17 @@ static int rockchip_init(struct driver *drv)
 	return 0;
 }
 
-static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
-					     uint32_t format, const uint64_t *modifiers,
-					     uint32_t count)
+static int rockchip_bo_layout_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
+					     uint32_t format, uint64_t use_flags,
+					     const uint64_t *modifiers, uint32_t count)
 {
-	int ret;
-	size_t plane;
-	struct drm_rockchip_gem_create gem_create = { 0 };
 	uint64_t afbc_modifier;
 
-	if (drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_ROCKCHIP_AFBC))
+	/* AFBC buffers can't be mapped, so CPU and linear uses rule it out when linear works. */
+	if ((use_flags & (BO_USE_SW_MASK | BO_USE_LINEAR)) &&
+	    drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_LINEAR))
+		afbc_modifier = 0;
+	else if (drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_ROCKCHIP_AFBC))
 		afbc_modifier = DRM_FORMAT_MOD_ROCKCHIP_AFBC;
 	else if (drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC))
 		afbc_modifier = DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC;
@@ -169,6 +170,22 @@ static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 		drv_bo_from_format(bo, stride, height, format);
 	}
 
+	return 0;
+}
+
+static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
+					     uint32_t format, uint64_t use_flags,
+					     const uint64_t *modifiers, uint32_t count)
+{
+	int ret;
+	size_t plane;
+	struct drm_rockchip_gem_create gem_create = { 0 };
+
+	ret = rockchip_bo_layout_with_modifiers(bo, width, height, format, use_flags, modifiers,
+						count);
+	if (ret)
+		return ret;
+
 	gem_create.size = bo->meta.total_size;
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_ROCKCHIP_GEM_CREATE, &gem_create);
 
@@ -184,11 +201,39 @@ static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 	return 0;
 }
 
+/*
+ * AFBC has no combinations of its own. It is listed ahead of linear for the four bytes per pixel
+ * formats whenever rockchip_bo_create_with_modifiers() would pick it for buffers up to 2560 wide.
+ */
+static uint32_t rockchip_get_modifiers(struct driver *drv, uint32_t format, uint64_t use_flags,
+				       uint64_t modifiers[DRV_MAX_MODIFIERS])
+{
+	uint32_t count = 0;
+
+	if (drv->compression && !(use_flags & (BO_USE_SW_MASK | BO_USE_LINEAR)) &&
+	    drv_num_planes_from_format(format) == 1 &&
+	    drv_bytes_per_pixel_from_format(format, 0) == 4)
+		modifiers[count++] = DRM_FORMAT_MOD_ROCKCHIP_AFBC;
+
+	if (drv_has_combination_with_modifier(drv, format, use_flags, DRM_FORMAT_MOD_LINEAR))
+		modifiers[count++] = DRM_FORMAT_MOD_LINEAR;
+
+	return count;
+}
+
 static int rockchip_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			      uint64_t use_flags)
 {
 	uint64_t modifiers[] = { DRM_FORMAT_MOD_LINEAR };
-	return rockchip_bo_create_with_modifiers(bo, width, height, format, modifiers,
+	return rockchip_bo_create_with_modifiers(bo, width, height, format, use_flags, modifiers,
+						 ARRAY_SIZE(modifiers));
+}
+
+static int rockchip_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height,
+				      uint32_t format, uint64_t use_flags)
+{
+	uint64_t modifiers[] = { DRM_FORMAT_MOD_LINEAR };
+	return rockchip_bo_layout_with_modifiers(bo, width, height, format, use_flags, modifiers,
 						 ARRAY_SIZE(modifiers));
 }
 
@@ -279,13 +324,16 @@ const struct backend backend_rockchip = {
 	.init = rockchip_init,
 	.bo_create = rockchip_bo_create,
 	.bo_create_with_modifiers = rockchip_bo_create_with_modifiers,
+	.bo_compute_layout = rockchip_bo_compute_layout,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = drv_prime_bo_import,
 	.bo_map = rockchip_bo_map,
 	.bo_unmap = rockchip_bo_unmap,
+	.map_is_pure_mmap = true,
 	.bo_invalidate = rockchip_bo_invalidate,
 	.bo_flush = rockchip_bo_flush,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
+	.get_modifiers = rockchip_get_modifiers,
 };
 
 #endif
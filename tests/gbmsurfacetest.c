@@ -0,0 +1,440 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Exercises the producer and consumer sides of gbm_surface without a GPU. Run it on a kernel
+ * with vkms loaded (modprobe vkms) and sw_sync available in debugfs for the fence tests:
+ *
+ * gbmsurfacetest all [/dev/dri/cardN]
+ *
+ * Please run clang-format on this file after making changes:
+ *
+ * clang-format -style=file -i gbmsurfacetest.c
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+
+#include "gbm.h"
+
+#define ARRAY_SIZE(A) (sizeof(A) / sizeof(*(A)))
+
+#define CHECK(cond)                                                                                \
+	do {                                                                                       \
+		if (!(cond)) {                                                                     \
+			fprintf(stderr, "[  FAILED  ] check in %s() %s:%d\n", __func__, __FILE__,  \
+				__LINE__);                                                         \
+			return 0;                                                                  \
+		}                                                                                  \
+	} while (0)
+
+/* Must match GBM_SURFACE_NUM_BUFFERS in gbm_priv.h. */
+#define NUM_BUFFERS 3
+#define NUM_FRAMES 30
+
+#define WIDTH 64
+#define HEIGHT 64
+#define FORMAT GBM_FORMAT_XRGB8888
+#define USAGE (GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR | GBM_BO_USE_SW_READ_OFTEN |             \
+	       GBM_BO_USE_SW_WRITE_OFTEN)
+
+#define SIGNAL_DELAY_MS 50
+
+/* sw_sync is debugfs only, so its ioctls are not part of the uapi headers. */
+struct sw_sync_create_fence_data {
+	uint32_t value;
+	char name[32];
+	int32_t fence;
+};
+
+#define SW_SYNC_IOC_MAGIC 'W'
+#define SW_SYNC_IOC_CREATE_FENCE _IOWR(SW_SYNC_IOC_MAGIC, 0, struct sw_sync_create_fence_data)
+#define SW_SYNC_IOC_INC _IOW(SW_SYNC_IOC_MAGIC, 1, uint32_t)
+
+struct gbmsurfacetest_context {
+	int fd;
+	struct gbm_device *gbm;
+	/* A fresh sw_sync timeline for every test that needs one. */
+	int timeline;
+	uint32_t timeline_value;
+};
+
+struct gbmsurfacetest {
+	const char *name;
+	int (*run_test)(struct gbmsurfacetest_context *ctx);
+	int needs_sw_sync;
+};
+
+static int open_vkms(const char *path)
+{
+	char name[32];
+	int i;
+
+	if (path)
+		return open(path, O_RDWR | O_CLOEXEC);
+
+	for (i = 0; i < DRM_MAX_MINOR; i++) {
+		drmVersionPtr version;
+		int fd;
+
+		snprintf(name, sizeof(name), DRM_DEV_NAME, DRM_DIR_NAME, i);
+		fd = open(name, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		version = drmGetVersion(fd);
+		if (version && !strcmp(version->name, "vkms")) {
+			drmFreeVersion(version);
+			return fd;
+		}
+
+		if (version)
+			drmFreeVersion(version);
+		close(fd);
+	}
+
+	return -1;
+}
+
+static int create_fence(struct gbmsurfacetest_context *ctx)
+{
+	struct sw_sync_create_fence_data data = { 0 };
+
+	data.value = ++ctx->timeline_value;
+	snprintf(data.name, sizeof(data.name), "gbmsurfacetest");
+	if (ioctl(ctx->timeline, SW_SYNC_IOC_CREATE_FENCE, &data))
+		return -1;
+
+	return data.fence;
+}
+
+/* Signals the oldest fence of the timeline that is still pending. */
+static int signal_fences(struct gbmsurfacetest_context *ctx)
+{
+	uint32_t inc = 1;
+
+	return ioctl(ctx->timeline, SW_SYNC_IOC_INC, &inc);
+}
+
+static int fence_is_signaled(int fence)
+{
+	struct pollfd fds = { fence, POLLIN, 0 };
+
+	return poll(&fds, 1, 0) == 1;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int fill(struct gbm_bo *bo, uint32_t value)
+{
+	uint32_t stride, x, y;
+	void *map_data = NULL;
+	uint8_t *addr;
+
+	addr = gbm_bo_map(bo, 0, 0, WIDTH, HEIGHT, GBM_BO_TRANSFER_WRITE, &stride, &map_data);
+	CHECK(addr && addr != MAP_FAILED);
+
+	for (y = 0; y < HEIGHT; y++)
+		for (x = 0; x < WIDTH; x++)
+			((uint32_t *)(addr + y * stride))[x] = value;
+
+	gbm_bo_unmap(bo, map_data);
+	return 1;
+}
+
+static int verify(struct gbm_bo *bo, uint32_t value)
+{
+	uint32_t stride, x, y;
+	void *map_data = NULL;
+	uint8_t *addr;
+	int ok = 1;
+
+	addr = gbm_bo_map(bo, 0, 0, WIDTH, HEIGHT, GBM_BO_TRANSFER_READ, &stride, &map_data);
+	CHECK(addr && addr != MAP_FAILED);
+
+	for (y = 0; y < HEIGHT && ok; y++)
+		for (x = 0; x < WIDTH && ok; x++)
+			ok = ((uint32_t *)(addr + y * stride))[x] == value;
+
+	gbm_bo_unmap(bo, map_data);
+	CHECK(ok);
+	return 1;
+}
+
+/*
+ * Fills all buffers of the ring, then checks the consumer gets them in queue order with what
+ * the producer wrote, and that every buffer is free again once released.
+ */
+static int test_ring(struct gbmsurfacetest_context *ctx)
+{
+	struct gbm_bo *bos[NUM_BUFFERS];
+	struct gbm_surface *surface;
+	int fence, i, j;
+
+	surface = gbm_surface_create(ctx->gbm, WIDTH, HEIGHT, FORMAT, USAGE);
+	CHECK(surface);
+	CHECK(gbm_surface_has_free_buffers(surface) == NUM_BUFFERS);
+	CHECK(gbm_surface_lock_front_buffer(surface) == NULL);
+
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		bos[i] = gbm_surface_acquire_back_buffer(surface, &fence);
+		CHECK(bos[i]);
+		CHECK(fence == -1);
+		for (j = 0; j < i; j++)
+			CHECK(bos[j] != bos[i]);
+		CHECK(fill(bos[i], 0x10101010 * (i + 1)));
+	}
+
+	CHECK(gbm_surface_has_free_buffers(surface) == 0);
+	CHECK(gbm_surface_acquire_back_buffer(surface, &fence) == NULL);
+
+	/* Queued out of acquire order: the consumer must follow the queue order. */
+	CHECK(gbm_surface_queue_buffer(surface, bos[1]) == 0);
+	CHECK(gbm_surface_queue_buffer(surface, bos[0]) == 0);
+	CHECK(gbm_surface_queue_buffer(surface, bos[2]) == 0);
+
+	CHECK(gbm_surface_lock_front_buffer(surface) == bos[1]);
+	CHECK(verify(bos[1], 0x20202020));
+	CHECK(gbm_surface_lock_front_buffer(surface) == bos[0]);
+	CHECK(verify(bos[0], 0x10101010));
+	CHECK(gbm_surface_lock_front_buffer(surface) == bos[2]);
+	CHECK(verify(bos[2], 0x30303030));
+	CHECK(gbm_surface_lock_front_buffer(surface) == NULL);
+
+	for (i = 0; i < NUM_BUFFERS; i++)
+		gbm_surface_release_buffer(surface, bos[i]);
+
+	CHECK(gbm_surface_has_free_buffers(surface) == NUM_BUFFERS);
+
+	gbm_surface_destroy(surface);
+	return 1;
+}
+
+/* Buffers not in the state an entry point expects are rejected without changing state. */
+static int test_misuse(struct gbmsurfacetest_context *ctx)
+{
+	struct gbm_surface *surface;
+	struct gbm_bo *bo, *other;
+	int fence;
+
+	surface = gbm_surface_create(ctx->gbm, WIDTH, HEIGHT, FORMAT, USAGE);
+	CHECK(surface);
+	other = gbm_bo_create(ctx->gbm, WIDTH, HEIGHT, FORMAT, USAGE);
+	CHECK(other);
+
+	CHECK(gbm_surface_queue_buffer(surface, other) == -EINVAL);
+
+	bo = gbm_surface_acquire_back_buffer(surface, &fence);
+	CHECK(bo);
+	CHECK(gbm_surface_queue_buffer(surface, bo) == 0);
+	CHECK(gbm_surface_queue_buffer(surface, bo) == -EINVAL);
+
+	/* Released before it was locked: still queued. */
+	gbm_surface_release_buffer(surface, bo);
+	CHECK(gbm_surface_has_free_buffers(surface) == NUM_BUFFERS - 1);
+
+	CHECK(gbm_surface_lock_front_buffer(surface) == bo);
+	gbm_surface_release_buffer(surface, bo);
+	CHECK(gbm_surface_has_free_buffers(surface) == NUM_BUFFERS);
+
+	gbm_bo_destroy(other);
+	gbm_surface_destroy(surface);
+	return 1;
+}
+
+/*
+ * Runs NUM_FRAMES frames through the ring like a compositor would: every released buffer
+ * carries a release fence that is still pending when the producer gets the buffer back.
+ */
+static int test_release_fences(struct gbmsurfacetest_context *ctx)
+{
+	struct gbm_surface *surface;
+	struct gbm_bo *back, *front;
+	int fence, frame;
+
+	surface = gbm_surface_create(ctx->gbm, WIDTH, HEIGHT, FORMAT, USAGE);
+	CHECK(surface);
+
+	for (frame = 0; frame < NUM_FRAMES; frame++) {
+		back = gbm_surface_acquire_back_buffer(surface, &fence);
+		CHECK(back);
+
+		/* Buffers only come back once every other buffer had its turn. */
+		if (frame < NUM_BUFFERS) {
+			CHECK(fence == -1);
+		} else {
+			CHECK(fence >= 0);
+			CHECK(!fence_is_signaled(fence));
+			CHECK(signal_fences(ctx) == 0);
+			CHECK(fence_is_signaled(fence));
+			close(fence);
+		}
+
+		CHECK(fill(back, frame));
+		CHECK(gbm_surface_queue_buffer(surface, back) == 0);
+
+		front = gbm_surface_lock_front_buffer(surface);
+		CHECK(front == back);
+		CHECK(verify(front, frame));
+
+		fence = create_fence(ctx);
+		CHECK(fence >= 0);
+		gbm_surface_release_buffer_with_fence(surface, front, fence);
+	}
+
+	gbm_surface_destroy(surface);
+	return 1;
+}
+
+static void *signal_later(void *arg)
+{
+	struct gbmsurfacetest_context *ctx = arg;
+
+	usleep(SIGNAL_DELAY_MS * 1000);
+	signal_fences(ctx);
+	return NULL;
+}
+
+/* Without a release fence out parameter, acquiring waits on the fence itself. */
+static int test_acquire_waits(struct gbmsurfacetest_context *ctx)
+{
+	struct gbm_bo *bos[NUM_BUFFERS], *bo;
+	struct gbm_surface *surface;
+	pthread_t thread;
+	uint64_t start;
+	int fence, i;
+
+	surface = gbm_surface_create(ctx->gbm, WIDTH, HEIGHT, FORMAT, USAGE);
+	CHECK(surface);
+
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		bos[i] = gbm_surface_acquire_back_buffer(surface, NULL);
+		CHECK(bos[i]);
+		CHECK(gbm_surface_queue_buffer(surface, bos[i]) == 0);
+		CHECK(gbm_surface_lock_front_buffer(surface) == bos[i]);
+	}
+
+	/* Only the first buffer is released, with a fence the other thread signals later. */
+	fence = create_fence(ctx);
+	CHECK(fence >= 0);
+	gbm_surface_release_buffer_with_fence(surface, bos[0], fence);
+
+	start = now_ms();
+	CHECK(pthread_create(&thread, NULL, signal_later, ctx) == 0);
+	bo = gbm_surface_acquire_back_buffer(surface, NULL);
+	CHECK(now_ms() - start >= SIGNAL_DELAY_MS / 2);
+	pthread_join(thread, NULL);
+	CHECK(bo == bos[0]);
+
+	CHECK(gbm_surface_queue_buffer(surface, bo) == 0);
+	CHECK(gbm_surface_lock_front_buffer(surface) == bo);
+	for (i = 0; i < NUM_BUFFERS; i++)
+		gbm_surface_release_buffer(surface, bos[i]);
+
+	gbm_surface_destroy(surface);
+	return 1;
+}
+
+static struct gbmsurfacetest tests[] = {
+	{ "ring", test_ring, 0 },
+	{ "misuse", test_misuse, 0 },
+	{ "release_fences", test_release_fences, 1 },
+	{ "acquire_waits", test_acquire_waits, 1 },
+};
+
+static void print_help(const char *argv0)
+{
+	uint32_t i;
+
+	printf("usage: %s <test_name> [device]\n\n", argv0);
+	printf("A valid name test is one the following:\n");
+	for (i = 0; i < ARRAY_SIZE(tests); i++)
+		printf("%s\n", tests[i].name);
+	printf("all\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct gbmsurfacetest_context ctx = { 0 };
+	uint32_t i, num_run = 0;
+	int ret = 0;
+
+	setbuf(stdout, NULL);
+	if (argc < 2 || argc > 3) {
+		print_help(argv[0]);
+		return 0;
+	}
+
+	ctx.fd = open_vkms(argc == 3 ? argv[2] : NULL);
+	if (ctx.fd < 0) {
+		fprintf(stderr, "[  FAILED  ] to open a vkms device.\n");
+		return 1;
+	}
+
+	ctx.gbm = gbm_create_device(ctx.fd);
+	if (!ctx.gbm) {
+		fprintf(stderr, "[  FAILED  ] to create a gbm device.\n");
+		return 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		if (strcmp(tests[i].name, argv[1]) && strcmp("all", argv[1]))
+			continue;
+
+		printf("[ RUN      ] gbmsurfacetest.%s\n", tests[i].name);
+		num_run++;
+
+		/* Every open of sw_sync creates a new timeline, starting at 0. */
+		ctx.timeline = -1;
+		ctx.timeline_value = 0;
+		if (tests[i].needs_sw_sync) {
+			ctx.timeline = open("/sys/kernel/debug/sync/sw_sync", O_RDWR | O_CLOEXEC);
+			if (ctx.timeline < 0) {
+				printf("[  SKIPPED ] gbmsurfacetest.%s: sw_sync not available\n",
+				       tests[i].name);
+				continue;
+			}
+		}
+
+		if (!tests[i].run_test(&ctx)) {
+			fprintf(stderr, "[  FAILED  ] gbmsurfacetest.%s\n", tests[i].name);
+			ret |= 1;
+		} else {
+			printf("[  PASSED  ] gbmsurfacetest.%s\n", tests[i].name);
+		}
+
+		if (ctx.timeline >= 0)
+			close(ctx.timeline);
+	}
+
+	gbm_device_destroy(ctx.gbm);
+	close(ctx.fd);
+
+	if (!num_run)
+		print_help(argv[0]);
+
+	return ret;
+}
@@ -40,13 +40,10 @@ static int vc4_init(struct driver *drv)
 	return drv_modify_linear_combinations(drv);
 }
 
-static int vc4_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
+static int vc4_bo_layout_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
 				      uint32_t format, uint64_t modifier)
 {
-	int ret;
-	size_t plane;
 	uint32_t stride;
-	struct drm_vc4_create_bo bo_create = { 0 };
 
 	switch (modifier) {
 	case DRM_FORMAT_MOD_LINEAR:
@@ -64,7 +61,19 @@ static int vc4_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t he
 	 */
 	stride = drv_stride_from_format(format, width, 0);
 	stride = ALIGN(stride, 64);
-	drv_bo_from_format(bo, stride, height, format);
+	return drv_bo_from_format(bo, stride, height, format);
+}
+
+static int vc4_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
+				      uint32_t format, uint64_t modifier)
+{
+	int ret;
+	size_t plane;
+	struct drm_vc4_create_bo bo_create = { 0 };
+
+	ret = vc4_bo_layout_for_modifier(bo, width, height, format, modifier);
+	if (ret)
+		return ret;
 
 	bo_create.size = bo->meta.total_size;
 
@@ -92,8 +101,21 @@ static int vc4_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_
 	return vc4_bo_create_for_modifier(bo, width, height, format, combo->metadata.modifier);
 }
 
+static int vc4_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				 uint64_t use_flags)
+{
+	struct combination *combo;
+
+	combo = drv_get_combination(bo->drv, format, use_flags);
+	if (!combo)
+		return -EINVAL;
+
+	return vc4_bo_layout_for_modifier(bo, width, height, format, combo->metadata.modifier);
+}
+
 static int vc4_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
-					uint32_t format, const uint64_t *modifiers, uint32_t count)
+					uint32_t format, uint64_t use_flags,
+					const uint64_t *modifiers, uint32_t count)
 {
 	static const uint64_t modifier_order[] = {
 		DRM_FORMAT_MOD_LINEAR,
@@ -127,10 +149,12 @@ const struct backend backend_vc4 = {
 	.init = vc4_init,
 	.bo_create = vc4_bo_create,
 	.bo_create_with_modifiers = vc4_bo_create_with_modifiers,
+	.bo_compute_layout = vc4_bo_compute_layout,
 	.bo_import = drv_prime_bo_import,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_map = vc4_bo_map,
 	.bo_unmap = drv_bo_munmap,
+	.map_is_pure_mmap = true,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
 };
 
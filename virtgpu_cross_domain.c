@@ -5,8 +5,15 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <xf86drm.h>
 
 #include "drv_helpers.h"
@@ -32,11 +39,87 @@ static const uint32_t texture_only_formats[] = { DRM_FORMAT_R8, DRM_FORMAT_NV12,
 
 extern struct virtgpu_param params[];
 
+#define CROSS_DOMAIN_METADATA_BUCKETS 64
+
+#define CROSS_DOMAIN_SHARED_CACHE_MAGIC 0x4d474358
+#define CROSS_DOMAIN_SHARED_CACHE_VERSION 1
+#define CROSS_DOMAIN_SHARED_CACHE_ENTRIES 256
+
+/*
+ * Allocation keys common enough on Android to be worth querying before the first allocation:
+ * display-sized window buffers and camera preview/record streams.
+ */
+static const struct {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+} prefetch_keys[] = {
+	{ 1920, 1080, DRM_FORMAT_ABGR8888, BO_USE_SCANOUT | BO_USE_TEXTURE | BO_USE_RENDERING },
+	{ 1080, 1920, DRM_FORMAT_ABGR8888, BO_USE_SCANOUT | BO_USE_TEXTURE | BO_USE_RENDERING },
+	{ 2560, 1600, DRM_FORMAT_ABGR8888, BO_USE_SCANOUT | BO_USE_TEXTURE | BO_USE_RENDERING },
+	{ 1280, 720, DRM_FORMAT_ABGR8888, BO_USE_SCANOUT | BO_USE_TEXTURE | BO_USE_RENDERING },
+	{ 640, 480, DRM_FORMAT_NV12, BO_USE_CAMERA_WRITE | BO_USE_TEXTURE },
+	{ 1280, 720, DRM_FORMAT_NV12, BO_USE_CAMERA_WRITE | BO_USE_TEXTURE },
+	{ 1920, 1080, DRM_FORMAT_NV12, BO_USE_CAMERA_WRITE | BO_USE_TEXTURE },
+};
+
+/*
+ * Layout of the file named by MINIGBM_CROSS_DOMAIN_CACHE.  It records which allocation keys have
+ * needed an image requirements query anywhere in the guest, so that every process can prefetch
+ * them at init.  Only keys are shared: the blob_id in a host reply is only valid in the context
+ * that issued the query.
+ *
+ * The file is published atomically with rename() and is versioned against the host's cross
+ * domain capabilities.  Its only writer is the owner of the directory it lives in, normally the
+ * allocator service; files owned by anyone else, or writable by anyone else, are ignored.  The
+ * writer serializes with flock(); readers scan it lock-free, since a key is fully written before
+ * its |valid| word is set and entries are never modified afterwards.
+ */
+struct cross_domain_shared_key {
+	uint32_t valid;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+};
+
+struct cross_domain_shared_cache {
+	uint32_t magic;
+	uint32_t version;
+	struct CrossDomainCapabilities caps;
+	uint32_t num_keys;
+	uint32_t pad;
+	struct cross_domain_shared_key keys[CROSS_DOMAIN_SHARED_CACHE_ENTRIES];
+};
+
+/*
+ * A metadata cache entry.  While |pending| is set, the thread that inserted the entry is querying
+ * the host and any other thread asking for the same key waits on |metadata_cache_cond| instead of
+ * issuing a duplicate query.  |refcount| counts the cache itself plus every thread that still
+ * holds a pointer to the entry.
+ */
+struct cross_domain_metadata_entry {
+	struct bo_metadata metadata;
+	struct cross_domain_metadata_entry *next;
+	uint32_t refcount;
+	bool pending;
+	int ret;
+};
+
 struct cross_domain_private {
 	uint32_t ring_handle;
 	void *ring_addr;
-	struct drv_array *metadata_cache;
+	pthread_mutex_t ring_lock;
+	struct cross_domain_metadata_entry *metadata_cache[CROSS_DOMAIN_METADATA_BUCKETS];
 	pthread_mutex_t metadata_cache_lock;
+	pthread_cond_t metadata_cache_cond;
+	struct cross_domain_shared_cache *shared_cache;
+	int shared_cache_fd;
+	bool shared_cache_writable;
+	pthread_t prefetch_thread;
+	bool prefetch_running;
+	bool prefetch_stop;
 };
 
 static void cross_domain_release_private(struct driver *drv)
@@ -45,6 +128,17 @@ static void cross_domain_release_private(struct driver *drv)
 	struct cross_domain_private *priv = drv->priv;
 	struct drm_gem_close gem_close = { 0 };
 
+	if (priv->prefetch_running) {
+		__atomic_store_n(&priv->prefetch_stop, true, __ATOMIC_RELAXED);
+		pthread_join(priv->prefetch_thread, NULL);
+	}
+
+	if (priv->shared_cache)
+		munmap(priv->shared_cache, sizeof(*priv->shared_cache));
+
+	if (priv->shared_cache_fd >= 0)
+		close(priv->shared_cache_fd);
+
 	if (priv->ring_addr != MAP_FAILED)
 		munmap(priv->ring_addr, PAGE_SIZE);
 
@@ -58,10 +152,18 @@ static void cross_domain_release_private(struct driver *drv)
 		}
 	}
 
-	if (priv->metadata_cache)
-		drv_array_destroy(priv->metadata_cache);
+	for (uint32_t i = 0; i < CROSS_DOMAIN_METADATA_BUCKETS; i++) {
+		struct cross_domain_metadata_entry *entry = priv->metadata_cache[i];
+		while (entry) {
+			struct cross_domain_metadata_entry *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
 
+	pthread_cond_destroy(&priv->metadata_cache_cond);
 	pthread_mutex_destroy(&priv->metadata_cache_lock);
+	pthread_mutex_destroy(&priv->ring_lock);
 
 	free(priv);
 }
@@ -105,6 +207,27 @@ static void add_combinations(struct driver *drv)
 	drv_modify_linear_combinations(drv);
 }
 
+static int cross_domain_wait_fence(int fence_fd)
+{
+	int ret;
+	struct pollfd fds = {
+		.fd = fence_fd,
+		.events = POLLIN,
+	};
+
+	do {
+		ret = poll(&fds, 1, -1);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	if (ret < 0)
+		return -errno;
+
+	if (fds.revents & (POLLERR | POLLNVAL))
+		return -EINVAL;
+
+	return 0;
+}
+
 static int cross_domain_submit_cmd(struct driver *drv, uint32_t *cmd, uint32_t cmd_size, bool wait)
 {
 	int ret;
@@ -114,8 +237,14 @@ static int cross_domain_submit_cmd(struct driver *drv, uint32_t *cmd, uint32_t c
 
 	exec.command = (uint64_t)&cmd[0];
 	exec.size = cmd_size;
+	exec.fence_fd = -1;
 	if (wait) {
-		exec.flags = VIRTGPU_EXECBUF_RING_IDX;
+		/*
+		 * Ask for an out-fence on the query ring's timeline so completion can be waited
+		 * for with poll() instead of spinning on DRM_IOCTL_VIRTGPU_WAIT.
+		 */
+		exec.flags = VIRTGPU_EXECBUF_RING_IDX | VIRTGPU_EXECBUF_FENCE_FD_OUT;
+		exec.fence_ctx_idx = CROSS_DOMAIN_QUERY_RING;
 		exec.bo_handles = (uint64_t)&priv->ring_handle;
 		exec.num_bo_handles = 1;
 	}
@@ -126,6 +255,19 @@ static int cross_domain_submit_cmd(struct driver *drv, uint32_t *cmd, uint32_t c
 		return -EINVAL;
 	}
 
+	if (!wait)
+		return 0;
+
+	if (exec.fence_fd >= 0) {
+		ret = cross_domain_wait_fence(exec.fence_fd);
+		close(exec.fence_fd);
+		if (!ret)
+			return 0;
+
+		drv_loge("waiting on cross domain fence failed with %s\n", strerror(-ret));
+	}
+
+	/* Fall back to waiting on the ring resource itself. */
 	ret = -EAGAIN;
 	while (ret == -EAGAIN) {
 		wait_3d.handle = priv->ring_handle;
@@ -148,26 +290,251 @@ static bool metadata_equal(struct bo_metadata *current, struct bo_metadata *cach
 	return false;
 }
 
-static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *metadata)
+static uint32_t metadata_hash(struct bo_metadata *metadata)
+{
+	uint64_t key = metadata->use_flags;
+
+	key = key * 31 + metadata->format;
+	key = key * 31 + metadata->width;
+	key = key * 31 + metadata->height;
+	key ^= key >> 29;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 32;
+
+	return (uint32_t)(key % CROSS_DOMAIN_METADATA_BUCKETS);
+}
+
+/* Called with metadata_cache_lock held. */
+static void metadata_entry_unref(struct cross_domain_metadata_entry *entry)
+{
+	if (--entry->refcount == 0)
+		free(entry);
+}
+
+/* Called with metadata_cache_lock held. */
+static void metadata_entry_unlink(struct cross_domain_private *priv,
+				  struct cross_domain_metadata_entry *entry)
+{
+	struct cross_domain_metadata_entry **link =
+	    &priv->metadata_cache[metadata_hash(&entry->metadata)];
+
+	while (*link && *link != entry)
+		link = &(*link)->next;
+
+	if (*link) {
+		*link = entry->next;
+		metadata_entry_unref(entry);
+	}
+}
+
+static bool cross_domain_shared_cache_valid(struct cross_domain_shared_cache *cache,
+					    struct CrossDomainCapabilities *caps)
+{
+	return cache->magic == CROSS_DOMAIN_SHARED_CACHE_MAGIC &&
+	       cache->version == CROSS_DOMAIN_SHARED_CACHE_VERSION &&
+	       !memcmp(&cache->caps, caps, sizeof(*caps)) &&
+	       cache->num_keys <= CROSS_DOMAIN_SHARED_CACHE_ENTRIES;
+}
+
+/* Looks up the uid allowed to write the cache at |path|: the owner of its directory. */
+static int cross_domain_shared_cache_writer(const char *path, uid_t *uid)
+{
+	char dir[PATH_MAX];
+	char *slash;
+	struct stat st;
+
+	if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir))
+		return -ENAMETOOLONG;
+
+	slash = strrchr(dir, '/');
+	if (!slash)
+		snprintf(dir, sizeof(dir), ".");
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	if (stat(dir, &st))
+		return -errno;
+
+	*uid = st.st_uid;
+	return 0;
+}
+
+/* Writes an empty cache for |caps| next to |path| and renames it into place. */
+static int cross_domain_shared_cache_publish(const char *path, struct CrossDomainCapabilities *caps)
+{
+	int fd, ret = 0;
+	char tmp_path[PATH_MAX];
+	struct cross_domain_shared_cache *cache;
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid()) >= (int)sizeof(tmp_path))
+		return -ENAMETOOLONG;
+
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	/* Readable by every process regardless of the writer's umask, writable only by it. */
+	if (fchmod(fd, 0644)) {
+		ret = -errno;
+		goto out_unlink;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		ret = -ENOMEM;
+		goto out_unlink;
+	}
+
+	cache->magic = CROSS_DOMAIN_SHARED_CACHE_MAGIC;
+	cache->version = CROSS_DOMAIN_SHARED_CACHE_VERSION;
+	memcpy(&cache->caps, caps, sizeof(*caps));
+
+	if (write(fd, cache, sizeof(*cache)) != (ssize_t)sizeof(*cache))
+		ret = errno ? -errno : -EIO;
+
+	free(cache);
+	if (!ret && rename(tmp_path, path))
+		ret = -errno;
+
+out_unlink:
+	if (ret)
+		unlink(tmp_path);
+	close(fd);
+	return ret;
+}
+
+static int cross_domain_shared_cache_map(struct cross_domain_private *priv, const char *path,
+					 uid_t writer)
+{
+	int fd;
+	struct stat st;
+	bool writable = geteuid() == writer;
+	void *addr;
+
+	fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -errno;
+	}
+
+	/* Don't trust keys that anyone but the writer could have planted. */
+	if (!S_ISREG(st.st_mode) || st.st_uid != writer || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		close(fd);
+		return -EPERM;
+	}
+
+	if (st.st_size != (off_t)sizeof(*priv->shared_cache)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	addr = mmap(0, sizeof(*priv->shared_cache), PROT_READ | (writable ? PROT_WRITE : 0),
+		    MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return -errno;
+	}
+
+	priv->shared_cache = addr;
+	priv->shared_cache_fd = fd;
+	priv->shared_cache_writable = writable;
+	return 0;
+}
+
+static void cross_domain_shared_cache_unmap(struct cross_domain_private *priv)
+{
+	munmap(priv->shared_cache, sizeof(*priv->shared_cache));
+	close(priv->shared_cache_fd);
+	priv->shared_cache = NULL;
+	priv->shared_cache_fd = -1;
+	priv->shared_cache_writable = false;
+}
+
+static void cross_domain_shared_cache_init(struct cross_domain_private *priv,
+					   struct CrossDomainCapabilities *caps)
+{
+	int ret;
+	uid_t writer;
+	const char *path = getenv("MINIGBM_CROSS_DOMAIN_CACHE");
+
+	if (!path || !path[0])
+		return;
+
+	ret = cross_domain_shared_cache_writer(path, &writer);
+	if (!ret)
+		ret = cross_domain_shared_cache_map(priv, path, writer);
+
+	if (!ret && !cross_domain_shared_cache_valid(priv->shared_cache, caps)) {
+		/* Written against another host, or an older layout. */
+		cross_domain_shared_cache_unmap(priv);
+		ret = -ESTALE;
+	}
+
+	/* Only the writer may (re)create the file; everyone else waits for it to do so. */
+	if ((ret == -ENOENT || ret == -ESTALE || ret == -EINVAL) && geteuid() == writer) {
+		if (!cross_domain_shared_cache_publish(path, caps))
+			ret = cross_domain_shared_cache_map(priv, path, writer);
+	}
+
+	if (!ret && !cross_domain_shared_cache_valid(priv->shared_cache, caps))
+		cross_domain_shared_cache_unmap(priv);
+	else if (ret)
+		drv_logi("cross domain shared cache %s unavailable: %s\n", path, strerror(-ret));
+}
+
+static bool shared_key_equal(struct cross_domain_shared_key *key, struct bo_metadata *metadata)
+{
+	return key->width == metadata->width && key->height == metadata->height &&
+	       key->format == metadata->format && key->use_flags == metadata->use_flags;
+}
+
+static void cross_domain_shared_cache_record(struct cross_domain_private *priv,
+					     struct bo_metadata *metadata)
+{
+	uint32_t i, num_keys;
+	struct cross_domain_shared_cache *cache = priv->shared_cache;
+	struct cross_domain_shared_key *key;
+
+	if (!cache || !priv->shared_cache_writable)
+		return;
+
+	if (flock(priv->shared_cache_fd, LOCK_EX))
+		return;
+
+	num_keys = __atomic_load_n(&cache->num_keys, __ATOMIC_ACQUIRE);
+	for (i = 0; i < num_keys; i++)
+		if (shared_key_equal(&cache->keys[i], metadata))
+			goto out_unlock;
+
+	if (num_keys == CROSS_DOMAIN_SHARED_CACHE_ENTRIES)
+		goto out_unlock;
+
+	key = &cache->keys[num_keys];
+	key->width = metadata->width;
+	key->height = metadata->height;
+	key->format = metadata->format;
+	key->use_flags = metadata->use_flags;
+	__atomic_store_n(&key->valid, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&cache->num_keys, num_keys + 1, __ATOMIC_RELEASE);
+
+out_unlock:
+	flock(priv->shared_cache_fd, LOCK_UN);
+}
+
+static int cross_domain_get_image_requirements(struct driver *drv, struct bo_metadata *metadata)
 {
-	int ret = 0;
-	struct bo_metadata *cached_data = NULL;
+	int ret;
 	struct cross_domain_private *priv = drv->priv;
 	struct CrossDomainGetImageRequirements cmd_get_reqs;
 	uint32_t *addr = (uint32_t *)priv->ring_addr;
 	uint32_t plane, remaining_size;
 
 	memset(&cmd_get_reqs, 0, sizeof(cmd_get_reqs));
-	pthread_mutex_lock(&priv->metadata_cache_lock);
-	for (uint32_t i = 0; i < drv_array_size(priv->metadata_cache); i++) {
-		cached_data = (struct bo_metadata *)drv_array_at_idx(priv->metadata_cache, i);
-		if (!metadata_equal(metadata, cached_data))
-			continue;
-
-		memcpy(metadata, cached_data, sizeof(*cached_data));
-		goto out_unlock;
-	}
-
 	cmd_get_reqs.hdr.cmd = CROSS_DOMAIN_CMD_GET_IMAGE_REQUIREMENTS;
 	cmd_get_reqs.hdr.cmd_size = sizeof(struct CrossDomainGetImageRequirements);
 
@@ -177,17 +544,14 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 	    (metadata->format == DRM_FORMAT_YVU420_ANDROID) ? DRM_FORMAT_YVU420 : metadata->format;
 	cmd_get_reqs.flags = metadata->use_flags;
 
-	/*
-	 * It is possible to avoid blocking other bo_create() calls by unlocking before
-	 * cross_domain_submit_cmd() and re-locking afterwards.  However, that would require
-	 * another scan of the metadata cache before drv_array_append in case two bo_create() calls
-	 * do the same metadata query.  Until cross_domain functionality is more widely tested,
-	 * leave this optimization out for now.
-	 */
+	/* The reply is written to the shared ring page, so only one query may be in flight. */
+	pthread_mutex_lock(&priv->ring_lock);
 	ret = cross_domain_submit_cmd(drv, (uint32_t *)&cmd_get_reqs, cmd_get_reqs.hdr.cmd_size,
 				      true);
-	if (ret < 0)
-		goto out_unlock;
+	if (ret < 0) {
+		pthread_mutex_unlock(&priv->ring_lock);
+		return ret;
+	}
 
 	memcpy(&metadata->strides, &addr[0], 4 * sizeof(uint32_t));
 	memcpy(&metadata->offsets, &addr[4], 4 * sizeof(uint32_t));
@@ -198,6 +562,7 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 	metadata->map_info = addr[13];
 	metadata->memory_idx = addr[14];
 	metadata->physical_device_idx = addr[15];
+	pthread_mutex_unlock(&priv->ring_lock);
 
 	/* Detect buffers, which have no particular stride alignment requirement: */
 	if ((metadata->height == 1) && (metadata->format == DRM_FORMAT_R8)) {
@@ -213,13 +578,157 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 	}
 
 	metadata->sizes[plane - 1] = remaining_size;
-	drv_array_append(priv->metadata_cache, metadata);
+	return 0;
+}
 
-out_unlock:
+static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *metadata)
+{
+	int ret;
+	struct cross_domain_private *priv = drv->priv;
+	struct cross_domain_metadata_entry *entry;
+	uint32_t bucket = metadata_hash(metadata);
+
+	pthread_mutex_lock(&priv->metadata_cache_lock);
+	for (entry = priv->metadata_cache[bucket]; entry; entry = entry->next)
+		if (metadata_equal(metadata, &entry->metadata))
+			break;
+
+	if (entry) {
+		/* Another thread is already asking the host for this key; wait for its answer. */
+		entry->refcount++;
+		while (entry->pending)
+			pthread_cond_wait(&priv->metadata_cache_cond, &priv->metadata_cache_lock);
+
+		ret = entry->ret;
+		if (!ret)
+			memcpy(metadata, &entry->metadata, sizeof(*metadata));
+
+		metadata_entry_unref(entry);
+		pthread_mutex_unlock(&priv->metadata_cache_lock);
+		return ret;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		pthread_mutex_unlock(&priv->metadata_cache_lock);
+		return -ENOMEM;
+	}
+
+	memcpy(&entry->metadata, metadata, sizeof(*metadata));
+	entry->pending = true;
+	entry->refcount = 2;
+	entry->next = priv->metadata_cache[bucket];
+	priv->metadata_cache[bucket] = entry;
+	pthread_mutex_unlock(&priv->metadata_cache_lock);
+
+	/* Other bo_create() calls proceed while the host round-trip is in progress. */
+	ret = cross_domain_get_image_requirements(drv, metadata);
+	if (!ret)
+		cross_domain_shared_cache_record(priv, metadata);
+
+	pthread_mutex_lock(&priv->metadata_cache_lock);
+	entry->pending = false;
+	entry->ret = ret;
+	if (ret)
+		metadata_entry_unlink(priv, entry);
+	else
+		memcpy(&entry->metadata, metadata, sizeof(*metadata));
+
+	pthread_cond_broadcast(&priv->metadata_cache_cond);
+	metadata_entry_unref(entry);
 	pthread_mutex_unlock(&priv->metadata_cache_lock);
 	return ret;
 }
 
+static void cross_domain_prefetch_key(struct driver *drv, uint32_t width, uint32_t height,
+				      uint32_t format, uint64_t use_flags)
+{
+	struct bo_metadata metadata = { 0 };
+
+	metadata.width = width;
+	metadata.height = height;
+	metadata.format = format;
+	metadata.use_flags = use_flags;
+	metadata.num_planes = drv_num_planes_from_format(format);
+	if (!metadata.num_planes)
+		return;
+
+	/* Failures are not interesting here; the allocation itself will retry and report. */
+	cross_domain_metadata_query(drv, &metadata);
+}
+
+static bool is_prefetch_key(const struct cross_domain_shared_key *key)
+{
+	for (uint32_t i = 0; i < ARRAY_SIZE(prefetch_keys); i++)
+		if (key->width == prefetch_keys[i].width && key->height == prefetch_keys[i].height &&
+		    key->format == prefetch_keys[i].format &&
+		    key->use_flags == prefetch_keys[i].use_flags)
+			return true;
+
+	return false;
+}
+
+/*
+ * Returns whether the shared cache names any key beyond the built-in ones.  The built-in keys
+ * alone don't justify a prefetch thread in every process; they are queried on first use.
+ */
+static bool cross_domain_shared_cache_has_keys(struct cross_domain_shared_cache *cache)
+{
+	uint32_t i, num_keys;
+
+	num_keys = __atomic_load_n(&cache->num_keys, __ATOMIC_ACQUIRE);
+	for (i = 0; i < num_keys && i < CROSS_DOMAIN_SHARED_CACHE_ENTRIES; i++) {
+		struct cross_domain_shared_key key;
+
+		if (!__atomic_load_n(&cache->keys[i].valid, __ATOMIC_ACQUIRE))
+			continue;
+
+		memcpy(&key, &cache->keys[i], sizeof(key));
+		if (!is_prefetch_key(&key))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Warms the metadata cache off the init path.  An allocation racing with the prefetch of the
+ * same key simply waits on the in-flight query.
+ */
+static void *cross_domain_prefetch(void *arg)
+{
+	struct driver *drv = arg;
+	struct cross_domain_private *priv = drv->priv;
+	struct cross_domain_shared_cache *cache = priv->shared_cache;
+	uint32_t i, num_keys;
+
+	for (i = 0; i < ARRAY_SIZE(prefetch_keys); i++) {
+		if (__atomic_load_n(&priv->prefetch_stop, __ATOMIC_RELAXED))
+			return NULL;
+
+		cross_domain_prefetch_key(drv, prefetch_keys[i].width, prefetch_keys[i].height,
+					  prefetch_keys[i].format, prefetch_keys[i].use_flags);
+	}
+
+	num_keys = __atomic_load_n(&cache->num_keys, __ATOMIC_ACQUIRE);
+	for (i = 0; i < num_keys && i < CROSS_DOMAIN_SHARED_CACHE_ENTRIES; i++) {
+		struct cross_domain_shared_key key;
+
+		if (__atomic_load_n(&priv->prefetch_stop, __ATOMIC_RELAXED))
+			break;
+
+		if (!__atomic_load_n(&cache->keys[i].valid, __ATOMIC_ACQUIRE))
+			continue;
+
+		memcpy(&key, &cache->keys[i], sizeof(key));
+		if (!is_prefetch_key(&key))
+			cross_domain_prefetch_key(drv, key.width, key.height, key.format,
+						  key.use_flags);
+	}
+
+	return NULL;
+}
+
 /* Fill out metadata for guest buffers, used only for CPU access: */
 void cross_domain_get_emulated_metadata(struct bo_metadata *metadata)
 {
@@ -273,13 +782,23 @@ static int cross_domain_init(struct driver *drv)
 		return ret;
 	}
 
-	priv->metadata_cache = drv_array_init(sizeof(struct bo_metadata));
-	if (!priv->metadata_cache) {
-		ret = -ENOMEM;
-		goto free_private;
+	ret = pthread_cond_init(&priv->metadata_cache_cond, NULL);
+	if (ret) {
+		pthread_mutex_destroy(&priv->metadata_cache_lock);
+		free(priv);
+		return ret;
+	}
+
+	ret = pthread_mutex_init(&priv->ring_lock, NULL);
+	if (ret) {
+		pthread_cond_destroy(&priv->metadata_cache_cond);
+		pthread_mutex_destroy(&priv->metadata_cache_lock);
+		free(priv);
+		return ret;
 	}
 
 	priv->ring_addr = MAP_FAILED;
+	priv->shared_cache_fd = -1;
 	drv->priv = priv;
 
 	args.cap_set_id = CAPSET_CROSS_DOMAIN;
@@ -354,6 +873,13 @@ static int cross_domain_init(struct driver *drv)
 
 	// minigbm bookkeeping
 	add_combinations(drv);
+
+	// Prefetch image requirements when the shared cache knows keys this process hasn't seen.
+	cross_domain_shared_cache_init(priv, &cross_domain_caps);
+	if (priv->shared_cache && cross_domain_shared_cache_has_keys(priv->shared_cache))
+		priv->prefetch_running =
+		    !pthread_create(&priv->prefetch_thread, NULL, cross_domain_prefetch, drv);
+
 	return 0;
 
 free_private:
@@ -444,5 +970,6 @@ const struct backend virtgpu_cross_domain = {
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_map = cross_domain_bo_map,
 	.bo_unmap = drv_bo_munmap,
+	.map_is_pure_mmap = true,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
 };
@@ -37,6 +37,10 @@
 #define VIRGL_2D_MAX_TEXTURE_2D_SIZE                                                               \
 	MIN(ANGLE_ON_SWIFTSHADER_MAX_TEXTURE_2D_SIZE, MESA_LLVMPIPE_MAX_TEXTURE_2D_SIZE)
 
+// Upper bounds of the stride and height alignment host allocators apply to YUV blob resources.
+#define VIRGL_BLOB_STRIDE_ALIGN 256
+#define VIRGL_BLOB_HEIGHT_ALIGN 64
+
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
 						  DRM_FORMAT_RGB565, DRM_FORMAT_XBGR8888,
 						  DRM_FORMAT_XRGB8888 };
@@ -59,9 +63,16 @@ struct virgl_priv {
 	int caps_is_v2;
 	union virgl_caps caps;
 	int host_gbm_enabled;
+	// Whether the kernel reports host-allocated layouts through extended resource info.
+	bool has_host_layout;
 	atomic_int next_blob_id;
 };
 
+struct virgl_bo_priv {
+	/* Host resource handle, which transfer commands are encoded against. */
+	uint32_t res_handle;
+};
+
 static uint32_t translate_format(uint32_t drm_fourcc)
 {
 	switch (drm_fourcc) {
@@ -226,6 +237,12 @@ struct virtio_transfers_params {
 	struct rectangle xfer_boxes[DRV_MAX_PLANES];
 };
 
+struct virgl_transfers {
+	struct virtio_transfers_params params;
+	uint32_t offset;
+	uint32_t level;
+};
+
 static void virgl_get_emulated_transfers_params(const struct bo *bo,
 						const struct rectangle *transfer_box,
 						struct virtio_transfers_params *xfer_params)
@@ -446,6 +463,20 @@ static uint32_t compute_virgl_bind_flags(uint64_t use_flags)
 	return bind;
 }
 
+static int virgl_bo_init_priv(struct bo *bo, uint32_t res_handle)
+{
+	struct virgl_bo_priv *priv;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		return -ENOMEM;
+
+	priv->res_handle = res_handle;
+	bo->priv = priv;
+
+	return 0;
+}
+
 static int virgl_3d_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			      uint64_t use_flags)
 {
@@ -504,7 +535,11 @@ static int virgl_3d_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 	for (uint32_t plane = 0; plane < bo->meta.num_planes; plane++)
 		bo->handles[plane].u32 = res_create.bo_handle;
 
-	return 0;
+	ret = virgl_bo_init_priv(bo, res_create.res_handle);
+	if (ret)
+		drv_gem_bo_destroy(bo);
+
+	return ret;
 }
 
 static void *virgl_3d_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
@@ -586,6 +621,40 @@ static void virgl_init_params_and_caps(struct driver *drv)
 	}
 }
 
+/*
+ * Kernels without the extended DRM_IOCTL_VIRTGPU_RESOURCE_INFO_CROS leave the strides empty. Probe
+ * that once with a scratch resource rather than on every blob allocation.
+ */
+static bool virgl_probe_host_layout(struct driver *drv)
+{
+	int ret;
+	struct drm_virtgpu_resource_create res_create = { 0 };
+	struct drm_virtgpu_resource_info_cros res_info = { 0 };
+	struct drm_gem_close gem_close = { 0 };
+
+	res_create.target = PIPE_TEXTURE_2D;
+	res_create.format = translate_format(DRM_FORMAT_ABGR8888);
+	res_create.bind = compute_virgl_bind_flags(BO_USE_TEXTURE);
+	res_create.width = 1;
+	res_create.height = 1;
+	res_create.depth = 1;
+	res_create.array_size = 1;
+	res_create.size = PAGE_SIZE;
+
+	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE, &res_create);
+	if (ret)
+		return false;
+
+	res_info.bo_handle = res_create.bo_handle;
+	res_info.type = VIRTGPU_RESOURCE_INFO_TYPE_EXTENDED;
+	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO_CROS, &res_info);
+
+	gem_close.handle = res_create.bo_handle;
+	drmIoctl(drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+
+	return !ret && res_info.strides[0];
+}
+
 static int virgl_init(struct driver *drv)
 {
 	struct virgl_priv *priv;
@@ -598,6 +667,10 @@ static int virgl_init(struct driver *drv)
 
 	virgl_init_params_and_caps(drv);
 
+	if (priv->host_gbm_enabled && params[param_resource_blob].value &&
+	    params[param_host_visible].value)
+		priv->has_host_layout = virgl_probe_host_layout(drv);
+
 	if (params[param_3d].value) {
 		/* This doesn't mean host can scanout everything, it just means host
 		 * hypervisor can show it. */
@@ -679,14 +752,58 @@ static void virgl_close(struct driver *drv)
 	drv->priv = NULL;
 }
 
+/*
+ * Replaces the guest-computed layout of a blob resource with the one the host allocated, so that
+ * guest mappings of the blob can be accessed directly.
+ */
+static int virgl_blob_query_layout(struct bo *bo, bool strict_layout)
+{
+	int ret;
+	uint32_t plane;
+	uint64_t plane_end;
+	struct drm_virtgpu_resource_info_cros res_info = { 0 };
+
+	res_info.bo_handle = bo->handles[0].u32;
+	res_info.type = VIRTGPU_RESOURCE_INFO_TYPE_EXTENDED;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO_CROS, &res_info);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	// should_use_blob() only lets formats through without the extended info if the guest
+	// layout can be trusted, i.e. the host lays them out exactly as the guest does.
+	if (!res_info.strides[0])
+		return strict_layout ? 0 : -ENOTSUP;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		bo->meta.strides[plane] = res_info.strides[plane];
+		bo->meta.offsets[plane] = res_info.offsets[plane];
+		bo->meta.sizes[plane] = drv_size_from_format(
+		    bo->meta.format, res_info.strides[plane], bo->meta.height, plane);
+
+		plane_end = (uint64_t)bo->meta.offsets[plane] + bo->meta.sizes[plane];
+		if (plane_end > bo->meta.total_size) {
+			drv_loge("host layout of plane %u exceeds blob size %llu\n", plane,
+				 (unsigned long long)bo->meta.total_size);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 static int virgl_bo_create_blob(struct driver *drv, struct bo *bo)
 {
 	int ret;
 	uint32_t stride;
+	uint32_t aligned_height;
 	uint32_t cur_blob_id;
 	uint32_t cmd[VIRGL_PIPE_RES_CREATE_SIZE + 1] = { 0 };
 	struct drm_virtgpu_resource_create_blob drm_rc_blob = { 0 };
 	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
+	// Formats with strictly defined strides match the host layout as-is.
+	bool strict_layout = bo->meta.format == DRM_FORMAT_R8;
 
 	uint32_t blob_flags = VIRTGPU_BLOB_FLAG_USE_SHAREABLE;
 	if (bo->meta.use_flags & (BO_USE_SW_MASK | BO_USE_GPU_DATA_BUFFER))
@@ -698,7 +815,18 @@ static int virgl_bo_create_blob(struct driver *drv, struct bo *bo)
 
 	cur_blob_id = atomic_fetch_add(&priv->next_blob_id, 1);
 	stride = drv_stride_from_format(bo->meta.format, bo->meta.width, 0);
-	drv_bo_from_format(bo, stride, bo->meta.height, bo->meta.format);
+	aligned_height = bo->meta.height;
+
+	// The blob size is fixed at creation while the host picks its own layout, so reserve
+	// room for the stride and height alignment host video allocators commonly apply. RGB
+	// layouts are used as computed; a host layout that doesn't fit falls back to 3D.
+	if (drv_num_planes_from_format(bo->meta.format) > 1) {
+		stride = ALIGN(stride, VIRGL_BLOB_STRIDE_ALIGN);
+		if (bo->meta.format != DRM_FORMAT_YVU420_ANDROID)
+			aligned_height = ALIGN(aligned_height, VIRGL_BLOB_HEIGHT_ALIGN);
+	}
+
+	drv_bo_from_format(bo, stride, aligned_height, bo->meta.format);
 	bo->meta.total_size = ALIGN(bo->meta.total_size, PAGE_SIZE);
 	bo->meta.tiling = blob_flags;
 
@@ -727,18 +855,19 @@ static int virgl_bo_create_blob(struct driver *drv, struct bo *bo)
 	for (uint32_t plane = 0; plane < bo->meta.num_planes; plane++)
 		bo->handles[plane].u32 = drm_rc_blob.bo_handle;
 
-	return 0;
+	ret = virgl_blob_query_layout(bo, strict_layout);
+	if (!ret)
+		ret = virgl_bo_init_priv(bo, drm_rc_blob.res_handle);
+	if (ret)
+		drv_gem_bo_destroy(bo);
+
+	return ret;
 }
 
 static bool should_use_blob(struct driver *drv, uint32_t format, uint64_t use_flags)
 {
 	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
 
-	// TODO(gurchetansingh): remove once all minigbm users are blob-safe
-#ifndef VIRTIO_GPU_NEXT
-	return false;
-#endif
-
 	// Only use blob when host gbm is available
 	if (!priv->host_gbm_enabled)
 		return false;
@@ -749,15 +878,30 @@ static bool should_use_blob(struct driver *drv, uint32_t format, uint64_t use_fl
 			   BO_USE_NON_GPU_HW | BO_USE_GPU_DATA_BUFFER)))
 		return false;
 
-	switch (format) {
-	case DRM_FORMAT_R8:
-		// Formats with strictly defined strides are supported
+	// R8 has a strictly defined stride, so its guest layout matches the host's.
+	if (format == DRM_FORMAT_R8)
 		return true;
-	case DRM_FORMAT_YVU420_ANDROID:
+
+	// Without a host layout to read back, other formats would be allocated as a blob, found
+	// unusable, and allocated again as a 3D resource.
+	if (!priv->has_host_layout)
+		return false;
+
+	// The layout of these formats is queried from the host once the blob is created, so they
+	// can be mapped directly into the guest, including for SW access.
+	switch (format) {
 	case DRM_FORMAT_NV12:
-		// Knowing buffer metadata at buffer creation isn't yet supported, so buffers
-		// can't be properly mapped into the guest.
-		return (use_flags & BO_USE_SW_MASK) == 0;
+	case DRM_FORMAT_P010:
+	case DRM_FORMAT_YVU420:
+	case DRM_FORMAT_YVU420_ANDROID:
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_RGB565:
+	case DRM_FORMAT_ABGR2101010:
+	case DRM_FORMAT_ABGR16161616F:
+		return true;
 	default:
 		return false;
 	}
@@ -766,9 +910,18 @@ static bool should_use_blob(struct driver *drv, uint32_t format, uint64_t use_fl
 static int virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			   uint64_t use_flags)
 {
+	int ret;
+
 	if (params[param_resource_blob].value && params[param_host_visible].value &&
-	    should_use_blob(bo->drv, format, use_flags))
-		return virgl_bo_create_blob(bo->drv, bo);
+	    should_use_blob(bo->drv, format, use_flags)) {
+		ret = virgl_bo_create_blob(bo->drv, bo);
+		if (!ret || !params[param_3d].value)
+			return ret;
+
+		// The host layout couldn't be mapped into the guest; use a transfer-based resource.
+		drv_logi("Falling back to a non-blob resource: %d\n", ret);
+		bo->meta.tiling = 0;
+	}
 
 	if (params[param_3d].value)
 		return virgl_3d_bo_create(bo, width, height, format, use_flags);
@@ -777,11 +930,9 @@ static int virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint3
 }
 
 static int virgl_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
-					  uint32_t format, const uint64_t *modifiers,
-					  uint32_t count)
+					  uint32_t format, uint64_t use_flags,
+					  const uint64_t *modifiers, uint32_t count)
 {
-	uint64_t use_flags = 0;
-
 	for (uint32_t i = 0; i < count; i++) {
 		if (modifiers[i] == DRM_FORMAT_MOD_LINEAR) {
 			return virgl_bo_create(bo, width, height, format, use_flags);
@@ -791,6 +942,47 @@ static int virgl_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_
 	return -EINVAL;
 }
 
+static int virgl_get_res_handle(struct bo *bo, uint32_t *res_handle)
+{
+	int ret;
+	struct drm_virtgpu_resource_info res_info = { 0 };
+
+	res_info.bo_handle = bo->handles[0].u32;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &res_info);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	*res_handle = res_info.res_handle;
+	return 0;
+}
+
+static int virgl_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+	uint32_t res_handle;
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret || !params[param_3d].value)
+		return ret;
+
+	// The GEM handle may be shared with other imports, so a failure here must not close it.
+	// Transfers look the resource handle up again instead.
+	if (!virgl_get_res_handle(bo, &res_handle))
+		virgl_bo_init_priv(bo, res_handle);
+
+	return 0;
+}
+
+static int virgl_bo_release(struct bo *bo)
+{
+	free(bo->priv);
+	bo->priv = NULL;
+
+	return 0;
+}
+
 static int virgl_bo_destroy(struct bo *bo)
 {
 	if (params[param_3d].value)
@@ -807,14 +999,117 @@ static void *virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 		return drv_dumb_bo_map(bo, vma, plane, map_flags);
 }
 
+static void virgl_get_transfers(struct bo *bo, struct mapping *mapping, bool use_level_stride,
+				struct virgl_transfers *xfers)
+{
+	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
+
+	xfers->offset = 0;
+	xfers->level = 0;
+
+	if (mapping->rect.x || mapping->rect.y) {
+		/*
+		 * virglrenderer uses the box parameters and assumes that offset == 0 for planar
+		 * images
+		 */
+		if (bo->meta.num_planes == 1) {
+			xfers->offset =
+			    (bo->meta.strides[0] * mapping->rect.y) +
+			    drv_bytes_per_pixel_from_format(bo->meta.format, 0) * mapping->rect.x;
+		}
+	}
+
+	// Unfortunately, the kernel doesn't actually pass the guest layer_stride and
+	// guest stride to the host (compare virgl.h and virtgpu_drm.h). For gbm based
+	// resources, we can work around this by using the level field to pass the stride
+	// to virglrenderer's gbm transfer code.
+	// TODO(b/145993887): Send also stride when the patches are landed
+	if (use_level_stride && priv->host_gbm_enabled)
+		xfers->level = bo->meta.strides[0];
+
+	if (virgl_supports_combination_natively(bo->drv, bo->meta.format, bo->meta.use_flags)) {
+		xfers->params.xfers_needed = 1;
+		xfers->params.xfer_boxes[0] = mapping->rect;
+	} else {
+		assert(virgl_supports_combination_through_emulation(bo->drv, bo->meta.format,
+								    bo->meta.use_flags));
+
+		virgl_get_emulated_transfers_params(bo, &mapping->rect, &xfers->params);
+	}
+}
+
+static bool virgl_supports_batched_transfers(struct driver *drv)
+{
+	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
+
+	return priv->caps_is_v2 && (priv->caps.v2.capability_bits & VIRGL_CAP_TRANSFER);
+}
+
+/*
+ * Encodes all transfer boxes as VIRGL_CCMD_TRANSFER3D commands and submits them in a single
+ * execbuffer, instead of one DRM_IOCTL_VIRTGPU_TRANSFER_{TO,FROM}_HOST per box. If out_fence
+ * is non-NULL, it receives a sync_file that signals once the host has processed the transfers.
+ */
+static int virgl_submit_transfers(struct bo *bo, uint32_t bo_handle, uint32_t direction,
+				  const struct virgl_transfers *xfers, int *out_fence)
+{
+	int ret;
+	size_t i;
+	uint32_t cmd[DRV_MAX_PLANES * (VIRGL_TRANSFER3D_SIZE + 1)] = { 0 };
+	uint32_t *xfer_cmd;
+	uint32_t res_handle;
+	struct virgl_bo_priv *priv = bo->priv;
+	struct drm_virtgpu_execbuffer exec = { 0 };
+
+	if (priv) {
+		res_handle = priv->res_handle;
+	} else {
+		ret = virgl_get_res_handle(bo, &res_handle);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < xfers->params.xfers_needed; i++) {
+		xfer_cmd = &cmd[i * (VIRGL_TRANSFER3D_SIZE + 1)];
+		xfer_cmd[0] = VIRGL_CMD0(VIRGL_CCMD_TRANSFER3D, 0, VIRGL_TRANSFER3D_SIZE);
+		xfer_cmd[VIRGL_RESOURCE_IW_RES_HANDLE] = res_handle;
+		xfer_cmd[VIRGL_RESOURCE_IW_LEVEL] = xfers->level;
+		xfer_cmd[VIRGL_RESOURCE_IW_X] = xfers->params.xfer_boxes[i].x;
+		xfer_cmd[VIRGL_RESOURCE_IW_Y] = xfers->params.xfer_boxes[i].y;
+		xfer_cmd[VIRGL_RESOURCE_IW_W] = xfers->params.xfer_boxes[i].width;
+		xfer_cmd[VIRGL_RESOURCE_IW_H] = xfers->params.xfer_boxes[i].height;
+		xfer_cmd[VIRGL_RESOURCE_IW_D] = 1;
+		xfer_cmd[VIRGL_TRANSFER3D_DATA_OFFSET] = xfers->offset;
+		xfer_cmd[VIRGL_TRANSFER3D_DIRECTION] = direction;
+	}
+
+	exec.command = (uint64_t)&cmd[0];
+	exec.size = xfers->params.xfers_needed * (VIRGL_TRANSFER3D_SIZE + 1) * sizeof(uint32_t);
+	exec.bo_handles = (uint64_t)&bo_handle;
+	exec.num_bo_handles = 1;
+	exec.fence_fd = -1;
+	if (out_fence)
+		exec.flags = VIRTGPU_EXECBUF_FENCE_FD_OUT;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exec);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_EXECBUFFER failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	if (out_fence)
+		*out_fence = exec.fence_fd;
+
+	return 0;
+}
+
 static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
 	size_t i;
 	struct drm_virtgpu_3d_transfer_from_host xfer = { 0 };
 	struct drm_virtgpu_3d_wait waitcmd = { 0 };
-	struct virtio_transfers_params xfer_params;
-	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
+	struct virgl_transfers xfers;
 	uint64_t host_write_flags;
 
 	if (!params[param_3d].value)
@@ -835,60 +1130,37 @@ static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	if (params[param_resource_blob].value && (bo->meta.tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE))
 		return 0;
 
-	xfer.bo_handle = mapping->vma->handle;
+	// Resources with BO_USE_RENDERING don't rely on virglrenderer's gbm transfer code.
+	virgl_get_transfers(bo, mapping, (bo->meta.use_flags & BO_USE_RENDERING) == 0, &xfers);
 
-	if (mapping->rect.x || mapping->rect.y) {
-		/*
-		 * virglrenderer uses the box parameters and assumes that offset == 0 for planar
-		 * images
-		 */
-		if (bo->meta.num_planes == 1) {
-			xfer.offset =
-			    (bo->meta.strides[0] * mapping->rect.y) +
-			    drv_bytes_per_pixel_from_format(bo->meta.format, 0) * mapping->rect.x;
-		}
-	}
-
-	if ((bo->meta.use_flags & BO_USE_RENDERING) == 0) {
-		// Unfortunately, the kernel doesn't actually pass the guest layer_stride
-		// and guest stride to the host (compare virgl.h and virtgpu_drm.h).
-		// For gbm based resources, we can work around this by using the level field
-		// to pass the stride to virglrenderer's gbm transfer code. However, we need
-		// to avoid doing this for resources which don't rely on that transfer code,
-		// which is resources with the BO_USE_RENDERING flag set.
-		// TODO(b/145993887): Send also stride when the patches are landed
-		if (priv->host_gbm_enabled)
-			xfer.level = bo->meta.strides[0];
-	}
-
-	if (virgl_supports_combination_natively(bo->drv, bo->meta.format, bo->meta.use_flags)) {
-		xfer_params.xfers_needed = 1;
-		xfer_params.xfer_boxes[0] = mapping->rect;
+	if (virgl_supports_batched_transfers(bo->drv)) {
+		ret = virgl_submit_transfers(bo, mapping->vma->handle, VIRGL_TRANSFER_FROM_HOST,
+					     &xfers, NULL);
+		if (ret)
+			return ret;
 	} else {
-		assert(virgl_supports_combination_through_emulation(bo->drv, bo->meta.format,
-								    bo->meta.use_flags));
-
-		virgl_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
-	}
-
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
-		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n",
-				 strerror(errno));
-			return -errno;
+		xfer.bo_handle = mapping->vma->handle;
+		xfer.offset = xfers.offset;
+		xfer.level = xfers.level;
+
+		for (i = 0; i < xfers.params.xfers_needed; i++) {
+			xfer.box.x = xfers.params.xfer_boxes[i].x;
+			xfer.box.y = xfers.params.xfer_boxes[i].y;
+			xfer.box.w = xfers.params.xfer_boxes[i].width;
+			xfer.box.h = xfers.params.xfer_boxes[i].height;
+			xfer.box.d = 1;
+
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
+			if (ret) {
+				drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n",
+					 strerror(errno));
+				return -errno;
+			}
 		}
 	}
 
 	// The transfer needs to complete before invalidate returns so that any host changes
 	// are visible and to ensure the host doesn't overwrite subsequent guest changes.
-	// TODO(b/136733358): Support returning fences from transfers
 	waitcmd.handle = mapping->vma->handle;
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
 	if (ret) {
@@ -899,14 +1171,15 @@ static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
-static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
+static int virgl_bo_flush_with_fence(struct bo *bo, struct mapping *mapping, int *out_fence)
 {
 	int ret;
 	size_t i;
 	struct drm_virtgpu_3d_transfer_to_host xfer = { 0 };
 	struct drm_virtgpu_3d_wait waitcmd = { 0 };
-	struct virtio_transfers_params xfer_params;
-	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
+	struct virgl_transfers xfers;
+	bool needs_wait;
+	int fence = -1;
 
 	if (!params[param_3d].value)
 		return 0;
@@ -917,56 +1190,46 @@ static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
 	if (params[param_resource_blob].value && (bo->meta.tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE))
 		return 0;
 
-	xfer.bo_handle = mapping->vma->handle;
+	// If the buffer is only accessed by the host GPU, then the flush is ordered
+	// with subsequent commands. However, if other host hardware can access the
+	// buffer, the transfer must complete before that hardware reads it.
+	needs_wait = bo->meta.use_flags & BO_USE_NON_GPU_HW;
 
-	if (mapping->rect.x || mapping->rect.y) {
-		/*
-		 * virglrenderer uses the box parameters and assumes that offset == 0 for planar
-		 * images
-		 */
-		if (bo->meta.num_planes == 1) {
-			xfer.offset =
-			    (bo->meta.strides[0] * mapping->rect.y) +
-			    drv_bytes_per_pixel_from_format(bo->meta.format, 0) * mapping->rect.x;
-		}
-	}
+	virgl_get_transfers(bo, mapping, true, &xfers);
 
-	// Unfortunately, the kernel doesn't actually pass the guest layer_stride and
-	// guest stride to the host (compare virgl.h and virtgpu_drm.h). We can use
-	// the level to work around this.
-	if (priv->host_gbm_enabled)
-		xfer.level = bo->meta.strides[0];
+	if (virgl_supports_batched_transfers(bo->drv)) {
+		ret = virgl_submit_transfers(bo, mapping->vma->handle, VIRGL_TRANSFER_TO_HOST,
+					     &xfers, needs_wait && out_fence ? &fence : NULL);
+		if (ret)
+			return ret;
 
-	if (virgl_supports_combination_natively(bo->drv, bo->meta.format, bo->meta.use_flags)) {
-		xfer_params.xfers_needed = 1;
-		xfer_params.xfer_boxes[0] = mapping->rect;
+		// Hand the completion fence to the caller rather than blocking on it.
+		if (fence >= 0) {
+			*out_fence = fence;
+			return 0;
+		}
 	} else {
-		assert(virgl_supports_combination_through_emulation(bo->drv, bo->meta.format,
-								    bo->meta.use_flags));
-
-		virgl_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
-	}
-
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
-		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
-				 strerror(errno));
-			return -errno;
+		xfer.bo_handle = mapping->vma->handle;
+		xfer.offset = xfers.offset;
+		xfer.level = xfers.level;
+
+		for (i = 0; i < xfers.params.xfers_needed; i++) {
+			xfer.box.x = xfers.params.xfer_boxes[i].x;
+			xfer.box.y = xfers.params.xfer_boxes[i].y;
+			xfer.box.w = xfers.params.xfer_boxes[i].width;
+			xfer.box.h = xfers.params.xfer_boxes[i].height;
+			xfer.box.d = 1;
+
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
+			if (ret) {
+				drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
+					 strerror(errno));
+				return -errno;
+			}
 		}
 	}
 
-	// If the buffer is only accessed by the host GPU, then the flush is ordered
-	// with subsequent commands. However, if other host hardware can access the
-	// buffer, we need to wait for the transfer to complete for consistency.
-	// TODO(b/136733358): Support returning fences from transfers
-	if (bo->meta.use_flags & BO_USE_NON_GPU_HW) {
+	if (needs_wait) {
 		waitcmd.handle = mapping->vma->handle;
 
 		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
@@ -979,6 +1242,11 @@ static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
+static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	return virgl_bo_flush_with_fence(bo, mapping, NULL);
+}
+
 static void virgl_3d_resolve_format_and_use_flags(struct driver *drv, uint32_t format,
 						  uint64_t use_flags, uint32_t *out_format,
 						  uint64_t *out_use_flags)
@@ -1116,12 +1384,15 @@ const struct backend virtgpu_virgl = { .name = "virtgpu_virgl",
 				       .close = virgl_close,
 				       .bo_create = virgl_bo_create,
 				       .bo_create_with_modifiers = virgl_bo_create_with_modifiers,
+				       .bo_release = virgl_bo_release,
 				       .bo_destroy = virgl_bo_destroy,
-				       .bo_import = drv_prime_bo_import,
+				       .bo_import = virgl_bo_import,
 				       .bo_map = virgl_bo_map,
 				       .bo_unmap = drv_bo_munmap,
+				       .map_is_pure_mmap = true,
 				       .bo_invalidate = virgl_bo_invalidate,
 				       .bo_flush = virgl_bo_flush,
+				       .bo_flush_with_fence = virgl_bo_flush_with_fence,
 				       .resolve_format_and_use_flags =
 					   virgl_resolve_format_and_use_flags,
 				       .resource_info = virgl_resource_info,